@@ -0,0 +1,128 @@
+/*
+    IIPImage Server - Streaming Box Filter
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _BOXFILTER_H
+#define _BOXFILTER_H
+
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+
+
+/// Streaming box filter for reducing interleaved image data by an integer factor
+/** Used to generate virtual resolutions for images which do not hold enough resolution
+    levels themselves. Rows are added one at a time as they are decoded, so that the
+    full size data never needs to be held in memory. Each output pixel is the mean of the
+    block of input pixels it covers, with partial blocks at the right and bottom edges
+    averaged over the pixels available. Rows are first summed vertically into a single row
+    of column sums, a contiguous loop which the compiler can vectorize, and each completed
+    block of rows is then summed horizontally once.
+ */
+template <class T> class BoxFilter {
+
+ private:
+
+  /// Input width in pixels
+  unsigned int width;
+
+  /// Number of interleaved channels
+  unsigned int channels;
+
+  /// Reduction factor
+  unsigned int factor;
+
+  /// Output width and height in pixels
+  unsigned int out_width, out_height;
+
+  /// Column sums for our current block of rows
+  std::vector<uint32_t> sums;
+
+  /// Number of rows summed into our current block
+  unsigned int rows;
+
+  /// Output buffer
+  T* out;
+
+  /// Next output row
+  unsigned int out_row;
+
+
+  /// Write out our current block of rows
+  void emit(){
+    if( rows == 0 ) return;
+    if( out_row < out_height ){
+      T* o = out + (size_t) out_row * out_width * channels;
+      for( unsigned int x=0; x<out_width; x++ ){
+	unsigned int start = x * factor;
+	unsigned int end = ( start + factor < width ) ? start + factor : width;
+	uint64_t n = (uint64_t) ( end - start ) * rows;
+	for( unsigned int k=0; k<channels; k++ ){
+	  uint64_t total = 0;
+	  for( unsigned int i=start; i<end; i++ ) total += sums[i*channels + k];
+	  o[x*channels + k] = (T) ( ( total + n/2 ) / n );
+	}
+      }
+      out_row++;
+    }
+    sums.assign( sums.size(), 0 );
+    rows = 0;
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param w input width in pixels
+      @param h output height in pixels
+      @param c number of interleaved channels
+      @param f reduction factor
+      @param o output buffer of at least ceil(w/f) x h pixels
+   */
+  BoxFilter( unsigned int w, unsigned int h, unsigned int c, unsigned int f, T* o ) :
+    width( w ), channels( c ), factor( f ? f : 1 ), out_height( h ), sums( (size_t) w * c, 0 ),
+    rows( 0 ), out( o ), out_row( 0 ) {
+    out_width = ( width + factor - 1 ) / factor;
+  };
+
+
+  /// Add a row of input data
+  /** @param row interleaved row of width x channels samples */
+  void addRow( const T* row ){
+    const unsigned int n = width * channels;
+    uint32_t* s = &sums[0];
+    for( unsigned int i=0; i<n; i++ ) s[i] += row[i];
+    if( ++rows == factor ) this->emit();
+  }
+
+
+  /// Write out any remaining partial block of rows at the bottom edge
+  void finish(){ this->emit(); };
+
+
+  /// Return the output width in pixels
+  unsigned int getOutputWidth(){ return out_width; };
+
+};
+
+
+#endif
@@ -26,6 +26,9 @@
 
 //#define CHUNKED 1
 
+// Height in pixels of the strips in which we compress and send our output
+#define CVT_STRIP_HEIGHT 128
+
 using namespace std;
 
 
@@ -77,9 +80,6 @@ void CVT::send( Session* session ){
   }
 
 
-  // Data length
-  int len;
-
   // Set up our final image sizes and if we have a region defined,
   // calculate our viewport
   unsigned int resampled_width, resampled_height;
@@ -205,183 +205,358 @@ void CVT::send( Session* session ){
 
     // Insert the histogram into our image cache
     const string key = (*session->image)->getImagePath();
-    imageCacheMapType::iterator i = session->imageCache->find(key);
-    if( i != session->imageCache->end() ) (i->second).histogram = (*session->image)->histogram;
+    session->imageCache->setHistogram( key, (*session->image)->histogram );
   }
 
 
 
-  // Retrieve image region
-  RawTile complete_image = tilemanager.getRegion( requested_res,
-						  session->view->xangle, session->view->yangle,
-						  session->view->getLayers(),
-						  view_left, view_top, view_width, view_height );
+  // Bit depth of our decoded data, where 1 bit data is unpacked to 8 bits
+  unsigned int bpc = (*session->image)->getNumBitsPerPixel();
+  if( bpc == 1 ) bpc = 8;
 
+  // Only use our floating point pipeline if necessary
+  bool float_processing = ( bpc > 8 || session->view->floatProcessing() );
 
+  // Make a copy of our max and min as we may change these
+  vector <float> min = (*session->image)->min;
+  vector <float> max = (*session->image)->max;
+
+  // Change our image max and min if we have asked for a contrast stretch
+  if( float_processing && session->view->contrast == -1 ){
+
+    // Find first non-zero bin in histogram
+    unsigned int n0 = 0;
+    while( (*session->image)->histogram[n0] == 0 ) ++n0;
+
+    // Find highest bin
+    unsigned int n1 = (*session->image)->histogram.size() - 1;
+    while( (*session->image)->histogram[n1] == 0 ) --n1;
+
+    // Histogram has been calculated using 8 bits, so scale up to native bit depth
+    if( bpc > 8 && (*session->image)->getSampleType() == FIXEDPOINT ){
+      n0 = n0 << (bpc-8);
+      n1 = n1 << (bpc-8);
+    }
+
+    min.assign( bpc, (float)n0 );
+    max.assign( bpc, (float)n1 );
+
+    // Reset our contrast
+    session->view->contrast = 1.0;
 
-  // Convert CIELAB to sRGB
-  if( (*session->image)->getColourSpace() == CIELAB ){
-    if( session->loglevel >= 5 ) function_timer.start();
-    session->processor->LAB2sRGB( complete_image );
     if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Converting from CIELAB->sRGB in "
-			  << function_timer.getTime() << " microseconds" << endl;
+      *(session->logfile) << "CVT :: Applying contrast stretch for image range of "
+			  << n0 << " - " << n1 << endl;
     }
   }
 
 
-  // Only use our floating point pipeline if necessary
-  if( complete_image.bpc > 8 || session->view->floatProcessing() ){
+  // Set the physical output resolution for this particular view and zoom level
+  float dpi_x = (*session->image)->dpi_x * (float) im_width / (float) (*session->image)->getImageWidth();
+  float dpi_y = (*session->image)->dpi_y * (float) im_height / (float) (*session->image)->getImageHeight();
+  compressor->setResolution( dpi_x, dpi_y, (*session->image)->dpi_units );
+  if( session->loglevel >= 5 ){
+    *(session->logfile) << "CVT :: Setting physical resolution of this view to " <<  dpi_x << " x " << dpi_y
+			<< ( ((*session->image)->dpi_units==1) ? " pixels/inch" : " pixels/cm" ) << endl;
+  }
 
+  // Set ICC profile if of a reasonable size
+  if( session->view->embedICC() && ((*session->image)->getMetadata("icc").size()>0) ){
+    if( (*session->image)->getMetadata("icc").size() < 65536 ){
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: Embedding ICC profile with size "
+			    << (*session->image)->getMetadata("icc").size() << " bytes" << endl;
+      }
+      compressor->setICCProfile( (*session->image)->getMetadata("icc") );
+    }
+    else{
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: ICC profile with size "
+			    << (*session->image)->getMetadata("icc").size() << " bytes is too large: Not embedding" << endl;
+      }
+    }
+  }
+
+  // Add XMP metadata if this exists
+  if( (*session->image)->getMetadata("xmp").size() > 0 ){
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Embedding XMP metadata with size "
+			  << (*session->image)->getMetadata("xmp").size() << " bytes" << endl;
+    }
+    compressor->setXMPMetadata( (*session->image)->getMetadata("xmp") );
+  }
+
+
+  // Buffer for our compressed strips, allocated once we know our number of output channels
+  vector <unsigned char> output;
 
-    // Make a copy of our max and min as we may change these
-    vector <float> min = (*session->image)->min;
-    vector <float> max = (*session->image)->max;
+  // Our resize interpolation method - bilinear by default
+  unsigned int interpolation = Environment::getInterpolation();
+  bool resize = (view_width!=resampled_width) || (view_height!=resampled_height);
 
-    // Change our image max and min if we have asked for a contrast stretch
-    if( session->view->contrast == -1 ){
+  // Large regions are streamed out in bands each holding a row of tiles, so that only one band
+  // is held in memory at a time. Rotation and vertical flipping need the whole region, however
+  unsigned int band_height = (*session->image)->getTileHeight();
+  bool streaming = ( band_height > 0 && view_height > band_height &&
+		     session->view->getRotation() == 0.0 && session->view->flip != 2 );
 
-      // Find first non-zero bin in histogram
-      unsigned int n0 = 0;
-      while( (*session->image)->histogram[n0] == 0 ) ++n0;
 
-      // Find highest bin
-      unsigned int n1 = (*session->image)->histogram.size() - 1;
-      while( (*session->image)->histogram[n1] == 0 ) --n1;
+  if( streaming ){
 
-      // Histogram has been calculated using 8 bits, so scale up to native bit depth
-      if( complete_image.bpc > 8 && complete_image.sampleType == FIXEDPOINT ){
-	n0 = n0 << (complete_image.bpc-8);
-	n1 = n1 << (complete_image.bpc-8);
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Streaming region in bands of up to " << band_height << " rows" << endl;
+    }
+
+    // Last row of our previous band, which bilinear interpolation may still need
+    vector <unsigned char> carry;
+
+    // Next output row to produce
+    unsigned int next = 0;
+
+    for( unsigned int b0=0, b1; b0<view_height; b0=b1 ){
+
+      // Align our bands with the rows of tiles in the image
+      b1 = ( (view_top+b0)/band_height + 1 ) * band_height - view_top;
+      if( b1 > view_height ) b1 = view_height;
+
+      if( session->loglevel >= 4 ){
+	*(session->logfile) << "CVT :: Processing band of rows " << b0 << " to " << b1-1 << endl;
       }
 
-      min.assign( complete_image.bpc, (float)n0 );
-      max.assign( complete_image.bpc, (float)n1 );
+      RawTile band = tilemanager.getRegion( requested_res,
+					    session->view->xangle, session->view->yangle,
+					    session->view->getLayers(),
+					    view_left, view_top+b0, view_width, b1-b0 );
 
-      // Reset our contrast
-      session->view->contrast = 1.0;
+      this->applyTransforms( band, min, max, float_processing );
 
-      if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Applying contrast stretch for image range of "
-			    << n0 << " - " << n1 << endl;
+      if( resize ){
+	session->processor->resample_band( band, b0, view_height, resampled_width, resampled_height,
+					   interpolation, next, carry );
       }
-    }
 
+      if( band.height == 0 ) continue;
 
-    // Apply normalization and perform float conversion
-    {
-      if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->normalize( complete_image, max, min );
-      if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Converting to floating point and normalizing in "
-			    << function_timer.getTime() << " microseconds" << endl;
+      this->finalize( band );
+
+      // Send our header once we have our first band
+      if( output.empty() ){
+	this->sendHeader( compressor, band, resampled_height );
+	output.resize( resampled_width*band.channels*CVT_STRIP_HEIGHT + 65536 );
       }
+
+      this->sendStrips( compressor, band, &output[0] );
     }
 
+  }
+  else{
+
+    // Retrieve image region
+    RawTile complete_image = tilemanager.getRegion( requested_res,
+						    session->view->xangle, session->view->yangle,
+						    session->view->getLayers(),
+						    view_left, view_top, view_width, view_height );
+
+    this->applyTransforms( complete_image, min, max, float_processing );
+
 
-    // Apply hill shading if requested
-    if( session->view->shaded ){
+    // Resize our image as requested. Use the interpolation method requested in the server configuration.
+    //  - Use bilinear interpolation by default
+    if( resize ){
+
+      string interpolation_type;
       if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->shade( complete_image, session->view->shade[0], session->view->shade[1] );
+
+      switch( interpolation ){
+       case 0:
+	interpolation_type = "nearest neighbour";
+	session->processor->interpolate_nearestneighbour( complete_image, resampled_width, resampled_height );
+	break;
+       default:
+	interpolation_type = "bilinear";
+	session->processor->interpolate_bilinear( complete_image, resampled_width, resampled_height );
+	break;
+      }
+
       if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Applying hill-shading in " << function_timer.getTime() << " microseconds" << endl;
+	*(session->logfile) << "CVT :: Resizing using " << interpolation_type << " interpolation in "
+			    << function_timer.getTime() << " microseconds" << endl;
       }
     }
 
 
-    // Apply color twist if requested
-    if( session->view->ctw.size() ){
+    this->finalize( complete_image );
+
+
+    // Apply flip
+    if( session->view->flip == 2 ){
+
       if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->twist( complete_image, session->view->ctw );
+
+      session->processor->flip( complete_image, session->view->flip  );
+
       if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Applying color twist in " << function_timer.getTime() << " microseconds" << endl;
+	*(session->logfile) << "CVT :: Flipping image vertically in "
+			    << function_timer.getTime() << " microseconds" << endl;
       }
     }
 
 
-    // Apply any gamma or log transform
-    if( session->view->gamma != 1.0 ){
-      float gamma = session->view->gamma;
+    // Apply rotation - can apply this safely after gamma and contrast adjustment
+    if( session->view->getRotation() != 0.0 ){
+
       if( session->loglevel >= 5 ) function_timer.start();
 
-      // Check whether we have asked for logarithm
-      if( gamma == -1 ) session->processor->log( complete_image );
-      else session->processor->gamma( complete_image, gamma );
+      float rotation = session->view->getRotation();
+      session->processor->rotate( complete_image, rotation );
+
+      // For 90 and 270 rotation swap width and height
+      resampled_width = complete_image.width;
+      resampled_height = complete_image.height;
 
       if( session->loglevel >= 5 ){
-	if( gamma == -1 ) *(session->logfile) << "CVT :: Applying logarithm transform in ";
-	else *(session->logfile) << "CVT :: Applying gamma of " << gamma << " in ";
-	*(session->logfile) << function_timer.getTime() << " microseconds" << endl;
+	*(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
+			    << function_timer.getTime() << " microseconds" << endl;
       }
     }
 
 
-    // Apply inversion if requested
-    if( session->view->inverted ){
-      if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->inv( complete_image );
-      if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Applying inversion in " << function_timer.getTime() << " microseconds" << endl;
-      }
+    this->sendHeader( compressor, complete_image, resampled_height );
+    output.resize( resampled_width*complete_image.channels*CVT_STRIP_HEIGHT + 65536 );
+    this->sendStrips( compressor, complete_image, &output[0] );
+  }
+
+
+  this->sendEnd( compressor, &output[0] );
+
+  // Inform our response object that we have sent something to the client
+  session->response->setImageSent();
+
+
+
+  // Total CVT response time
+  if( session->loglevel >= 2 ){
+    *(session->logfile) << "CVT :: Total command time " << command_timer.getTime() << " microseconds" << endl;
+  }
+
+
+}
+
+
+
+void CVT::applyTransforms( RawTile& tile, const vector<float>& min, const vector<float>& max, bool float_processing ){
+
+  Timer function_timer;
+
+
+  // Convert CIELAB to sRGB
+  if( (*session->image)->getColourSpace() == CIELAB ){
+    if( session->loglevel >= 5 ) function_timer.start();
+    session->processor->LAB2sRGB( tile );
+    if( session->loglevel >= 5 ){
+      *(session->logfile) << "CVT :: Converting from CIELAB->sRGB in "
+			  << function_timer.getTime() << " microseconds" << endl;
     }
+  }
 
 
-    // Apply color mapping if requested
-    if( session->view->cmapped ){
-      if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->cmap( complete_image, session->view->cmap );
-      if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Applying color map in " << function_timer.getTime() << " microseconds" << endl;
-      }
+  if( !float_processing ) return;
+
+
+  // Apply normalization and perform float conversion
+  {
+    if( session->loglevel >= 5 ) function_timer.start();
+    session->processor->normalize( tile, max, min );
+    if( session->loglevel >= 5 ){
+      *(session->logfile) << "CVT :: Converting to floating point and normalizing in "
+			  << function_timer.getTime() << " microseconds" << endl;
     }
+  }
 
 
+  // Apply hill shading if requested
+  if( session->view->shaded ){
+    if( session->loglevel >= 5 ) function_timer.start();
+    session->processor->shade( tile, session->view->shade[0], session->view->shade[1] );
+    if( session->loglevel >= 5 ){
+      *(session->logfile) << "CVT :: Applying hill-shading in " << function_timer.getTime() << " microseconds" << endl;
+    }
+  }
 
-    // Apply any contrast adjustments and/or clip from 16bit or 32bit to 8bit
-    {
-      if( session->loglevel >= 5 ) function_timer.start();
-      session->processor->contrast( complete_image, session->view->contrast );
-      if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Applying contrast of " << session->view->contrast
-			    << " and converting to 8bit in " << function_timer.getTime() << " microseconds" << endl;
-      }
+
+  // Apply color twist if requested
+  if( session->view->ctw.size() ){
+    if( session->loglevel >= 5 ) function_timer.start();
+    session->processor->twist( tile, session->view->ctw );
+    if( session->loglevel >= 5 ){
+      *(session->logfile) << "CVT :: Applying color twist in " << function_timer.getTime() << " microseconds" << endl;
     }
   }
 
 
-  // Resize our image as requested. Use the interpolation method requested in the server configuration.
-  //  - Use bilinear interpolation by default
-  if( (view_width!=resampled_width) || (view_height!=resampled_height) ){
+  // Apply any gamma or log transform
+  if( session->view->gamma != 1.0 ){
+    float gamma = session->view->gamma;
+    if( session->loglevel >= 5 ) function_timer.start();
+
+    // Check whether we have asked for logarithm
+    if( gamma == -1 ) session->processor->log( tile );
+    else session->processor->gamma( tile, gamma );
+
+    if( session->loglevel >= 5 ){
+      if( gamma == -1 ) *(session->logfile) << "CVT :: Applying logarithm transform in ";
+      else *(session->logfile) << "CVT :: Applying gamma of " << gamma << " in ";
+      *(session->logfile) << function_timer.getTime() << " microseconds" << endl;
+    }
+  }
+
 
-    string interpolation_type;
+  // Apply inversion if requested
+  if( session->view->inverted ){
     if( session->loglevel >= 5 ) function_timer.start();
+    session->processor->inv( tile );
+    if( session->loglevel >= 5 ){
+      *(session->logfile) << "CVT :: Applying inversion in " << function_timer.getTime() << " microseconds" << endl;
+    }
+  }
+
 
-    unsigned int interpolation = Environment::getInterpolation();
-    switch( interpolation ){
-     case 0:
-      interpolation_type = "nearest neighbour";
-      session->processor->interpolate_nearestneighbour( complete_image, resampled_width, resampled_height );
-      break;
-     default:
-      interpolation_type = "bilinear";
-      session->processor->interpolate_bilinear( complete_image, resampled_width, resampled_height );
-      break;
+  // Apply color mapping if requested
+  if( session->view->cmapped ){
+    if( session->loglevel >= 5 ) function_timer.start();
+    session->processor->cmap( tile, session->view->cmap );
+    if( session->loglevel >= 5 ){
+      *(session->logfile) << "CVT :: Applying color map in " << function_timer.getTime() << " microseconds" << endl;
     }
+  }
+
 
+  // Apply any contrast adjustments and/or clip from 16bit or 32bit to 8bit
+  {
+    if( session->loglevel >= 5 ) function_timer.start();
+    session->processor->contrast( tile, session->view->contrast );
     if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Resizing using " << interpolation_type << " interpolation in "
-			  << function_timer.getTime() << " microseconds" << endl;
+      *(session->logfile) << "CVT :: Applying contrast of " << session->view->contrast
+			  << " and converting to 8bit in " << function_timer.getTime() << " microseconds" << endl;
     }
   }
 
+}
+
+
+
+void CVT::finalize( RawTile& tile ){
+
+  Timer function_timer;
+
 
   // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
-  if( (complete_image.channels==2) || (complete_image.channels>3 ) ){
+  if( (tile.channels==2) || (tile.channels>3 ) ){
 
-    int output_channels = (complete_image.channels==2)? 1 : 3;
+    int output_channels = (tile.channels==2)? 1 : 3;
     if( session->loglevel >= 5 ) function_timer.start();
 
-    session->processor->flatten( complete_image, output_channels );
+    session->processor->flatten( tile, output_channels );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Flattening to " << output_channels << " channel"
@@ -396,7 +571,7 @@ void CVT::send( Session* session ){
 
     if( session->loglevel >= 5 ) function_timer.start();
 
-    session->processor->greyscale( complete_image );
+    session->processor->greyscale( tile );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Converting to greyscale in "
@@ -414,7 +589,7 @@ void CVT::send( Session* session ){
     unsigned char threshold = session->processor->threshold( (*session->image)->histogram );
 
     // Apply threshold to create binary (bi-level) image
-    session->processor->binary( complete_image, threshold );
+    session->processor->binary( tile, threshold );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Converting to binary with threshold " << (unsigned int) threshold
@@ -429,7 +604,7 @@ void CVT::send( Session* session ){
     if( session->loglevel >= 5 ) function_timer.start();
 
     // Perform histogram equalization
-    session->processor->equalize( complete_image, (*session->image)->histogram );
+    session->processor->equalize( tile, (*session->image)->histogram );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Histogram equalization applied in "
@@ -438,202 +613,115 @@ void CVT::send( Session* session ){
   }
 
 
-  // Apply flip
-  if( session->view->flip != 0 ){
+  // Apply horizontal flip, which works row by row. Vertical flips need the whole image
+  if( session->view->flip == 1 ){
 
     if( session->loglevel >= 5 ) function_timer.start();
 
-    session->processor->flip( complete_image, session->view->flip  );
+    session->processor->flip( tile, session->view->flip  );
 
     if( session->loglevel >= 5 ){
-      string direction = session->view->flip==1 ? "horizontally" : "vertically";
-      *(session->logfile) << "JTL :: Flipping image " << direction << " in "
+      *(session->logfile) << "CVT :: Flipping image horizontally in "
 			  << function_timer.getTime() << " microseconds" << endl;
     }
   }
 
-
-  // Apply rotation - can apply this safely after gamma and contrast adjustment
-  if( session->view->getRotation() != 0.0 ){
-
-    if( session->loglevel >= 5 ) function_timer.start();
-
-    float rotation = session->view->getRotation();
-    session->processor->rotate( complete_image, rotation );
-
-    // For 90 and 270 rotation swap width and height
-    resampled_width = complete_image.width;
-    resampled_height = complete_image.height;
-
-    if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
-			  << function_timer.getTime() << " microseconds" << endl;
-    }
-  }
+}
 
 
-  // Set the physical output resolution for this particular view and zoom level
-  float dpi_x = (*session->image)->dpi_x * (float) im_width / (float) (*session->image)->getImageWidth();
-  float dpi_y = (*session->image)->dpi_y * (float) im_height / (float) (*session->image)->getImageHeight();
-  compressor->setResolution( dpi_x, dpi_y, (*session->image)->dpi_units );
-  if( session->loglevel >= 5 ){
-    *(session->logfile) << "CVT :: Setting physical resolution of this view to " <<  dpi_x << " x " << dpi_y
-			<< ( ((*session->image)->dpi_units==1) ? " pixels/inch" : " pixels/cm" ) << endl;
-  }
-
-  // Set ICC profile if of a reasonable size
-  if( session->view->embedICC() && ((*session->image)->getMetadata("icc").size()>0) ){
-    if( (*session->image)->getMetadata("icc").size() < 65536 ){
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: Embedding ICC profile with size "
-			    << (*session->image)->getMetadata("icc").size() << " bytes" << endl;
-      }
-      compressor->setICCProfile( (*session->image)->getMetadata("icc") );
-    }
-    else{
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: ICC profile with size "
-			    << (*session->image)->getMetadata("icc").size() << " bytes is too large: Not embedding" << endl;
-      }
-    }
-  }
-
-  // Add XMP metadata if this exists
-  if( (*session->image)->getMetadata("xmp").size() > 0 ){
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Embedding XMP metadata with size "
-			  << (*session->image)->getMetadata("xmp").size() << " bytes" << endl;
-    }
-    compressor->setXMPMetadata( (*session->image)->getMetadata("xmp") );
-  }
 
+void CVT::sendHeader( Compressor* compressor, const RawTile& tile, unsigned int height ){
 
   // Initialise our output compression object
-  compressor->InitCompression( complete_image, resampled_height );
-
+  compressor->InitCompression( tile, height );
 
-  len = compressor->getHeaderSize();
-
-#ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Output Header Chunk : " << str;
-  session->out->printf( str );
-#endif
+  this->write( compressor->getHeader(), compressor->getHeaderSize(), "header" );
 
-  if( session->out->putStr( (const char*) compressor->getHeader(), len ) != len ){
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing header" << endl;
-    }
-  }
+}
 
-#ifdef CHUNKED
-  session->out->printf( "\r\n" );
-#endif
 
-  // Flush our block of data
-  if( session->out->flush() == -1 ) {
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error flushing output data" << endl;
-    }
-  }
 
+void CVT::sendStrips( Compressor* compressor, const RawTile& tile, unsigned char* output ){
 
-  // Send out the data per strip of fixed height.
-  // Allocate enough memory for this plus an extra 64k for instances where compressed
-  // data is greater than uncompressed
-  unsigned int strip_height = 128;
-  unsigned int channels = complete_image.channels;
-  unsigned char* output = new unsigned char[resampled_width*channels*strip_height+65536];
-  int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
+  // Send out the data per strip of fixed height
+  unsigned int row = tile.width * tile.channels;
+  unsigned int strips = (tile.height/CVT_STRIP_HEIGHT) + (tile.height%CVT_STRIP_HEIGHT == 0 ? 0 : 1);
 
-  for( int n=0; n<strips; n++ ){
+  for( unsigned int n=0; n<strips; n++ ){
 
     // Get the starting index for this strip of data
-    unsigned char* input = &((unsigned char*)complete_image.data)[n*strip_height*resampled_width*channels];
+    unsigned char* input = &((unsigned char*)tile.data)[(size_t)n*CVT_STRIP_HEIGHT*row];
 
     // The last strip may have a different height
-    if( (n==strips-1) && (resampled_height%strip_height!=0) ) strip_height = resampled_height % strip_height;
+    unsigned int strip_height = CVT_STRIP_HEIGHT;
+    if( (n==strips-1) && (tile.height%CVT_STRIP_HEIGHT!=0) ) strip_height = tile.height % CVT_STRIP_HEIGHT;
 
     if( session->loglevel >= 3 ){
       *(session->logfile) << "CVT :: About to compress strip with height " << strip_height << endl;
     }
 
     // Compress the strip
-    len = compressor->CompressStrip( input, output, strip_height );
+    int len = compressor->CompressStrip( input, output, strip_height );
 
     if( session->loglevel >= 3 ){
       *(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
     }
 
-#ifdef CHUNKED
-    // Send chunk length in hex
-    snprintf( str, 1024, "%X\r\n", len );
-    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
-    session->out->printf( str );
-#endif
-
     // Send this strip out to the client
-    if( len != session->out->putStr( (const char*) output, len ) ){
-      if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error writing strip: " << len << endl;
-      }
-    }
+    this->write( output, len, "strip" );
+  }
+
+}
+
+
+
+void CVT::sendEnd( Compressor* compressor, unsigned char* output ){
+
+  // Finish off the image compression
+  int len = compressor->Finish( output );
+
+  this->write( output, len, "output" );
 
 #ifdef CHUNKED
-    // Send closing chunk CRLF
-    session->out->printf( "\r\n" );
+  // Send closing blank chunk
+  session->out->printf( "0\r\n\r\n" );
+  if( session->out->flush() == -1 ) {
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "CVT :: Error flushing output" << endl;
+    }
+  }
 #endif
 
-    // Flush our block of data
-    if( session->out->flush() == -1 ) {
-      if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error flushing data" << endl;
-      }
-    }
+}
 
-  }
 
-  // Finish off the image compression
-  len = compressor->Finish( output );
+
+void CVT::write( const unsigned char* data, int len, const char* label ){
 
 #ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Final Data Chunk : " << str << endl;
+  // Send chunk length in hex
+  char str[16];
+  snprintf( str, 16, "%X\r\n", len );
+  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
   session->out->printf( str );
 #endif
 
-  if( session->out->putStr( (const char*) output, len ) != len ){
+  if( session->out->putStr( (const char*) data, len ) != len ){
     if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing output" << endl;
+      *(session->logfile) << "CVT :: Error writing " << label << ": " << len << endl;
     }
   }
 
-  delete[] output;
-
-
 #ifdef CHUNKED
   // Send closing chunk CRLF
   session->out->printf( "\r\n" );
-  // Send closing blank chunk
-  session->out->printf( "0\r\n\r\n" );
 #endif
 
-  if( session->out->flush()  == -1 ) {
+  // Flush our block of data
+  if( session->out->flush() == -1 ) {
     if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error flushing output" << endl;
+      *(session->logfile) << "CVT :: Error flushing " << label << endl;
     }
   }
 
-  // Inform our response object that we have sent something to the client
-  session->response->setImageSent();
-
-
-
-  // Total CVT response time
-  if( session->loglevel >= 2 ){
-    *(session->logfile) << "CVT :: Total command time " << command_timer.getTime() << " microseconds" << endl;
-  }
-
-
 }
-
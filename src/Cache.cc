@@ -0,0 +1,313 @@
+/*
+    IIPImage Server - Tile Cache Snapshots
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifdef HAVE_SYS_MMAN_H
+
+#include "Cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+using namespace std;
+
+
+/* Snapshots use a flat layout, which can be used in place once mapped into memory:
+   a header, an array of fixed-size tile records ordered from the most to the least
+   valuable tile, the image paths referenced by these records, and finally the tile data.
+   Records refer to their image path and data by offset from the start of the file.
+ */
+
+// Identifiers for our snapshot layout
+#define SNAPSHOT_MAGIC 0x49495053  // "IIPS"
+#define SNAPSHOT_VERSION 1
+
+
+/// Snapshot file header
+struct SnapshotHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;    ///< Size of each record, as a check on our layout
+  uint32_t codec;          ///< TileCodec used for any compressed tiles
+  uint64_t count;          ///< Number of records
+  uint64_t size;           ///< Total file size
+};
+
+
+/// Snapshot tile record
+struct SnapshotRecord {
+  uint64_t name_offset;
+  uint64_t data_offset;
+  uint32_t name_length;
+  uint32_t data_length;
+  uint32_t raw_length;     ///< Uncompressed length if compressed by our codec, otherwise 0
+  int32_t resolution;
+  int32_t tileNum;
+  int32_t hSequence;
+  int32_t vSequence;
+  int32_t compression;
+  int32_t quality;
+  int32_t channels;
+  int64_t timestamp;
+  uint64_t cost;
+  uint32_t width;
+  uint32_t height;
+  int32_t bpc;
+  int32_t sampleType;
+  uint32_t padded;
+  uint32_t reserved;
+};
+
+
+/// Tile selected for inclusion within a snapshot
+struct SnapshotTile {
+  TileKey key;
+  RawTile tile;
+  unsigned int rawLength;
+  unsigned long cost;
+};
+
+
+
+// Write a complete buffer, retrying after partial writes
+static bool writeAll( int fd, const void* buf, size_t length )
+{
+  const char* p = (const char*) buf;
+  while( length > 0 ){
+    ssize_t n = ::write( fd, p, length );
+    if( n < 0 ){
+      if( errno == EINTR ) continue;
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+
+
+unsigned int Cache::saveSnapshot( const string& path, float max )
+{
+  uint64_t limit = (uint64_t)( max * 1024000 );
+
+  // Gather the entries of each shard, most valuable first. Tiles share their data
+  // buffers with the cache, so that no pixel data is copied while the locks are held
+  vector< vector<SnapshotTile> > lists( shards.size() );
+  for( unsigned int i=0; i<shards.size(); i++ ){
+    std::lock_guard<std::mutex> lock( shards[i]->mutex );
+    vector<CacheEntry*> entries;
+    shards[i]->policy->hottest( entries );
+    lists[i].resize( entries.size() );
+    for( unsigned int j=0; j<entries.size(); j++ ){
+      SnapshotTile& t = lists[i][j];
+      t.key = entries[j]->key;
+      t.tile = entries[j]->tile;
+      t.rawLength = entries[j]->rawLength;
+      t.cost = entries[j]->cost;
+    }
+  }
+
+  // Interleave our shards, so that the most valuable tiles of each are taken first,
+  // until we reach our size limit
+  vector<SnapshotTile*> selected;
+  uint64_t total = 0;
+  bool full = false;
+  for( unsigned int j=0; !full; j++ ){
+    bool more = false;
+    for( unsigned int i=0; i<lists.size(); i++ ){
+      if( j >= lists[i].size() ) continue;
+      more = true;
+      SnapshotTile& t = lists[i][j];
+      if( limit && total + t.tile.dataLength > limit ){
+	full = true;
+	break;
+      }
+      total += t.tile.dataLength;
+      selected.push_back( &t );
+    }
+    if( !more ) break;
+  }
+
+  // Store each image path once
+  map<const CacheImage*, uint64_t> names;
+  uint64_t names_offset = sizeof(SnapshotHeader) + selected.size() * sizeof(SnapshotRecord);
+  uint64_t offset = names_offset;
+  for( unsigned int i=0; i<selected.size(); i++ ){
+    const CacheImage* image = selected[i]->key.image;
+    if( names.find( image ) != names.end() ) continue;
+    names[ image ] = offset;
+    offset += image->filename.length();
+  }
+  uint64_t data_offset = offset;
+
+  // Build our records
+  vector<SnapshotRecord> records( selected.size() );
+  offset = data_offset;
+  for( unsigned int i=0; i<selected.size(); i++ ){
+    const SnapshotTile& t = *selected[i];
+    SnapshotRecord& r = records[i];
+    memset( &r, 0, sizeof(r) );
+    r.name_offset = names[ t.key.image ];
+    r.name_length = t.key.image->filename.length();
+    r.data_offset = offset;
+    r.data_length = t.tile.dataLength;
+    r.raw_length = t.rawLength;
+    r.resolution = t.key.resolution;
+    r.tileNum = t.key.tile;
+    r.hSequence = t.key.hSequence;
+    r.vSequence = t.key.vSequence;
+    r.compression = t.key.compression;
+    r.quality = t.key.quality;
+    r.channels = t.tile.channels;
+    r.timestamp = t.tile.timestamp;
+    r.cost = t.cost;
+    r.width = t.tile.width;
+    r.height = t.tile.height;
+    r.bpc = t.tile.bpc;
+    r.sampleType = t.tile.sampleType;
+    r.padded = t.tile.padded;
+    offset += t.tile.dataLength;
+  }
+
+  SnapshotHeader header;
+  memset( &header, 0, sizeof(header) );
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = SNAPSHOT_VERSION;
+  header.record_size = sizeof(SnapshotRecord);
+  header.codec = codec ? codec->getCodec() : TileCodec::CODEC_NONE;
+  header.count = records.size();
+  header.size = offset;
+
+  // Write to a temporary file and rename into place
+  char suffix[32];
+  snprintf( suffix, sizeof(suffix), ".%ld.tmp", (long) getpid() );
+  string tmp = path + suffix;
+  int fd = open( tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+  if( fd < 0 ) return 0;
+
+  bool ok = writeAll( fd, &header, sizeof(header) );
+  if( ok && !records.empty() ) ok = writeAll( fd, &records[0], records.size()*sizeof(SnapshotRecord) );
+  for( map<const CacheImage*, uint64_t>::iterator i = names.begin(); ok && i != names.end(); ++i ){
+    // Our map is ordered by pointer, so write each path at its own offset
+    ok = ( pwrite( fd, i->first->filename.data(), i->first->filename.length(), i->second ) ==
+	   (ssize_t) i->first->filename.length() );
+  }
+  if( ok && lseek( fd, data_offset, SEEK_SET ) < 0 ) ok = false;
+  for( unsigned int i=0; ok && i<selected.size(); i++ ){
+    ok = writeAll( fd, selected[i]->tile.data, selected[i]->tile.dataLength );
+  }
+  if( close( fd ) != 0 ) ok = false;
+
+  if( !ok || rename( tmp.c_str(), path.c_str() ) != 0 ){
+    unlink( tmp.c_str() );
+    return 0;
+  }
+
+  return selected.size();
+}
+
+
+
+unsigned int Cache::loadSnapshot( const string& path, const string& prefix, const string& suffix )
+{
+  int fd = open( path.c_str(), O_RDONLY );
+  if( fd < 0 ) return 0;
+
+  struct stat st;
+  if( fstat( fd, &st ) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader) ){
+    close( fd );
+    return 0;
+  }
+
+  size_t length = st.st_size;
+  void* base = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( base == MAP_FAILED ) return 0;
+
+  const unsigned char* data = (const unsigned char*) base;
+  const SnapshotHeader* header = (const SnapshotHeader*) data;
+  const SnapshotRecord* records = (const SnapshotRecord*)( data + sizeof(SnapshotHeader) );
+
+  if( header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+      header->record_size != sizeof(SnapshotRecord) || header->size != length ||
+      header->count > ( length - sizeof(SnapshotHeader) ) / sizeof(SnapshotRecord) ){
+    munmap( base, length );
+    return 0;
+  }
+
+  // Compressed tiles can only be used if we are using the same codec
+  bool compressed = ( codec && (uint32_t) codec->getCodec() == header->codec );
+
+  // Check each image once against the modification time of its file
+  map<uint64_t, time_t> images;
+
+  unsigned int loaded = 0;
+
+  // Insert least valuable tiles first, so that the most valuable end up most recently used
+  for( uint64_t n = header->count; n > 0 && maxSize > 0; n-- ){
+
+    const SnapshotRecord& r = records[n-1];
+    if( r.name_offset + r.name_length > length || r.data_offset + r.data_length > length ) continue;
+    if( r.raw_length && !compressed ) continue;
+
+    string filename( (const char*)( data + r.name_offset ), r.name_length );
+
+    map<uint64_t, time_t>::iterator i = images.find( r.name_offset );
+    if( i == images.end() ){
+      struct stat sb;
+      time_t mtime = ( stat( (prefix + filename + suffix).c_str(), &sb ) == 0 ) ? sb.st_mtime : -1;
+      i = images.insert( make_pair( r.name_offset, mtime ) ).first;
+    }
+    if( i->second < 0 || i->second > r.timestamp ) continue;
+
+    RawTile tile( r.tileNum, r.resolution, r.hSequence, r.vSequence, r.width, r.height, r.channels, r.bpc );
+    tile.compressionType = (CompressionType) r.compression;
+    tile.quality = r.quality;
+    tile.timestamp = r.timestamp;
+    tile.sampleType = (SampleType) r.sampleType;
+    tile.padded = r.padded;
+    tile.filename = filename;
+    tile.dataLength = r.data_length;
+    if( r.raw_length ) tile.adopt( new unsigned char[r.data_length] );
+    else tile.allocate( r.data_length );
+    memcpy( tile.data, data + r.data_offset, r.data_length );
+
+    const CacheImage* image = this->getImage( filename );
+    TileKey key = TileKey::make( image, r.resolution, r.tileNum,
+				 r.hSequence, r.vSequence, (CompressionType) r.compression, r.quality );
+    this->_store( key, tile, r.cost, r.raw_length );
+    this->releaseImage( image );
+    loaded++;
+  }
+
+  munmap( base, length );
+  return loaded;
+}
+
+
+#endif
@@ -34,41 +34,7 @@
 
 
 
-// Test for available map types. Try to use an efficient hashed map type if possible
-// and define this as HASHMAP, which we can then use elsewhere.
-#if defined(HAVE_UNORDERED_MAP)
-#include <unordered_map>
-#define HASHMAP std::unordered_map
-
-#elif defined(HAVE_TR1_UNORDERED_MAP)
-#include <tr1/unordered_map>
-#define HASHMAP std::tr1::unordered_map
-
-// Use the gcc hash_map extension if we have it
-#elif defined(HAVE_EXT_HASH_MAP)
-#include <ext/hash_map>
-#define HASHMAP __gnu_cxx::hash_map
-
-/* Explicit template specialization of hash of a string class,
-   which just uses the internal char* representation as a wrapper.
-   Required for older versions of gcc as hashing on a string is
-   not supported.
- */
-namespace __gnu_cxx {
-  template <>
-    struct hash<std::string> {
-      size_t operator() (const std::string& x) const {
-	return hash<const char*>()(x.c_str());
-      }
-    };
-}
-
-// If no hash type available, just use map
-#else
-#include <map>
-#define HASHMAP std::map
-
-#endif // End of #if defined
+#include "HashMap.h"
 
 
 
@@ -82,214 +48,770 @@ namespace __gnu_cxx {
 #include <iostream>
 #include <list>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
 #include "RawTile.h"
+#include "TileKey.h"
+#include "Timer.h"
+#include "CachePolicy.h"
+#include "TileCodec.h"
+
+#ifdef HAVE_SHM_OPEN
+#include "SharedCache.h"
+#endif
 
+#ifdef HAVE_PREAD
+#include "DiskCache.h"
+#endif
 
 
-/// Cache to store raw tile data
+// Minimum share in MB of our memory budget for each cache shard
+#define MIN_CACHE_SHARD_SIZE 4
 
+
+
+/// Cache to store raw tile data
+/** The cache is divided into a number of independently locked shards, each with a fair
+ *  share of the total memory budget. Tiles are assigned to shards by a hash of their key,
+ *  so that concurrent worker threads accessing different tiles rarely contend for the same
+ *  lock. The budget itself is global: a shard may grow beyond its share while the cache as
+ *  a whole has room, and once the budget is exceeded, tiles are evicted first from the
+ *  shard being inserted into and then from the shards furthest over their share. Shards are
+ *  limited to at least MIN_CACHE_SHARD_SIZE MB each, so that large tiles and whole virtual
+ *  resolutions are not evicted as soon as they are inserted. Within each shard, the choice
+ *  of which tiles to evict is delegated to a pluggable CachePolicy: classic LRU, the
+ *  scan-resistant S3-FIFO or the cost-aware GreedyDual-Size, which favours tiles that are
+ *  expensive to decode. With a single shard and the LRU policy, this behaves exactly as a
+ *  classic LRU cache.
+ *
+ *  Memory use is tracked per image. An optional per-image quota can be set, limiting the
+ *  fraction of each shard that tiles from a single image may occupy. An image exceeding
+ *  its quota has its own least recently used tiles evicted first, so that a single user
+ *  panning across a very large image cannot push out the tiles of every other image.
+ *
+ *  Tiles are indexed by a compact fixed-size TileKey. Image paths are interned once into
+ *  CacheImage records, so that lookups via a TileKey involve no string handling or
+ *  memory allocation.
+ *
+ *  Uncompressed tiles can optionally be held in compressed form using a fast lossless
+ *  TileCodec, so that more of them fit in the cache. Compression takes place before the
+ *  tile is inserted and decompression after it is retrieved, outside of the shard locks.
+ *
+ *  Concurrent misses for the same tile are coalesced: the first thread to miss claims the
+ *  tile and decodes it, while other threads requesting the same tile wait for and share
+ *  its result rather than decoding it again.
+ *
+ *  Optionally, a SharedCache backend held in shared memory can be attached, in which
+ *  case tiles are stored there in preference, allowing them to be shared between
+ *  processes. Only tiles too large for the shared backend are then kept locally.
+ *
+ *  A persistent DiskCache can also be attached as a second tier for JPEG tiles, which
+ *  are then written to local disk on insertion. Memory misses are looked up on disk
+ *  before the caller falls back to decoding, and tiles found there are promoted back
+ *  into memory. The disk tier survives restarts and is not emptied by clear().
+ */
 class Cache {
 
 
  private:
 
+  /// Index typedef - our index owns the cache entries
+#if defined(HAVE_UNORDERED_MAP) || defined(HAVE_TR1_UNORDERED_MAP) || defined(HAVE_EXT_HASH_MAP)
+#ifdef HAVE_EXT_POOL_ALLOCATOR
+  typedef HASHMAP < TileKey, CacheEntry*, TileKeyHash, std::equal_to< TileKey >,
+    __gnu_cxx::__pool_alloc< std::pair<const TileKey, CacheEntry*> >
+    > TileMap;
+#else
+  typedef HASHMAP < TileKey, CacheEntry*, TileKeyHash > TileMap;
+#endif
+#else
+  typedef std::map < TileKey, CacheEntry* > TileMap;
+#endif
+
+  /// Image index typedef
+  typedef HASHMAP < std::string, CacheImage* > ImageMap;
+
+
+  /// Occupancy of a single image within a shard, only held while the image has tiles in the shard
+  struct ImageUsage {
+
+    /// Number of tiles
+    unsigned int tiles;
+
+    /// Memory used in bytes
+    unsigned long size;
+
+    /// Number of tiles evicted because this image exceeded its quota while resident
+    unsigned long evictions;
+
+    /// Entries for this image, least recently used last - only maintained when a quota is set
+    std::list<CacheEntry*> entries;
+
+    ImageUsage() : tiles( 0 ), size( 0 ), evictions( 0 ) {};
+  };
+
+  /// Per image occupancy typedef
+  typedef HASHMAP < const CacheImage*, ImageUsage > ImageUsageMap;
+
+
+  /// A single independently locked partition of our cache
+  struct Shard {
+
+    /// Max memory size in bytes for this shard
+    unsigned long maxSize;
+
+    /// Current memory running total
+    unsigned long currentSize;
+
+    /// Main Cache storage index object
+    TileMap tileMap;
+
+    /// Eviction policy
+    CachePolicy* policy;
+
+    /// Occupancy of each image within this shard
+    ImageUsageMap usage;
+
+    /// Maximum memory in bytes that a single image may use in this shard or 0 for no limit
+    unsigned long imageQuota;
+
+    /// Mutex protecting this shard
+    std::mutex mutex;
+
+    Shard() : maxSize( 0 ), currentSize( 0 ), policy( NULL ), imageQuota( 0 ) {};
+    ~Shard() { delete policy; };
+  };
+
+
   /// Basic object storage size
   int tileSize;
 
   /// Max memory size in bytes
   unsigned long maxSize;
 
-  /// Current memory running total
-  unsigned long currentSize;
+  /// Current memory running total across all shards
+  std::atomic<unsigned long> totalSize;
 
-  /// Main cache storage typedef
-#ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef std::list < std::pair<const std::string,RawTile>,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string,RawTile> > > TileList;
-#else
-  typedef std::list < std::pair<const std::string,RawTile> > TileList;
-#endif
+  /// Our cache shards
+  std::vector<Shard*> shards;
 
-  /// Main cache list iterator typedef
-  typedef std::list < std::pair<const std::string,RawTile> >::iterator List_Iter;
+  /// Interned image paths
+  ImageMap images;
 
-  /// Index typedef
-#ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef HASHMAP < std::string, List_Iter,
-    __gnu_cxx::hash< const std::string >,
-    std::equal_to< const std::string >,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string, List_Iter> >
-    > TileMap;
-#else
-  typedef HASHMAP < std::string,List_Iter > TileMap;
+  /// Mutex protecting our interned image paths and the release of their last reference
+  std::mutex imageMutex;
+
+  /// A tile currently being produced by one thread on behalf of others
+  struct Flight {
+    std::condition_variable done;    ///< Signalled once the tile has been produced
+    bool finished;                   ///< Whether the producing thread has finished
+    bool ok;                         ///< Whether the tile was successfully produced
+    RawTile tile;                    ///< The tile produced
+    Flight() : finished( false ), ok( false ) {};
+  };
+
+  /// In-flight index typedef
+  typedef HASHMAP < TileKey, std::shared_ptr<Flight>, TileKeyHash > FlightMap;
+
+  /// Tiles currently being produced
+  FlightMap flights;
+
+  /// Mutex protecting our in-flight tiles
+  std::mutex flightMutex;
+
+  /// Number of requests which waited for a tile produced by another thread
+  std::atomic<unsigned long> coalesced;
+
+  /// Total time in microseconds spent waiting for tiles produced by other threads
+  std::atomic<unsigned long> coalescedTime;
+
+  /// Total number of tiles evicted because their image exceeded its quota
+  std::atomic<unsigned long> quotaEvictions;
+
+  /// Optional codec used to compress uncompressed tiles
+  TileCodec* codec;
+
+#ifdef HAVE_SHM_OPEN
+  /// Optional shared memory backend
+  SharedCache* shared;
 #endif
 
+#ifdef HAVE_PREAD
+  /// Optional persistent disk tier
+  DiskCache* disk;
+#endif
 
-  /// Main cache storage object
-  TileList tileList;
 
-  /// Main Cache storage index object
-  TileMap tileMap;
+  /// Select the shard responsible for a particular key
+  /** Uses the upper bits of the key hash, as the lower bits are used by the hashed index
+   *  @param key tile key
+   *  @return reference to shard
+   */
+  Shard& _shard( const TileKey &key ) {
+    if( shards.size() == 1 ) return *shards[0];
+    return *shards[ (key.hash() >> 32) % shards.size() ];
+  }
 
 
   /// Internal touch function
-  /** Touches a key in the Cache and makes it the most recently used
+  /** Touches a key in the Cache, recording the access with our eviction policy
+   *  @param shard shard containing key
    *  @param key to be touched
    *  @return a Map_Iter pointing to the key that was touched.
    */
-  TileMap::iterator _touch( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return miter;
-    // Move the found node to the head of the list.
-    tileList.splice( tileList.begin(), tileList, miter->second );
+  TileMap::iterator _touch( Shard& shard, const TileKey &key ) {
+    TileMap::iterator miter = shard.tileMap.find( key );
+    if( miter == shard.tileMap.end() ) return miter;
+    CacheEntry* e = miter->second;
+    shard.policy->touch( e );
+    if( shard.imageQuota ){
+      // Move to the head of the list for this image
+      std::list<CacheEntry*>& entries = shard.usage[ e->key.image ].entries;
+      entries.splice( entries.begin(), entries, e->imagePosition );
+    }
     return miter;
   }
 
 
   /// Interal remove function
   /**
+   *  @param shard shard containing key
    *  @param miter Map_Iter that points to the key to remove
    *  @warning miter is no longer usable after being passed to this function.
    */
-  void _remove( const TileMap::iterator &miter ) {
-    // Reduce our current size counter
-    currentSize -= ( (miter->second->second).dataLength +
-		     ( (miter->second->second).filename.capacity() + (miter->second->first).capacity() )*sizeof(char) +
-		     tileSize );
-    tileList.erase( miter->second );
-    tileMap.erase( miter );
+  void _remove( Shard& shard, const TileMap::iterator &miter ) {
+    CacheEntry* e = miter->second;
+    shard.policy->remove( e );
+    shard.tileMap.erase( miter );
+    this->_delete( shard, e );
   }
 
 
-  /// Interal remove function
-  /** @param key to remove */
-  void _remove( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
-    this->_remove( miter );
+  /// Delete an entry no longer known to our index or policy
+  /** @param shard shard containing entry
+   *  @param e entry to delete
+   */
+  void _delete( Shard& shard, CacheEntry* e ) {
+    // Reduce our current size counters
+    shard.currentSize -= e->size;
+    totalSize -= e->size;
+    ImageUsage& usage = shard.usage[ e->key.image ];
+    usage.tiles--;
+    usage.size -= e->size;
+    if( shard.imageQuota ) usage.entries.erase( e->imagePosition );
+    // Forget images with no tiles left, so that our index only grows with the images resident
+    if( usage.tiles == 0 ) shard.usage.erase( e->key.image );
+    const CacheImage* image = e->key.image;
+    delete e;
+    this->releaseImage( image );
   }
 
 
+  /// Insert a tile into memory
+  /** @param key tile key
+   *  @param r tile to be inserted
+   *  @param cost time in microseconds taken to produce the tile
+   */
+  void _insert( const TileKey& key, const RawTile& r, long cost ) {
+
+#ifdef HAVE_SHM_OPEN
+    // Store in our shared backend if we can
+    if( shared && shared->insert( key, r ) ) return;
+#endif
+
+    if( maxSize == 0 ) return;
+
+    // Compress uncompressed tiles before taking our lock
+    RawTile compressed;
+    if( codec && r.compressionType == UNCOMPRESSED && codec->compress( r, compressed ) ){
+      this->_store( key, compressed, cost, r.dataLength );
+    }
+    else this->_store( key, r, cost, 0 );
+  }
+
+
+  /// Store a tile within its shard, evicting as necessary
+  /** @param key tile key
+   *  @param t tile to be stored
+   *  @param cost time in microseconds taken to produce the tile
+   *  @param rawLength uncompressed data length if the tile data has been compressed by our codec, otherwise 0
+   */
+  void _store( const TileKey& key, const RawTile& t, long cost, unsigned int rawLength ) {
+
+    // Tiles larger than our whole budget would only push out everything else
+    if( t.dataLength + tileSize > maxSize ) return;
+
+    Shard& shard = this->_shard( key );
+    {
+      std::lock_guard<std::mutex> lock( shard.mutex );
+
+      // Touch the key, if it exists
+      TileMap::iterator miter = this->_touch( shard, key );
+
+      // Check whether this tile exists in our cache
+      if( miter != shard.tileMap.end() ){
+	// Check the timestamp and delete if necessary
+	if( miter->second->tile.timestamp < t.timestamp ){
+	  this->_remove( shard, miter );
+	}
+	// If this index already exists and it is up to date, do nothing
+	else return;
+      }
+
+      // Store the key if it doesn't already exist in our cache. Use the string::capacity function
+      // rather than length() as std::string can allocate slightly more than necessary
+      // Each entry holds a reference to its interned image, which our caller already holds
+      key.image->references++;
+      CacheEntry* e = new CacheEntry( key, t );
+      e->size = t.dataLength + e->tile.filename.capacity()*sizeof(char) + tileSize;
+      e->cost = ( cost > 0 ) ? cost : 0;
+      e->rawLength = rawLength;
+      shard.tileMap[ key ] = e;
+      shard.policy->insert( e );
+
+      // Update our total current size variables
+      shard.currentSize += e->size;
+      totalSize += e->size;
+      ImageUsage& usage = shard.usage[ key.image ];
+      usage.tiles++;
+      usage.size += e->size;
+
+      // If this image exceeds its quota, first evict its own least recently used tiles. As we
+      // always keep our new entry, the usage for this image is never removed here
+      if( shard.imageQuota ){
+	usage.entries.push_front( e );
+	e->imagePosition = usage.entries.begin();
+	while( usage.size > shard.imageQuota && usage.entries.size() > 1 ){
+	  CacheEntry* victim = usage.entries.back();
+	  shard.policy->remove( victim );
+	  shard.tileMap.erase( victim->key );
+	  usage.evictions++;
+	  quotaEvictions++;
+	  this->_delete( shard, victim );
+	}
+      }
+
+      // If we have exceeded our budget, first remove elements chosen by our policy while this shard
+      // exceeds its share. Keep our last entry, which may be a single tile larger than our share
+      while( totalSize > maxSize && shard.currentSize > shard.maxSize && shard.tileMap.size() > 1 ) {
+	CacheEntry* victim = shard.policy->evict();
+	if( !victim ) break;
+	shard.tileMap.erase( victim->key );
+	this->_delete( shard, victim );
+      }
+    }
+
+    // Otherwise reclaim memory borrowed by other shards
+    if( totalSize > maxSize ) this->_reclaim();
+
+  }
+
+
+  /// Evict tiles from the shards furthest over their share until we are back within our budget
+  /** Only a single shard lock is held at a time */
+  void _reclaim() {
+
+    // Order our shards by how far they are over their share
+    std::vector< std::pair<long,unsigned int> > order;
+    for( unsigned int i=0; i<shards.size(); i++ ){
+      std::lock_guard<std::mutex> lock( shards[i]->mutex );
+      order.push_back( std::make_pair( (long) shards[i]->maxSize - (long) shards[i]->currentSize, i ) );
+    }
+    std::sort( order.begin(), order.end() );
+
+    // First bring shards back to their share, then evict from any shard if still necessary,
+    // keeping the last entry of each
+    for( int pass=0; pass<2; pass++ ){
+      for( unsigned int n=0; n<order.size() && totalSize > maxSize; n++ ){
+	Shard& shard = *shards[ order[n].second ];
+	std::lock_guard<std::mutex> lock( shard.mutex );
+	while( totalSize > maxSize && shard.tileMap.size() > 1 &&
+	       ( pass == 1 || shard.currentSize > shard.maxSize ) ){
+	  CacheEntry* victim = shard.policy->evict();
+	  if( !victim ) break;
+	  shard.tileMap.erase( victim->key );
+	  this->_delete( shard, victim );
+	}
+      }
+    }
+  }
+
 
  public:
 
   /// Constructor
-  /** @param max Maximum cache size in MB */
-  Cache( float max ) {
-    maxSize = (unsigned long)(max*1024000) ; currentSize = 0;
-    // 64 chars added at the end represents an average string length
-    tileSize = sizeof( RawTile ) + sizeof( std::pair<const std::string,RawTile> ) +
-      sizeof( std::pair<const std::string, List_Iter> ) + sizeof(char)*64 + sizeof(List_Iter);
+  /** @param max Maximum cache size in MB
+   *  @param n   Maximum number of independently locked shards, reduced so that each
+   *             shard has at least MIN_CACHE_SHARD_SIZE MB
+   *  @param policy Name of eviction policy: "lru", "s3fifo" or "gds"
+   */
+  Cache( float max, unsigned int n = 1, const std::string& policy = "lru" ) {
+#ifdef HAVE_SHM_OPEN
+    shared = NULL;
+#endif
+#ifdef HAVE_PREAD
+    disk = NULL;
+#endif
+    codec = NULL;
+    coalesced = 0;
+    coalescedTime = 0;
+    quotaEvictions = 0;
+    maxSize = (unsigned long)(max*1024000);
+    totalSize = 0;
+    if( n > maxSize / (MIN_CACHE_SHARD_SIZE*1024000UL) ) n = maxSize / (MIN_CACHE_SHARD_SIZE*1024000UL);
+    if( n < 1 ) n = 1;
+    for( unsigned int i=0; i<n; i++ ){
+      Shard* shard = new Shard();
+      shard->maxSize = maxSize / n;
+      shard->policy = CachePolicy::create( policy, shard->maxSize );
+      shards.push_back( shard );
+    }
+    // The 64 chars added at the end represent an average file name length
+    tileSize = sizeof( CacheEntry ) + sizeof( std::pair<const TileKey, CacheEntry*> ) +
+      sizeof(char)*64 + 4*sizeof(void*);
   };
 
 
   /// Destructor
+  /** Any interned image records not yet released by their users are also deleted */
   ~Cache() {
     clear();
+    for( unsigned int i=0; i<shards.size(); i++ ) delete shards[i];
+    for( ImageMap::iterator i = images.begin(); i != images.end(); ++i ) delete i->second;
   }
 
 
-  /// Empty the cache
-  void clear() {
-    tileList.clear();
-    tileMap.clear();
-    currentSize = 0;
+  /// Set the per-image quota
+  /** Must be called before any tiles are inserted
+   *  @param q maximum fraction (0-1) of the cache that tiles from a single image may occupy or 0 for no limit
+   */
+  void setImageQuota( float q ) {
+    if( q < 0 || q >= 1 ) q = 0;
+    for( unsigned int i=0; i<shards.size(); i++ ){
+      std::lock_guard<std::mutex> lock( shards[i]->mutex );
+      shards[i]->imageQuota = (unsigned long)( q * shards[i]->maxSize );
+    }
   }
 
 
-  /// Insert a tile
-  /** @param r Tile to be inserted */
-  void insert( const RawTile& r ) {
+  /// Set the codec used to compress uncompressed tiles held within the cache
+  /** Must be called before any tiles are inserted
+   *  @param c pointer to TileCodec object or NULL for no compression
+   */
+  void setCodec( TileCodec* c ) { codec = c; }
 
-    if( maxSize == 0 ) return;
 
-    std::string key = this->getIndex( r.filename, r.resolution, r.tileNum,
-				      r.hSequence, r.vSequence, r.compressionType, r.quality );
+#ifdef HAVE_SHM_OPEN
+  /// Attach a shared memory backend
+  /** @param s pointer to SharedCache object or NULL to detach */
+  void setSharedCache( SharedCache* s ) { shared = s; }
+#endif
+
+
+#ifdef HAVE_PREAD
+  /// Attach a persistent disk tier for JPEG tiles
+  /** @param d pointer to DiskCache object or NULL to detach */
+  void setDiskCache( DiskCache* d ) { disk = d; }
+#endif
 
-    // Touch the key, if it exists
-    TileMap::iterator miter = this->_touch( key );
 
-    // Check whether this tile exists in our cache
-    if( miter != tileMap.end() ){
-      // Check the timestamp and delete if necessary
-      if( miter->second->second.timestamp < r.timestamp ){
-	this->_remove( miter );
+  /// Empty the cache
+  /** Interned image records are deleted unless still in use elsewhere. Any disk tier is
+   *  kept, as its tiles are validated against image timestamps on use
+   */
+  void clear() {
+#ifdef HAVE_SHM_OPEN
+    if( shared ) shared->clear();
+#endif
+    for( unsigned int i=0; i<shards.size(); i++ ){
+      Shard& shard = *shards[i];
+      std::lock_guard<std::mutex> lock( shard.mutex );
+      shard.policy->clear();
+      for( TileMap::iterator i = shard.tileMap.begin(); i != shard.tileMap.end(); ++i ){
+	const CacheImage* image = i->second->key.image;
+	delete i->second;
+	this->releaseImage( image );
       }
-      // If this index already exists and it is up to date, do nothing
-      else return;
+      shard.tileMap.clear();
+      shard.usage.clear();
+      totalSize -= shard.currentSize;
+      shard.currentSize = 0;
     }
+  }
+
+
+  /// Intern an image path
+  /** Callers should intern each image once and use the record for all their keys, releasing
+   *  it with releaseImage() when done. The record remains valid until then
+   *  @param f image path
+   *  @return pointer to interned record
+   */
+  const CacheImage* getImage( const std::string& f ) {
+    std::lock_guard<std::mutex> lock( imageMutex );
+    CacheImage*& image = images[ f ];
+    if( !image ) image = new CacheImage( f );
+    image->references++;
+    return image;
+  }
+
 
-    // Store the key if it doesn't already exist in our cache
-    // Ok, do the actual insert at the head of the list
-    tileList.push_front( std::make_pair(key,r) );
-
-    // And store this in our map
-    List_Iter liter = tileList.begin();
-    tileMap[ key ] = liter;
-
-    // Update our total current size variable. Use the string::capacity function
-    // rather than length() as std::string can allocate slightly more than necessary
-    // The +1 is for the terminating null byte
-    currentSize += (r.dataLength + (r.filename.capacity()+key.capacity())*sizeof(char) + tileSize);
-
-    // Check to see if we need to remove an element due to exceeding max_size
-    while( currentSize > maxSize ) {
-      // Remove the last element
-      liter = tileList.end();
-      --liter;
-      this->_remove( liter->first );
+  /// Release a reference to an interned image, deleting the record once no longer referenced
+  /** Only the last reference is released under our lock, so that a record can never be deleted
+   *  while another thread is interning the same path
+   *  @param image interned record obtained from getImage()
+   */
+  void releaseImage( const CacheImage* image ) {
+    unsigned int n = image->references;
+    while( n > 1 ){
+      if( image->references.compare_exchange_weak( n, n-1 ) ) return;
+    }
+    std::lock_guard<std::mutex> lock( imageMutex );
+    if( --image->references == 0 ){
+      images.erase( image->filename );
+      delete image;
     }
+  }
 
+
+  /// Return the number of interned images
+  unsigned int getNumImages() {
+    std::lock_guard<std::mutex> lock( imageMutex );
+    return images.size();
+  }
+
+
+  /// Insert a tile
+  /** The cached entry shares the data buffer of the tile rather than copying it, unless
+      the tile is uncompressed and a codec has been set, in which case a compressed copy is held
+      @param image interned image from which the tile comes
+      @param r Tile to be inserted
+      @param cost time in microseconds taken to produce the tile, used by cost-aware policies
+   */
+  void insert( const CacheImage* image, const RawTile& r, long cost = 0 ) {
+
+    TileKey key = TileKey::make( image, r.resolution, r.tileNum,
+				 r.hSequence, r.vSequence, r.compressionType, r.quality );
+
+#ifdef HAVE_PREAD
+    // Write encoded tiles through to our disk tier
+    if( disk && r.compressionType == JPEG ) disk->insert( key, r );
+#endif
+
+    this->_insert( key, r, cost );
   }
 
 
   /// Return the number of tiles in the cache
-  unsigned int getNumElements() { return tileList.size(); }
+  unsigned int getNumElements() {
+    unsigned int n = 0;
+#ifdef HAVE_SHM_OPEN
+    if( shared ) n += shared->getNumElements();
+#endif
+    for( unsigned int i=0; i<shards.size(); i++ ){
+      std::lock_guard<std::mutex> lock( shards[i]->mutex );
+      n += shards[i]->tileMap.size();
+    }
+    return n;
+  }
 
 
   /// Return the number of MB stored
-  float getMemorySize() { return (float) ( currentSize / 1024000.0 ); }
+  float getMemorySize() {
+    float size = (float) ( totalSize / 1024000.0 );
+#ifdef HAVE_SHM_OPEN
+    if( shared ) size += shared->getMemorySize();
+#endif
+    return size;
+  }
 
 
-  /// Get a tile from the cache
-  /** 
-   *  @param f filename
-   *  @param r resolution number
-   *  @param t tile number
-   *  @param h horizontal sequence number
-   *  @param v vertical sequence number
-   *  @param c compression type
-   *  @param q compression quality
-   *  @return pointer to data or NULL on error
+  /// Return the number of shards
+  unsigned int getNumShards() { return shards.size(); }
+
+
+  /// Return whether a tile can stay resident in our local cache without displacing a whole shard
+  /** @param bytes tile data length in bytes
+   *  @return true if the tile fits within the share of a single shard
    */
-  RawTile* getTile( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+  bool fits( unsigned long bytes ) { return maxSize > 0 && bytes + tileSize <= maxSize / shards.size(); }
+
 
-    if( maxSize == 0 ) return NULL;
+  /// Occupancy statistics for a single image
+  struct ImageStats {
+    std::string filename;      ///< Image path
+    unsigned int tiles;        ///< Number of cached tiles
+    unsigned long size;        ///< Memory used in bytes
+    unsigned long evictions;   ///< Number of tiles evicted because the image exceeded its quota while resident
 
-    std::string key = this->getIndex( f, r, t, h, v, c, q );
+    /// Ordering by memory used, largest first
+    static bool larger( const ImageStats& a, const ImageStats& b ) { return a.size > b.size; }
+  };
 
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return NULL;
-    this->_touch( key );
 
-    return &(miter->second->second);
+  /// Return per-image occupancy statistics for the images resident in our local cache, largest first
+  std::vector<ImageStats> getImageStats() {
+    HASHMAP < const CacheImage*, ImageStats > totals;
+    for( unsigned int i=0; i<shards.size(); i++ ){
+      std::lock_guard<std::mutex> lock( shards[i]->mutex );
+      for( ImageUsageMap::iterator u = shards[i]->usage.begin(); u != shards[i]->usage.end(); ++u ){
+	ImageStats& stats = totals[ u->first ];
+	if( stats.filename.empty() ){
+	  stats.filename = u->first->filename;
+	  stats.tiles = 0; stats.size = 0; stats.evictions = 0;
+	}
+	stats.tiles += u->second.tiles;
+	stats.size += u->second.size;
+	stats.evictions += u->second.evictions;
+      }
+    }
+    std::vector<ImageStats> list;
+    for( HASHMAP < const CacheImage*, ImageStats >::iterator i = totals.begin(); i != totals.end(); ++i ){
+      list.push_back( i->second );
+    }
+    std::sort( list.begin(), list.end(), ImageStats::larger );
+    return list;
   }
 
 
-  /// Create a hash index
-  /** 
-   *  @param f filename
-   *  @param r resolution number
-   *  @param t tile number
-   *  @param h horizontal sequence number
-   *  @param v vertical sequence number
-   *  @param c compression type
-   *  @param q compression quality
-   *  @return string
+  /// Claim the production of a missing tile or wait for another thread already producing it
+  /** A caller receiving true must produce the tile and then call complete(), even on failure
+   *  @param key tile key
+   *  @param tile RawTile into which the tile is placed if produced by another thread
+   *  @return true if the caller should produce the tile itself, false if it has been placed in tile
    */
-  std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
-    char tmp[1024];
-    snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
-    return std::string( tmp );
+  bool claim( const TileKey& key, RawTile& tile ) {
+    std::unique_lock<std::mutex> lock( flightMutex );
+    while( true ){
+      FlightMap::iterator i = flights.find( key );
+      if( i == flights.end() ){
+	flights[ key ] = std::shared_ptr<Flight>( new Flight() );
+	return true;
+      }
+
+      // Wait for the producing thread, keeping the flight alive after it has been removed from our index
+      std::shared_ptr<Flight> flight = i->second;
+      Timer timer;
+      timer.start();
+      while( !flight->finished ) flight->done.wait( lock );
+      coalesced++;
+      coalescedTime += timer.getTime();
+
+      if( flight->ok ){
+	tile = flight->tile;
+	return false;
+      }
+      // If the producing thread failed, try to claim the tile ourselves
+    }
+  }
+
+
+  /// Complete the production of a tile claimed via claim(), waking any waiting threads
+  /** @param key tile key
+   *  @param tile pointer to the tile produced or NULL on failure
+   */
+  void complete( const TileKey& key, const RawTile* tile ) {
+    std::lock_guard<std::mutex> lock( flightMutex );
+    FlightMap::iterator i = flights.find( key );
+    if( i == flights.end() ) return;
+    std::shared_ptr<Flight> flight = i->second;
+    flights.erase( i );
+    if( tile ){
+      flight->tile = *tile;
+      flight->ok = true;
+    }
+    flight->finished = true;
+    flight->done.notify_all();
+  }
+
+
+  /// Return the number of requests which waited for a tile produced by another thread
+  unsigned long getCoalescedWaits() { return coalesced; }
+
+
+  /// Return the total time in microseconds spent waiting for tiles produced by other threads
+  unsigned long getCoalescedTime() { return coalescedTime; }
+
+
+  /// Return the total number of tiles evicted because their image exceeded its quota
+  unsigned long getQuotaEvictions() { return quotaEvictions; }
+
+
+  /// Return the name of our eviction policy
+  const char* getPolicyName() { return shards[0]->policy->name(); }
+
+
+#ifdef HAVE_SYS_MMAN_H
+  /// Save a snapshot of our most valuable tiles for reloading after a restart
+  /** Only tiles held in our local memory are saved
+   *  @param path snapshot file
+   *  @param max maximum size in MB of tile data to save or 0 for no limit
+   *  @return number of tiles saved
+   */
+  unsigned int saveSnapshot( const std::string& path, float max );
+
+  /// Reload a snapshot saved with saveSnapshot()
+  /** Tiles from images which have since been modified or removed are skipped
+   *  @param path snapshot file
+   *  @param prefix file system prefix for image paths
+   *  @param suffix file system suffix for image paths
+   *  @return number of tiles loaded
+   */
+  unsigned int loadSnapshot( const std::string& path, const std::string& prefix, const std::string& suffix );
+#endif
+
+
+  /// Get a tile from the cache
+  /** The tile shares the reference counted data buffer of the cached entry, so no
+   *  pixel data is copied and the data remains valid even if the entry is evicted
+   *  by another thread afterwards. Tiles held within the shared memory cache are
+   *  copied out, however, and compressed tiles are decompressed into a new buffer.
+   *  JPEG tiles not held in memory are looked up in any attached disk tier.
+   *  @param key tile key
+   *  @param tile RawTile into which the cached tile is placed
+   *  @return true if found, false otherwise
+   */
+  bool getTile( const TileKey& key, RawTile& tile ) {
+
+#ifdef HAVE_SHM_OPEN
+    if( shared && shared->getTile( key, tile ) ){
+      tile.filename = key.image->filename;
+      return true;
+    }
+#endif
+
+    Shard& shard = this->_shard( key );
+    unsigned int rawLength = 0;
+    bool found = false;
+    if( maxSize > 0 ){
+      std::lock_guard<std::mutex> lock( shard.mutex );
+      TileMap::iterator miter = this->_touch( shard, key );
+      if( miter != shard.tileMap.end() ){
+	tile = miter->second->tile;
+	rawLength = miter->second->rawLength;
+	found = true;
+      }
+    }
+
+    if( !found ){
+#ifdef HAVE_PREAD
+      // Look in our disk tier and promote any tile found there back into memory
+      if( disk && key.compression == JPEG && disk->getTile( key, tile ) ){
+	tile.filename = key.image->filename;
+	this->_insert( key, tile, 0 );
+	return true;
+      }
+#endif
+      return false;
+    }
+
+    // Decompress outside of our lock, treating any failure as a cache miss
+    if( rawLength && !( codec && codec->decompress( tile, rawLength ) ) ) return false;
+
+    return true;
   }
 
 
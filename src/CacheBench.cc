@@ -0,0 +1,181 @@
+/*
+    IIPImage Server - Tile Cache Hit Throughput Benchmark
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/* Measures the rate of cache hits served by the tile cache from several threads at once.
+   The cache is first filled with tiles from a number of images, after which each thread
+   repeatedly looks up randomly chosen tiles, all of which are held in the cache.
+
+   The number of threads is doubled up to the given maximum. For each, the cache is split
+   into four shards per thread, as the server does for its worker threads, and compared
+   with a single shard.
+
+   Usage: cachebench [maximum threads] [seconds] [cache size in MB] [policy]
+
+   Built on request with "make cachebench"
+*/
+
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <stdint.h>
+
+#include "Cache.h"
+
+
+using namespace std;
+
+
+// Number of images, resolutions and tiles per resolution with which to fill our cache
+#define BENCH_IMAGES 16
+#define BENCH_RESOLUTIONS 4
+#define BENCH_TILES 64
+
+// Size in bytes of our uncompressed test tiles
+#define BENCH_TILE_SIZE 4096
+
+
+
+/// Simple per-thread xorshift random number generator
+static inline uint32_t xorshift( uint32_t& state ){
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+
+
+/// State shared between our benchmark threads
+struct Bench {
+  Cache* cache;                     ///< Cache under test
+  const vector<TileKey>* keys;      ///< Keys of our cached tiles
+  atomic<bool> running;             ///< Whether threads should continue
+  atomic<unsigned long> hits;       ///< Total number of lookups
+  atomic<unsigned long> misses;     ///< Number of lookups not found
+};
+
+
+
+/// Benchmark thread: look up randomly chosen tiles until told to stop
+static void worker( Bench* b, unsigned int n ){
+  uint32_t state = 2463534242U + n;
+  unsigned long count = 0, missed = 0;
+  const vector<TileKey>& keys = *(b->keys);
+  RawTile tile;
+  while( b->running ){
+    // Only check our flag every so often
+    for( unsigned int i=0; i<256; i++ ){
+      if( !b->cache->getTile( keys[ xorshift( state ) % keys.size() ], tile ) ) missed++;
+    }
+    count += 256;
+  }
+  b->hits += count;
+  b->misses += missed;
+}
+
+
+
+/// Run a benchmark with a particular number of shards
+/** @return number of lookups per second */
+static double bench( unsigned int threads, unsigned int shards, double seconds, float size, const string& policy ){
+
+  Cache cache( size, shards, policy );
+
+  // Fill our cache and intern our keys
+  vector<TileKey> keys;
+  vector<const CacheImage*> images;
+  for( unsigned int i=0; i<BENCH_IMAGES; i++ ){
+    string filename = "image" + to_string( i ) + ".tif";
+    const CacheImage* image = cache.getImage( filename );
+    images.push_back( image );
+    for( unsigned int r=0; r<BENCH_RESOLUTIONS; r++ ){
+      for( unsigned int t=0; t<BENCH_TILES; t++ ){
+	RawTile tile( t, r, 0, 90, 64, 64, 1, 8 );
+	tile.filename = filename;
+	tile.timestamp = 1;
+	tile.dataLength = BENCH_TILE_SIZE;
+	tile.allocate( tile.dataLength );
+	cache.insert( image, tile );
+	keys.push_back( TileKey::make( image, r, t, 0, 90, UNCOMPRESSED, 0 ) );
+      }
+    }
+  }
+
+  if( cache.getNumElements() != keys.size() ){
+    cerr << "cachebench: cache too small to hold all " << keys.size() << " test tiles" << endl;
+    exit( 1 );
+  }
+
+  Bench b;
+  b.cache = &cache;
+  b.keys = &keys;
+  b.running = true;
+  b.hits = 0;
+  b.misses = 0;
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<thread> workers;
+  for( unsigned int n=0; n<threads; n++ ) workers.push_back( thread( worker, &b, n ) );
+  this_thread::sleep_for( chrono::duration<double>( seconds ) );
+  b.running = false;
+  for( unsigned int n=0; n<threads; n++ ) workers[n].join();
+  double elapsed = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+  if( b.misses > 0 ) cerr << "cachebench: " << b.misses << " unexpected misses" << endl;
+
+  for( unsigned int i=0; i<images.size(); i++ ) cache.releaseImage( images[i] );
+
+  return b.hits / elapsed;
+}
+
+
+
+int main( int argc, char* argv[] ){
+
+  unsigned int threads = ( argc > 1 ) ? atoi( argv[1] ) : thread::hardware_concurrency();
+  double seconds = ( argc > 2 ) ? atof( argv[2] ) : 2.0;
+  float size = ( argc > 3 ) ? atof( argv[3] ) : 64.0;
+  string policy = ( argc > 4 ) ? argv[4] : "lru";
+  if( threads < 1 ) threads = 1;
+
+  cout << "Tile cache hit throughput: up to " << threads << " thread(s), " << size << " MB, "
+       << policy << " policy, " << BENCH_IMAGES*BENCH_RESOLUTIONS*BENCH_TILES << " tiles" << endl;
+  cout << "threads\tshards\t1 shard lookups/s\tsharded lookups/s\tspeedup" << endl;
+
+  for( unsigned int n = 1; n <= threads; n = ( n < threads && 2*n > threads ) ? threads : 2*n ){
+
+    // Shard as the server does for this many workers, within the limit set by our cache size
+    unsigned int shards = ( n > 1 ) ? 4*n : 1;
+    Cache probe( size, shards, policy );
+    shards = probe.getNumShards();
+
+    double base = bench( n, 1, seconds, size, policy );
+    double rate = ( shards > 1 ) ? bench( n, shards, seconds, size, policy ) : base;
+    cout << n << "\t" << shards << "\t" << (unsigned long) base << "\t\t"
+	 << (unsigned long) rate << "\t\t" << rate / base << "x" << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,403 @@
+// Tile Cache Eviction Policies
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _CACHEPOLICY_H
+#define _CACHEPOLICY_H
+
+
+#include <list>
+#include <map>
+#include <vector>
+#include <utility>
+#include <string>
+#include <algorithm>
+#include <cctype>
+#include <stdint.h>
+#include "HashMap.h"
+#include "RawTile.h"
+#include "TileKey.h"
+
+
+
+/// A single entry within the tile cache
+struct CacheEntry {
+
+  /// Tile key
+  TileKey key;
+
+  /// Cached tile
+  RawTile tile;
+
+  /// Memory accounted for this entry in bytes
+  unsigned long size;
+
+  /// Queue within which the policy has placed this entry
+  unsigned int queue;
+
+  /// Access frequency counter maintained by the policy
+  unsigned int frequency;
+
+  /// Cost in microseconds of decoding and compressing this tile
+  unsigned long cost;
+
+  /// Uncompressed data length if the tile data is held compressed by the cache's codec, otherwise 0
+  unsigned int rawLength;
+
+  /// Priority and sequence number within a priority ordered policy
+  std::pair<double,unsigned long> priority;
+
+  /// Position of this entry within its policy queue
+  std::list<CacheEntry*>::iterator position;
+
+  /// Position of this entry within the per-image list used for quota enforcement
+  std::list<CacheEntry*>::iterator imagePosition;
+
+  /// Constructor
+  /** @param k tile key
+      @param r tile
+   */
+  CacheEntry( const TileKey& k, const RawTile& r ) :
+    key( k ), tile( r ), size( 0 ), queue( 0 ), frequency( 0 ), cost( 0 ), rawLength( 0 ), priority( 0.0, 0 ) {};
+
+};
+
+
+
+/// Base class for tile cache eviction policies
+/** A policy orders the entries of a single cache shard and chooses which entry to evict
+    when the shard is full. Entries are owned by the cache, which notifies the policy of
+    each insertion, hit and removal. Policies are not thread safe and are only called
+    with their shard lock held.
+ */
+class CachePolicy {
+
+ protected:
+
+  /// Max memory size in bytes of the shard using this policy
+  unsigned long maxSize;
+
+
+ public:
+
+  /// Constructor
+  /** @param max maximum size in bytes of our shard */
+  CachePolicy( unsigned long max ) : maxSize( max ) {};
+
+  /// Virtual destructor
+  virtual ~CachePolicy() {};
+
+  /// Return the name of this policy
+  virtual const char* name() const = 0;
+
+  /// Add a newly inserted entry
+  virtual void insert( CacheEntry* e ) = 0;
+
+  /// Record a cache hit on an entry
+  virtual void touch( CacheEntry* e ) = 0;
+
+  /// Remove an entry which is being deleted from the cache
+  virtual void remove( CacheEntry* e ) = 0;
+
+  /// Choose an entry to evict and remove it from the policy
+  /** @return entry to be deleted by the cache or NULL if empty */
+  virtual CacheEntry* evict() = 0;
+
+  /// Forget all entries
+  virtual void clear() = 0;
+
+  /// List our entries, those most worth keeping first
+  /** @param l list to which our entries are appended */
+  virtual void hottest( std::vector<CacheEntry*>& l ) const = 0;
+
+
+  /// Create a policy by name
+  /** @param type policy name: "lru", "s3fifo" or "gds" (case insensitive). Unknown names give LRU.
+      @param max maximum size in bytes of our shard
+      @return newly allocated policy
+   */
+  static CachePolicy* create( const std::string& type, unsigned long max );
+
+};
+
+
+
+/// Classic least recently used eviction
+class LRUPolicy : public CachePolicy {
+
+ private:
+
+  /// Entries in order of use, most recently used first
+  std::list<CacheEntry*> entries;
+
+
+ public:
+
+  /// Constructor
+  LRUPolicy( unsigned long max ) : CachePolicy( max ) {};
+
+  const char* name() const { return "LRU"; };
+
+  void insert( CacheEntry* e ){
+    entries.push_front( e );
+    e->position = entries.begin();
+  };
+
+  void touch( CacheEntry* e ){
+    // Move the entry to the head of the list
+    entries.splice( entries.begin(), entries, e->position );
+  };
+
+  void remove( CacheEntry* e ){ entries.erase( e->position ); };
+
+  CacheEntry* evict(){
+    if( entries.empty() ) return NULL;
+    CacheEntry* e = entries.back();
+    entries.pop_back();
+    return e;
+  };
+
+  void clear(){ entries.clear(); };
+
+  void hottest( std::vector<CacheEntry*>& l ) const {
+    l.insert( l.end(), entries.begin(), entries.end() );
+  };
+
+};
+
+
+
+/// S3-FIFO scan-resistant eviction
+/** Based on "FIFO queues are all you need for cache eviction" (Yang et al., SOSP 2023).
+    New tiles enter a small probationary FIFO queue holding around 10% of the memory. Tiles
+    which are hit again before reaching the end of this queue are promoted to the main FIFO
+    queue, while the rest are evicted and remembered in a ghost queue of key hashes. Tiles
+    re-requested while in the ghost queue are inserted directly into the main queue, which
+    gives tiles with a non-zero hit count a further pass. Tiles touched only once, such as
+    those requested by a crawler sweeping a whole image, therefore pass through the small
+    queue without displacing the frequently used tiles held in the main queue.
+ */
+class S3FIFOPolicy : public CachePolicy {
+
+ private:
+
+  /// Queue identifiers
+  enum { SMALL, MAIN };
+
+  /// Maximum value of our frequency counters
+  static const unsigned int MAX_FREQUENCY = 3;
+
+  /// Probationary queue, newest first
+  std::list<CacheEntry*> smallQueue;
+
+  /// Main queue, newest first
+  std::list<CacheEntry*> mainQueue;
+
+  /// Memory held by entries in our small queue
+  unsigned long smallSize;
+
+  /// Hashes of keys recently evicted from our small queue, newest first
+  std::list<uint64_t> ghost;
+
+  /// Number of occurrences of each hash within our ghost queue
+  HASHMAP<uint64_t,unsigned int> ghostIndex;
+
+
+  /// Remember an evicted key, keeping our ghost queue no longer than the number of cached entries
+  void _addGhost( uint64_t h ){
+    ghost.push_front( h );
+    ghostIndex[h]++;
+    while( ghost.size() > std::max( (size_t) 1, smallQueue.size() + mainQueue.size() ) ){
+      HASHMAP<uint64_t,unsigned int>::iterator i = ghostIndex.find( ghost.back() );
+      if( --(i->second) == 0 ) ghostIndex.erase( i );
+      ghost.pop_back();
+    }
+  };
+
+
+ public:
+
+  /// Constructor
+  S3FIFOPolicy( unsigned long max ) : CachePolicy( max ), smallSize( 0 ) {};
+
+  const char* name() const { return "S3-FIFO"; };
+
+  void insert( CacheEntry* e ){
+    e->frequency = 0;
+    if( ghostIndex.find( e->key.hash() ) != ghostIndex.end() ){
+      e->queue = MAIN;
+      mainQueue.push_front( e );
+      e->position = mainQueue.begin();
+    }
+    else{
+      e->queue = SMALL;
+      smallQueue.push_front( e );
+      e->position = smallQueue.begin();
+      smallSize += e->size;
+    }
+  };
+
+  void touch( CacheEntry* e ){
+    if( e->frequency < MAX_FREQUENCY ) e->frequency++;
+  };
+
+  void remove( CacheEntry* e ){
+    if( e->queue == SMALL ){
+      smallQueue.erase( e->position );
+      smallSize -= e->size;
+    }
+    else mainQueue.erase( e->position );
+  };
+
+  CacheEntry* evict(){
+    while( true ){
+      // Evict from our small queue if it exceeds its share or if it is all we have
+      if( !smallQueue.empty() && ( smallSize >= maxSize/10 || mainQueue.empty() ) ){
+	CacheEntry* e = smallQueue.back();
+	smallSize -= e->size;
+	// Promote tiles which have been hit since insertion
+	if( e->frequency > 0 ){
+	  e->queue = MAIN;
+	  e->frequency = 0;
+	  mainQueue.splice( mainQueue.begin(), smallQueue, e->position );
+	  continue;
+	}
+	smallQueue.pop_back();
+	_addGhost( e->key.hash() );
+	return e;
+      }
+      else if( !mainQueue.empty() ){
+	CacheEntry* e = mainQueue.back();
+	// Give tiles which have been hit another pass
+	if( e->frequency > 0 ){
+	  e->frequency--;
+	  mainQueue.splice( mainQueue.begin(), mainQueue, e->position );
+	  continue;
+	}
+	mainQueue.pop_back();
+	return e;
+      }
+      else return NULL;
+    }
+  };
+
+  void clear(){
+    smallQueue.clear();
+    mainQueue.clear();
+    ghost.clear();
+    ghostIndex.clear();
+    smallSize = 0;
+  };
+
+  void hottest( std::vector<CacheEntry*>& l ) const {
+    // Tiles in our main queue have proven themselves, so list these first, followed
+    // by those in our small queue which have been hit since insertion
+    l.insert( l.end(), mainQueue.begin(), mainQueue.end() );
+    std::list<CacheEntry*>::const_iterator i;
+    for( i = smallQueue.begin(); i != smallQueue.end(); ++i ) if( (*i)->frequency > 0 ) l.push_back( *i );
+    for( i = smallQueue.begin(); i != smallQueue.end(); ++i ) if( (*i)->frequency == 0 ) l.push_back( *i );
+  };
+
+};
+
+
+
+/// GreedyDual-Size cost-aware eviction
+/** Based on "Cost-Aware WWW Proxy Caching Algorithms" (Cao and Irani, 1997). Each entry is
+    given a priority of L + cost/size, where cost is the time taken to decode and compress
+    the tile and L is an inflation value set to the priority of the most recently evicted
+    entry. The entry with the lowest priority is evicted first and priorities are refreshed
+    on each hit. Tiles which are expensive to regenerate relative to the memory they
+    occupy, such as JPEG2000 tiles, therefore survive longer than those which are cheap to
+    decode, while the inflation value ages out entries that are no longer used. Entries
+    with equal priority are evicted in least recently used order.
+ */
+class GreedyDualSizePolicy : public CachePolicy {
+
+ private:
+
+  /// Entries ordered by priority, then by sequence number
+  std::map< std::pair<double,unsigned long>, CacheEntry* > entries;
+
+  /// Inflation value
+  double inflation;
+
+  /// Sequence counter
+  unsigned long sequence;
+
+
+  /// Calculate the priority of an entry and add it to our queue
+  void _queue( CacheEntry* e ){
+    // Treat unknown or sub-microsecond costs as a nominal 1 microsecond
+    double cost = ( e->cost > 0 ) ? (double) e->cost : 1.0;
+    e->priority = std::make_pair( inflation + cost / (double)( e->size ? e->size : 1 ), sequence++ );
+    entries[ e->priority ] = e;
+  };
+
+
+ public:
+
+  /// Constructor
+  GreedyDualSizePolicy( unsigned long max ) : CachePolicy( max ), inflation( 0.0 ), sequence( 0 ) {};
+
+  const char* name() const { return "GreedyDual-Size"; };
+
+  void insert( CacheEntry* e ){ _queue( e ); };
+
+  void touch( CacheEntry* e ){
+    entries.erase( e->priority );
+    _queue( e );
+  };
+
+  void remove( CacheEntry* e ){ entries.erase( e->priority ); };
+
+  CacheEntry* evict(){
+    if( entries.empty() ) return NULL;
+    CacheEntry* e = entries.begin()->second;
+    inflation = e->priority.first;
+    entries.erase( entries.begin() );
+    return e;
+  };
+
+  void clear(){
+    entries.clear();
+    inflation = 0.0;
+  };
+
+  void hottest( std::vector<CacheEntry*>& l ) const {
+    std::map< std::pair<double,unsigned long>, CacheEntry* >::const_reverse_iterator i;
+    for( i = entries.rbegin(); i != entries.rend(); ++i ) l.push_back( i->second );
+  };
+
+};
+
+
+
+inline CachePolicy* CachePolicy::create( const std::string& type, unsigned long max ){
+  std::string t = type;
+  std::transform( t.begin(), t.end(), t.begin(), ::tolower );
+  if( t == "s3fifo" || t == "s3-fifo" ) return new S3FIFOPolicy( max );
+  if( t == "gds" || t == "greedydual" ) return new GreedyDualSizePolicy( max );
+  return new LRUPolicy( max );
+}
+
+
+#endif
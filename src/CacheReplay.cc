@@ -0,0 +1,262 @@
+/*
+    IIPImage Server - Tile Cache Trace Replay
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/* Replays a trace of tile requests through the tile cache with each of our eviction
+   policies and reports their hit ratios. Each request is looked up in the cache and, on
+   a miss, a tile of the given size and decoding cost is inserted.
+
+   Traces are text files with one request per line:
+
+     <image path> <resolution> <tile> <size in bytes> [<decoding cost in microseconds>]
+
+   Blank lines and lines starting with # are ignored. Without a trace file, a synthetic
+   trace is generated: requests for a hot set of tiles following a Zipf distribution, with
+   decoding costs varying between images, interleaved with crawler-like sequential sweeps
+   across tiles which are each requested only once.
+
+   Usage: cachereplay [cache size in MB] [trace file]
+
+   Built on request with "make cachereplay"
+*/
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdint.h>
+
+#include "Cache.h"
+
+
+using namespace std;
+
+
+// Synthetic trace: number of requests, hot images and tiles per hot image
+#define REPLAY_REQUESTS 200000
+#define REPLAY_HOT_IMAGES 8
+#define REPLAY_HOT_TILES 256
+
+// Zipf exponent of our hot set
+#define REPLAY_ZIPF 0.9
+
+// Size in bytes of synthetic tiles
+#define REPLAY_TILE_SIZE 16384
+
+// Synthetic crawler sweeps: one sweep of this many tiles on average every REPLAY_SCAN_INTERVAL requests
+#define REPLAY_SCAN_LENGTH 2000
+#define REPLAY_SCAN_INTERVAL 10000
+
+
+
+/// A single request within a trace
+struct Request {
+  string filename;         ///< Image path
+  int resolution;          ///< Resolution number
+  int tile;                ///< Tile number
+  unsigned int size;       ///< Tile size in bytes
+  long cost;               ///< Decoding cost in microseconds
+};
+
+
+/// Results of replaying a trace
+struct Result {
+  unsigned long hits;      ///< Number of requests found in the cache
+  unsigned long bytes;     ///< Number of bytes served from the cache
+  double saved;            ///< Decoding time in microseconds saved by cache hits
+};
+
+
+
+/// Simple xorshift random number generator
+static inline uint32_t xorshift( uint32_t& state ){
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+
+/// Random number in the range [0,1)
+static inline double uniform( uint32_t& state ){
+  return xorshift( state ) / 4294967296.0;
+}
+
+
+
+/// Load a trace from a file
+/** @return false if the file cannot be read */
+static bool load( const string& path, vector<Request>& trace ){
+  ifstream in( path.c_str() );
+  if( !in ) return false;
+  string line;
+  while( getline( in, line ) ){
+    if( line.empty() || line[0] == '#' ) continue;
+    istringstream fields( line );
+    Request r;
+    r.cost = 0;
+    if( !( fields >> r.filename >> r.resolution >> r.tile >> r.size ) ) continue;
+    fields >> r.cost;
+    trace.push_back( r );
+  }
+  return true;
+}
+
+
+
+/// Generate a synthetic trace of a Zipf distributed hot set interleaved with sequential sweeps
+static void generate( vector<Request>& trace ){
+
+  uint32_t state = 2463534242U;
+
+  // Cumulative Zipf distribution over our hot tiles
+  unsigned int n = REPLAY_HOT_IMAGES * REPLAY_HOT_TILES;
+  vector<double> cdf( n );
+  double sum = 0.0;
+  for( unsigned int i=0; i<n; i++ ){
+    sum += 1.0 / pow( (double)( i + 1 ), REPLAY_ZIPF );
+    cdf[i] = sum;
+  }
+  for( unsigned int i=0; i<n; i++ ) cdf[i] /= sum;
+
+  // Scatter popularity ranks across images and tiles
+  vector<unsigned int> ranks( n );
+  for( unsigned int i=0; i<n; i++ ) ranks[i] = i;
+  for( unsigned int i=n-1; i>0; i-- ) swap( ranks[i], ranks[ xorshift( state ) % (i+1) ] );
+
+  unsigned int sweep = 0, remaining = 0, next = 0;
+
+  for( unsigned int i=0; i<REPLAY_REQUESTS; i++ ){
+    Request r;
+    r.resolution = 0;
+    r.size = REPLAY_TILE_SIZE;
+
+    // Start a new sweep at random, with REPLAY_SCAN_INTERVAL requests between sweeps on average
+    if( remaining == 0 && xorshift( state ) % REPLAY_SCAN_INTERVAL == 0 ){
+      remaining = REPLAY_SCAN_LENGTH;
+      next = 0;
+      sweep++;
+    }
+
+    // Crawler sweeps alternate with our hot set so that hot tiles continue to be requested
+    if( remaining > 0 && ( i & 1 ) ){
+      r.filename = "sweep" + to_string( sweep ) + ".tif";
+      r.tile = next++;
+      r.cost = 2000;
+      remaining--;
+    }
+    else{
+      unsigned int k = upper_bound( cdf.begin(), cdf.end(), uniform( state ) ) - cdf.begin();
+      if( k >= n ) k = n - 1;
+      unsigned int image = ranks[k] / REPLAY_HOT_TILES;
+      r.filename = "hot" + to_string( image ) + ".tif";
+      r.tile = ranks[k] % REPLAY_HOT_TILES;
+      // Images differ in how expensive their tiles are to decode
+      r.cost = 500 << ( image % 4 );
+    }
+    trace.push_back( r );
+  }
+}
+
+
+
+/// Replay a trace through a cache using a particular policy
+static Result replay( const vector<Request>& trace, float size, const string& policy ){
+
+  Cache cache( size, 1, policy );
+  Result result;
+  result.hits = 0;
+  result.bytes = 0;
+  result.saved = 0.0;
+
+  // Intern each image once, as the server does for each request
+  map<string, const CacheImage*> images;
+
+  RawTile tile;
+  for( unsigned int i=0; i<trace.size(); i++ ){
+    const Request& r = trace[i];
+    const CacheImage*& image = images[ r.filename ];
+    if( !image ) image = cache.getImage( r.filename );
+    if( cache.getTile( TileKey::make( image, r.resolution, r.tile, 0, 90, UNCOMPRESSED, 0 ), tile ) ){
+      result.hits++;
+      result.bytes += r.size;
+      result.saved += r.cost;
+      continue;
+    }
+    RawTile t( r.tile, r.resolution, 0, 90, 0, 0, 1, 8 );
+    t.filename = r.filename;
+    t.timestamp = 1;
+    t.dataLength = r.size;
+    t.allocate( t.dataLength );
+    cache.insert( image, t, r.cost );
+  }
+
+  for( map<string, const CacheImage*>::iterator i = images.begin(); i != images.end(); ++i ){
+    cache.releaseImage( i->second );
+  }
+
+  return result;
+}
+
+
+
+int main( int argc, char* argv[] ){
+
+  float size = ( argc > 1 ) ? atof( argv[1] ) : 16.0;
+
+  vector<Request> trace;
+  if( argc > 2 ){
+    if( !load( argv[2], trace ) ){
+      cerr << "cachereplay: unable to read trace file '" << argv[2] << "'" << endl;
+      return 1;
+    }
+  }
+  else generate( trace );
+
+  if( trace.empty() ){
+    cerr << "cachereplay: empty trace" << endl;
+    return 1;
+  }
+
+  unsigned long bytes = 0;
+  double cost = 0.0;
+  for( unsigned int i=0; i<trace.size(); i++ ){
+    bytes += trace[i].size;
+    cost += trace[i].cost;
+  }
+
+  cout << "Replaying " << trace.size() << " requests through a " << size << " MB tile cache" << endl;
+  cout << "policy\thit ratio\tbyte hit ratio\tdecoding time saved" << endl;
+
+  const char* policies[] = { "lru", "s3fifo", "gds" };
+  for( unsigned int p=0; p<3; p++ ){
+    Result result = replay( trace, size, policies[p] );
+    cout << policies[p] << "\t" << (double) result.hits / trace.size()
+	 << "\t\t" << (double) result.bytes / bytes
+	 << "\t\t" << ( cost > 0 ? result.saved / cost : 0.0 ) << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,190 @@
+/*
+    IIPImage Server - Tile Cache Claim Test
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/* Checks that concurrent misses for the same tile are coalesced by the tile cache's
+   claim() and complete(): threads fetching a tile the same way as TileManager::getTile()
+   must decode each tile only once, whether they wait for another thread's decode or
+   claim the tile just after another thread has cached it and completed its flight.
+   A thread waiting on a decode which fails must then decode the tile itself.
+
+   Built and run with "make check"
+*/
+
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "Cache.h"
+
+
+using namespace std;
+
+
+// Number of threads fetching each tile at once and number of tiles fetched
+#define TEST_THREADS 8
+#define TEST_TILES 500
+
+// Size in bytes of our test tiles
+#define TEST_TILE_SIZE 4096
+
+
+
+/// Number of failed checks
+static unsigned int failures = 0;
+
+
+
+/// State shared between our test threads
+struct Test {
+  Cache* cache;                     ///< Tile cache
+  const CacheImage* image;          ///< Interned image of our tiles
+  atomic<unsigned int> decoded;     ///< Number of tiles decoded
+  atomic<bool> missed;              ///< Whether a paused fetch has missed the cache
+  atomic<bool> resume;              ///< Whether a paused fetch may claim its tile
+};
+
+
+
+/// Report the result of a check
+/** @param name description of check
+    @param ok whether the check passed */
+static void check( const string& name, bool ok ){
+  cout << ( ok ? "ok   " : "FAIL " ) << name << endl;
+  if( !ok ) failures++;
+}
+
+
+/// Create a test tile owning a new buffer
+static RawTile make( int n ){
+  RawTile tile( n, 0, 0, 90, 64, 64, 1, 8 );
+  tile.filename = "test.tif";
+  tile.timestamp = 1;
+  tile.dataLength = TEST_TILE_SIZE;
+  tile.allocate( tile.dataLength );
+  return tile;
+}
+
+
+/// Fetch a tile as TileManager::getTile() does, decoding and caching it on a miss
+/** @param pause whether to wait for test->resume between missing the cache and claiming the tile */
+static void fetch( Test* test, int n, RawTile* tile, bool pause ){
+  Cache* cache = test->cache;
+  TileKey key = TileKey::make( test->image, 0, n, 0, 90, UNCOMPRESSED, 0 );
+
+  if( cache->getTile( key, *tile ) ) return;
+  if( pause ){
+    test->missed = true;
+    while( !test->resume ) this_thread::yield();
+  }
+  if( !cache->claim( key, *tile ) ) return;
+  if( cache->getTile( key, *tile ) ){
+    cache->complete( key, tile );
+    return;
+  }
+
+  test->decoded++;
+  RawTile t = make( n );
+  cache->insert( test->image, t );
+  cache->complete( key, &t );
+  *tile = t;
+}
+
+
+/// Fetch a sequence of tiles from several threads at once
+static void fetchAll( Test* test, vector<RawTile>* tiles ){
+  for( int n=0; n<TEST_TILES; n++ ) fetch( test, n, &(*tiles)[n], false );
+}
+
+
+
+int main(){
+
+  Cache cache( 64.0 );
+  Test test;
+  test.cache = &cache;
+  test.image = cache.getImage( "test.tif" );
+  test.decoded = 0;
+  test.missed = false;
+  test.resume = false;
+
+  // Several threads fetching the same tiles decode each only once and share its buffer
+  vector< vector<RawTile> > tiles( TEST_THREADS, vector<RawTile>( TEST_TILES ) );
+  vector<thread> threads;
+  for( unsigned int i=0; i<TEST_THREADS; i++ ) threads.push_back( thread( fetchAll, &test, &tiles[i] ) );
+  for( unsigned int i=0; i<TEST_THREADS; i++ ) threads[i].join();
+
+  bool shared = true;
+  for( unsigned int i=1; i<TEST_THREADS; i++ ){
+    for( int n=0; n<TEST_TILES; n++ ){
+      if( !tiles[i][n].data || tiles[i][n].data != tiles[0][n].data ) shared = false;
+    }
+  }
+  check( "concurrent fetches decode each tile once", test.decoded == TEST_TILES );
+  check( "concurrent fetches share each tile's buffer", shared );
+
+  // A thread waiting on another's decode receives its tile
+  TileKey key = TileKey::make( test.image, 0, TEST_TILES, 0, 90, UNCOMPRESSED, 0 );
+  RawTile r, w;
+  test.decoded = 0;
+  check( "first claim of a missing tile succeeds", cache.claim( key, r ) );
+  thread waiter( fetch, &test, TEST_TILES, &w, false );
+  this_thread::sleep_for( chrono::milliseconds( 50 ) );
+  r = make( TEST_TILES );
+  cache.insert( test.image, r );
+  cache.complete( key, &r );
+  waiter.join();
+  check( "waiting thread shares the completed tile", test.decoded == 0 && w.data == r.data );
+
+  // A thread waiting on a failed decode decodes the tile itself
+  key = TileKey::make( test.image, 0, TEST_TILES+1, 0, 90, UNCOMPRESSED, 0 );
+  RawTile f;
+  check( "claim of another missing tile succeeds", cache.claim( key, r ) );
+  thread retry( fetch, &test, TEST_TILES+1, &f, false );
+  this_thread::sleep_for( chrono::milliseconds( 50 ) );
+  cache.complete( key, NULL );
+  retry.join();
+  check( "waiting thread decodes a tile whose decode failed", test.decoded == 1 && f.data != NULL );
+
+  // A thread which missed the cache before another thread cached the tile and completed
+  // its flight finds the tile once it has claimed it
+  key = TileKey::make( test.image, 0, TEST_TILES+2, 0, 90, UNCOMPRESSED, 0 );
+  RawTile l;
+  test.decoded = 0;
+  thread late( fetch, &test, TEST_TILES+2, &l, true );
+  while( !test.missed ) this_thread::yield();
+  check( "claim of a tile missed by another thread succeeds", cache.claim( key, r ) );
+  r = make( TEST_TILES+2 );
+  cache.insert( test.image, r );
+  cache.complete( key, &r );
+  test.resume = true;
+  late.join();
+  check( "late claim shares the cached tile", test.decoded == 0 && l.data == r.data );
+  check( "late claim completes its flight", cache.claim( key, r ) );
+  cache.complete( key, NULL );
+
+  cache.releaseImage( test.image );
+
+  cout << ( failures ? "FAILED" : "All tests passed" ) << endl;
+  return failures ? 1 : 0;
+}
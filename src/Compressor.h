@@ -74,6 +74,10 @@ class Compressor {
   inline void setICCProfile( const std::string& profile ){ icc = profile; }
 
 
+  /// Get the ICC profile
+  inline const std::string& getICCProfile(){ return icc; }
+
+
   /// Set XMP metadata
   /** @param x XMP metadata string */
   inline void setXMPMetadata( const std::string& x ){ xmp = x; }
@@ -271,7 +271,7 @@ RawTile DSOImage::getTile( int seq, int angle, unsigned int resolution, int laye
 
   RawTile rawtile( tile, resolution, seq, angle,
 		   w, h, 3, 8 );
-  rawtile.data = data;
+  rawtile.adopt( data );
   rawtile.dataLength = data_len;
   return rawtile;
 }  
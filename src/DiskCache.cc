@@ -0,0 +1,457 @@
+/*
+    IIPImage Server - Persistent Disk Tile Cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifdef HAVE_PREAD
+
+#include "Cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+using namespace std;
+
+
+// Identifiers for our content and index files
+#define DISKCACHE_MAGIC 0x49495044  // "IIPD"
+#define DISKCACHE_VERSION 1
+
+// Name of our saved index within the cache directory
+#define DISKCACHE_INDEX "index"
+
+// Age in seconds after which left over temporary files are removed
+#define DISKCACHE_TMP_AGE 3600
+
+
+/// Header at the start of each content file
+struct DiskRecord {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash;
+  int32_t resolution;
+  int32_t tileNum;
+  int32_t hSequence;
+  int32_t vSequence;
+  int32_t compression;
+  int32_t quality;
+  int64_t timestamp;
+  uint32_t width;
+  uint32_t height;
+  int32_t channels;
+  int32_t bpc;
+  int32_t sampleType;
+  uint32_t padded;
+  uint32_t key_length;     ///< Length of the image path stored after this header
+  uint32_t data_length;    ///< Length of the tile data stored after the image path
+};
+
+
+/// Header of our saved index, which is followed by pairs of hashes and file sizes
+struct DiskIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t count;
+};
+
+
+
+// Write a complete buffer, retrying after partial writes
+static bool writeAll( int fd, const void* buf, size_t length )
+{
+  const char* p = (const char*) buf;
+  while( length > 0 ){
+    ssize_t n = ::write( fd, p, length );
+    if( n < 0 ){
+      if( errno == EINTR ) continue;
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+
+
+// Read a complete buffer at a given offset, retrying after partial reads
+static bool readAll( int fd, void* buf, size_t length, off_t offset )
+{
+  char* p = (char*) buf;
+  while( length > 0 ){
+    ssize_t n = ::pread( fd, p, length, offset );
+    if( n < 0 ){
+      if( errno == EINTR ) continue;
+      return false;
+    }
+    if( n == 0 ) return false;
+    p += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+}
+
+
+
+DiskCache::DiskCache( const string& dir, float max ) :
+  directory( dir ), maxSize( (uint64_t)( max * 1024000 ) ), currentSize( 0 ), sequence( 0 )
+{
+  // Remove any trailing slashes
+  while( directory.size() > 1 && directory[directory.size()-1] == '/' ) directory.erase( directory.size()-1 );
+
+  if( mkdir( directory.c_str(), 0755 ) != 0 && errno != EEXIST ){
+    throw string( "DiskCache :: Unable to create cache directory '" + directory + "': " + strerror(errno) );
+  }
+
+  struct stat st;
+  if( stat( directory.c_str(), &st ) != 0 || !S_ISDIR( st.st_mode ) || access( directory.c_str(), R_OK|W_OK|X_OK ) != 0 ){
+    throw string( "DiskCache :: Cache directory '" + directory + "' is not a writable directory" );
+  }
+
+  // Reload our saved index or, failing that, rebuild it from the directory contents
+  if( !this->load() ) this->scan();
+}
+
+
+
+DiskCache::~DiskCache()
+{
+  this->save();
+}
+
+
+
+string DiskCache::path( uint64_t h ) const
+{
+  char name[32];
+  snprintf( name, sizeof(name), "/%02x/%016llx", (unsigned int)( h >> 56 ), (unsigned long long) h );
+  return directory + name;
+}
+
+
+
+void DiskCache::add( uint64_t h, uint64_t size )
+{
+  EntryMap::iterator i = index.find( h );
+  if( i != index.end() ){
+    // Move to the head of our list and update the size, which changes if the file was rewritten
+    entries.splice( entries.begin(), entries, i->second );
+    currentSize = currentSize - i->second->size + size;
+    i->second->size = size;
+  }
+  else{
+    Entry e;
+    e.hash = h;
+    e.size = size;
+    entries.push_front( e );
+    index[h] = entries.begin();
+    currentSize += size;
+  }
+
+  // Evict least recently used files until we are within our limit, always keeping the newest
+  while( currentSize > maxSize && entries.size() > 1 ){
+    const Entry& victim = entries.back();
+    unlink( this->path( victim.hash ).c_str() );
+    currentSize -= victim.size;
+    index.erase( victim.hash );
+    entries.pop_back();
+  }
+}
+
+
+
+void DiskCache::forget( uint64_t h )
+{
+  EntryMap::iterator i = index.find( h );
+  if( i == index.end() ) return;
+  currentSize -= i->second->size;
+  entries.erase( i->second );
+  index.erase( i );
+}
+
+
+
+bool DiskCache::insert( const TileKey& key, const RawTile& r )
+{
+  if( !r.data || r.dataLength == 0 ) return false;
+
+  const string& filename = key.image->filename;
+  uint64_t h = key.hash();
+  uint64_t size = sizeof(DiskRecord) + filename.length() + r.dataLength;
+  if( size > maxSize ) return false;
+
+  DiskRecord record;
+  memset( &record, 0, sizeof(record) );
+  record.magic = DISKCACHE_MAGIC;
+  record.version = DISKCACHE_VERSION;
+  record.hash = h;
+  record.resolution = key.resolution;
+  record.tileNum = key.tile;
+  record.hSequence = key.hSequence;
+  record.vSequence = key.vSequence;
+  record.compression = key.compression;
+  record.quality = key.quality;
+  record.timestamp = r.timestamp;
+  record.width = r.width;
+  record.height = r.height;
+  record.channels = r.channels;
+  record.bpc = r.bpc;
+  record.sampleType = r.sampleType;
+  record.padded = r.padded;
+  record.key_length = filename.length();
+  record.data_length = r.dataLength;
+
+  string target = this->path( h );
+
+  // Write to a unique temporary file alongside our target
+  unsigned long n;
+  {
+    lock_guard<std::mutex> lock( mutex );
+    n = sequence++;
+  }
+  char suffix[64];
+  snprintf( suffix, sizeof(suffix), ".%ld.%lu.tmp", (long) getpid(), n );
+  string tmp = target + suffix;
+
+  int fd = open( tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+  if( fd < 0 && errno == ENOENT ){
+    // Create our sub-directory on first use
+    string subdir = target.substr( 0, target.rfind( '/' ) );
+    mkdir( subdir.c_str(), 0755 );
+    fd = open( tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+  }
+  if( fd < 0 ) return false;
+
+  bool ok = writeAll( fd, &record, sizeof(record) ) &&
+    writeAll( fd, filename.data(), filename.length() ) &&
+    writeAll( fd, r.data, r.dataLength );
+  if( close( fd ) != 0 ) ok = false;
+
+  // Atomically replace any existing file
+  if( !ok || rename( tmp.c_str(), target.c_str() ) != 0 ){
+    unlink( tmp.c_str() );
+    return false;
+  }
+
+  lock_guard<std::mutex> lock( mutex );
+  this->add( h, size );
+  return true;
+}
+
+
+
+bool DiskCache::getTile( const TileKey& key, RawTile& tile )
+{
+  const string& filename = key.image->filename;
+  uint64_t h = key.hash();
+
+  int fd = open( this->path( h ).c_str(), O_RDONLY );
+  if( fd < 0 ){
+    // Forget any file evicted by another process
+    lock_guard<std::mutex> lock( mutex );
+    this->forget( h );
+    return false;
+  }
+
+  // Read our header and image path, checking that this file holds the requested tile
+  vector<char> head( sizeof(DiskRecord) + filename.length() );
+  DiskRecord record;
+  struct stat st;
+  bool ok = ( fstat( fd, &st ) == 0 ) && readAll( fd, &head[0], head.size(), 0 );
+  if( ok ){
+    memcpy( &record, &head[0], sizeof(record) );
+    ok = ( record.magic == DISKCACHE_MAGIC && record.version == DISKCACHE_VERSION && record.hash == h &&
+	   record.resolution == key.resolution && record.tileNum == key.tile &&
+	   record.hSequence == key.hSequence && record.vSequence == key.vSequence &&
+	   record.compression == key.compression && record.quality == key.quality &&
+	   record.key_length == filename.length() &&
+	   memcmp( &head[sizeof(DiskRecord)], filename.data(), filename.length() ) == 0 &&
+	   (uint64_t) st.st_size == head.size() + record.data_length );
+  }
+
+  if( ok ){
+    tile.tileNum = record.tileNum;
+    tile.resolution = record.resolution;
+    tile.hSequence = record.hSequence;
+    tile.vSequence = record.vSequence;
+    tile.compressionType = (CompressionType) record.compression;
+    tile.quality = record.quality;
+    tile.timestamp = record.timestamp;
+    tile.width = record.width;
+    tile.height = record.height;
+    tile.channels = record.channels;
+    tile.bpc = record.bpc;
+    tile.sampleType = (SampleType) record.sampleType;
+    tile.padded = record.padded;
+    tile.dataLength = record.data_length;
+    tile.allocate( tile.dataLength );
+    ok = readAll( fd, tile.data, tile.dataLength, head.size() );
+  }
+
+  close( fd );
+
+  if( !ok ){
+    tile.adopt( (unsigned char*) NULL );
+    tile.dataLength = 0;
+    return false;
+  }
+
+  lock_guard<std::mutex> lock( mutex );
+  this->add( h, st.st_size );
+  return true;
+}
+
+
+
+void DiskCache::save()
+{
+  string target = directory + "/" + DISKCACHE_INDEX;
+  char suffix[32];
+  snprintf( suffix, sizeof(suffix), ".%ld.tmp", (long) getpid() );
+  string tmp = target + suffix;
+
+  lock_guard<std::mutex> lock( mutex );
+
+  int fd = open( tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+  if( fd < 0 ) return;
+
+  DiskIndexHeader header;
+  header.magic = DISKCACHE_MAGIC;
+  header.version = DISKCACHE_VERSION;
+  header.count = entries.size();
+  bool ok = writeAll( fd, &header, sizeof(header) );
+
+  // Write our entries least recently used first in blocks
+  vector<uint64_t> block;
+  block.reserve( 8192 );
+  for( list<Entry>::reverse_iterator i = entries.rbegin(); ok && i != entries.rend(); ++i ){
+    block.push_back( i->hash );
+    block.push_back( i->size );
+    if( block.size() == block.capacity() ){
+      ok = writeAll( fd, &block[0], block.size()*sizeof(uint64_t) );
+      block.clear();
+    }
+  }
+  if( ok && !block.empty() ) ok = writeAll( fd, &block[0], block.size()*sizeof(uint64_t) );
+
+  if( close( fd ) != 0 ) ok = false;
+  if( !ok || rename( tmp.c_str(), target.c_str() ) != 0 ) unlink( tmp.c_str() );
+}
+
+
+
+bool DiskCache::load()
+{
+  string target = directory + "/" + DISKCACHE_INDEX;
+
+  int fd = open( target.c_str(), O_RDONLY );
+  if( fd < 0 ) return false;
+
+  DiskIndexHeader header;
+  struct stat st;
+  bool ok = ( fstat( fd, &st ) == 0 ) && readAll( fd, &header, sizeof(header), 0 ) &&
+    header.magic == DISKCACHE_MAGIC && header.version == DISKCACHE_VERSION &&
+    (uint64_t) st.st_size == sizeof(header) + header.count * 2 * sizeof(uint64_t);
+
+  vector<uint64_t> data;
+  if( ok && header.count > 0 ){
+    data.resize( header.count * 2 );
+    ok = readAll( fd, &data[0], data.size()*sizeof(uint64_t), sizeof(header) );
+  }
+  close( fd );
+
+  // Our index is consumed, so that a crash before the next save leads to a full scan instead
+  unlink( target.c_str() );
+  if( !ok ) return false;
+
+  lock_guard<std::mutex> lock( mutex );
+  for( size_t i=0; i<data.size(); i+=2 ) this->add( data[i], data[i+1] );
+  return true;
+}
+
+
+
+void DiskCache::scan()
+{
+  vector< pair< time_t, pair<uint64_t,uint64_t> > > found;
+  time_t now = time( NULL );
+
+  for( unsigned int d=0; d<256; d++ ){
+    char name[8];
+    snprintf( name, sizeof(name), "/%02x", d );
+    string subdir = directory + name;
+    DIR* dp = opendir( subdir.c_str() );
+    if( !dp ) continue;
+
+    struct dirent* de;
+    while( (de = readdir( dp )) ){
+      string f = subdir + "/" + de->d_name;
+      struct stat st;
+      if( de->d_name[0] == '.' || stat( f.c_str(), &st ) != 0 || !S_ISREG( st.st_mode ) ) continue;
+
+      // Remove temporary files left behind by processes that have died
+      if( strlen( de->d_name ) > 16 ){
+	if( strstr( de->d_name, ".tmp" ) && now - st.st_mtime > DISKCACHE_TMP_AGE ) unlink( f.c_str() );
+	continue;
+      }
+
+      char* end;
+      uint64_t h = strtoull( de->d_name, &end, 16 );
+      if( *end != '\0' ) continue;
+      found.push_back( make_pair( st.st_mtime, make_pair( h, (uint64_t) st.st_size ) ) );
+    }
+    closedir( dp );
+  }
+
+  // Add our files oldest first, so that the most recently written end up at the head of our list
+  sort( found.begin(), found.end() );
+
+  lock_guard<std::mutex> lock( mutex );
+  for( size_t i=0; i<found.size(); i++ ) this->add( found[i].second.first, found[i].second.second );
+}
+
+
+
+unsigned int DiskCache::getNumElements()
+{
+  lock_guard<std::mutex> lock( mutex );
+  return entries.size();
+}
+
+
+
+float DiskCache::getMemorySize()
+{
+  lock_guard<std::mutex> lock( mutex );
+  return (float)( currentSize / 1024000.0 );
+}
+
+
+#endif
@@ -0,0 +1,152 @@
+/*
+    IIPImage Server - Persistent Disk Tile Cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+
+#include <string>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include "HashMap.h"
+#include "RawTile.h"
+#include "TileKey.h"
+
+
+
+/// Size bounded tile cache stored on local disk
+/** Encoded tiles are written to individual content files named after the 64 bit hash
+    of their tile key and spread over 256 sub-directories. Each file begins with a
+    header holding the full key and tile meta-data, which is checked on every read,
+    so lookups need no index and files written by other processes or previous runs
+    are found directly. Files are written to a temporary name and renamed into place,
+    so that readers never see partially written tiles.
+
+    An in-memory index of file sizes in least recently used order bounds the total
+    size on disk. This index is saved as a compact file on shutdown and reloaded at
+    startup. If no saved index is found, for example after a crash, the directory is
+    scanned instead. Stale tiles are detected by the caller via the stored tile
+    timestamp and simply overwritten. When several processes share a directory, each
+    bounds only the tiles it knows about, so the limit is approximate.
+ */
+class DiskCache {
+
+ private:
+
+  /// Index entry
+  struct Entry {
+    uint64_t hash;     ///< Tile key hash
+    uint64_t size;     ///< File size in bytes
+  };
+
+  /// Index typedef
+  typedef HASHMAP < uint64_t, std::list<Entry>::iterator > EntryMap;
+
+
+  /// Cache directory
+  std::string directory;
+
+  /// Max size in bytes
+  uint64_t maxSize;
+
+  /// Current size in bytes of our known files
+  uint64_t currentSize;
+
+  /// Entries in order of use, most recently used first
+  std::list<Entry> entries;
+
+  /// Index into our entry list
+  EntryMap index;
+
+  /// Mutex protecting our index
+  std::mutex mutex;
+
+  /// Counter used to build unique temporary file names
+  unsigned long sequence;
+
+
+  /// Return the path of the content file for a given key hash
+  std::string path( uint64_t h ) const;
+
+  /// Record a file in our index as most recently used, evicting files if necessary - must be called with lock held
+  /** @param h key hash
+      @param size file size in bytes
+   */
+  void add( uint64_t h, uint64_t size );
+
+  /// Forget a file - must be called with lock held
+  void forget( uint64_t h );
+
+  /// Load our saved index
+  /** @return true if successful */
+  bool load();
+
+  /// Scan our directory for content files
+  void scan();
+
+
+ public:
+
+  /// Constructor - open or create a cache directory
+  /** @param dir cache directory
+      @param max maximum size on disk in MB
+      Throws a std::string on error
+   */
+  DiskCache( const std::string& dir, float max );
+
+  /// Destructor - save our index
+  ~DiskCache();
+
+  /// Insert a tile
+  /** @param key tile key
+      @param r tile to be written
+      @return false if the tile could not be written
+   */
+  bool insert( const TileKey& key, const RawTile& r );
+
+  /// Get a tile from the cache
+  /** Note that the tile file name is not set
+      @param key tile key
+      @param tile RawTile into which the cached tile is read
+      @return true if found, false otherwise
+   */
+  bool getTile( const TileKey& key, RawTile& tile );
+
+  /// Save our index so that it can be reloaded at the next startup
+  void save();
+
+  /// Return the number of tiles known to be stored
+  unsigned int getNumElements();
+
+  /// Return the number of MB stored
+  float getMemorySize();
+
+  /// Return the maximum size in MB
+  float getMaxSize(){ return (float)( maxSize / 1024000.0 ); };
+
+  /// Return our cache directory
+  const std::string& getDirectory(){ return directory; };
+
+};
+
+
+#endif
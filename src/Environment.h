@@ -45,8 +45,26 @@
 #define ALLOW_UPSCALING true
 #define URI_MAP ""
 #define EMBED_ICC true
+#define JPEG_PASSTHROUGH false
+#define TIFF_IO "libtiff"
 #define KAKADU_READMODE 0
 #define IIIF_VERSION 2
+#define WORKER_THREADS 1
+#define CODEC_THREADS 0
+#define SHM_CACHE_SIZE 0.0
+#define SHM_CACHE_NAME "/iipsrv"
+#define CACHE_POLICY "lru"
+#define CACHE_IMAGE_QUOTA 0.0
+#define CACHE_COMPRESSION "none"
+#define DISK_CACHE_DIR ""
+#define DISK_CACHE_SIZE 1024.0
+#define CACHE_SNAPSHOT ""
+#define CACHE_SNAPSHOT_SIZE 0.0
+#define NEGATIVE_CACHE_TTL 0
+#define NEGATIVE_CACHE_SIZE 10000
+#define METADATA_CACHE_SIZE 1000
+#define IMAGE_REVALIDATION_INTERVAL 0
+#define HANDLE_POOL_SIZE 0
 
 
 #include <string>
@@ -289,6 +307,24 @@ class Environment {
   }
 
 
+  static bool getJPEGPassthrough(){
+    char* envpara = getenv( "JPEG_PASSTHROUGH" );
+    bool passthrough;
+    if( envpara ) passthrough = atoi( envpara );
+    else passthrough = JPEG_PASSTHROUGH;
+    return passthrough;
+  }
+
+
+  static std::string getTIFFIO(){
+    char* envpara = getenv( "TIFF_IO" );
+    std::string mode;
+    if( envpara ) mode = std::string( envpara );
+    else mode = TIFF_IO;
+    return mode;
+  }
+
+
   static unsigned int getKduReadMode(){
     unsigned int readmode;
     char* envpara = getenv( "KAKADU_READMODE" );
@@ -313,6 +349,166 @@ class Environment {
   }
 
 
+  static float getShmCacheSize(){
+    float shm_cache_size = SHM_CACHE_SIZE;
+    char* envpara = getenv( "SHM_CACHE_SIZE" );
+    if( envpara ){
+      shm_cache_size = atof( envpara );
+      if( shm_cache_size < 0 ) shm_cache_size = 0;
+    }
+    return shm_cache_size;
+  }
+
+
+  static std::string getShmCacheName(){
+    char* envpara = getenv( "SHM_CACHE_NAME" );
+    std::string name;
+    if( envpara ) name = std::string( envpara );
+    else name = SHM_CACHE_NAME;
+    // POSIX shared memory object names must begin with a slash
+    if( name.empty() || name[0] != '/' ) name = "/" + name;
+    return name;
+  }
+
+
+  static std::string getDiskCacheDir(){
+    char* envpara = getenv( "DISK_CACHE_DIR" );
+    std::string dir;
+    if( envpara ) dir = std::string( envpara );
+    else dir = DISK_CACHE_DIR;
+    return dir;
+  }
+
+
+  static float getDiskCacheSize(){
+    float disk_cache_size = DISK_CACHE_SIZE;
+    char* envpara = getenv( "DISK_CACHE_SIZE" );
+    if( envpara ){
+      disk_cache_size = atof( envpara );
+      if( disk_cache_size < 0 ) disk_cache_size = 0;
+    }
+    return disk_cache_size;
+  }
+
+
+  static std::string getCacheSnapshot(){
+    char* envpara = getenv( "CACHE_SNAPSHOT" );
+    std::string snapshot;
+    if( envpara ) snapshot = std::string( envpara );
+    else snapshot = CACHE_SNAPSHOT;
+    return snapshot;
+  }
+
+
+  static float getCacheSnapshotSize(){
+    float snapshot_size = CACHE_SNAPSHOT_SIZE;
+    char* envpara = getenv( "CACHE_SNAPSHOT_SIZE" );
+    if( envpara ){
+      snapshot_size = atof( envpara );
+      if( snapshot_size < 0 ) snapshot_size = 0;
+    }
+    return snapshot_size;
+  }
+
+
+  static unsigned int getNegativeCacheTTL(){
+    char* envpara = getenv( "NEGATIVE_CACHE_TTL" );
+    int ttl = NEGATIVE_CACHE_TTL;
+    if( envpara ) ttl = atoi( envpara );
+    if( ttl < 0 ) ttl = 0;
+    return (unsigned int) ttl;
+  }
+
+
+  static unsigned int getNegativeCacheSize(){
+    char* envpara = getenv( "NEGATIVE_CACHE_SIZE" );
+    int size = NEGATIVE_CACHE_SIZE;
+    if( envpara ) size = atoi( envpara );
+    if( size < 0 ) size = 0;
+    return (unsigned int) size;
+  }
+
+
+  static unsigned int getMetadataCacheSize(){
+    char* envpara = getenv( "METADATA_CACHE_SIZE" );
+    int size = METADATA_CACHE_SIZE;
+    if( envpara ) size = atoi( envpara );
+    if( size < 0 ) size = 0;
+    return (unsigned int) size;
+  }
+
+
+  static unsigned int getImageRevalidationInterval(){
+    char* envpara = getenv( "IMAGE_REVALIDATION_INTERVAL" );
+    int interval = IMAGE_REVALIDATION_INTERVAL;
+    if( envpara ) interval = atoi( envpara );
+    if( interval < 0 ) interval = 0;
+    return (unsigned int) interval;
+  }
+
+
+  static unsigned int getHandlePoolSize(){
+    char* envpara = getenv( "HANDLE_POOL_SIZE" );
+    int size = HANDLE_POOL_SIZE;
+    if( envpara ) size = atoi( envpara );
+    if( size < 0 ) size = 0;
+    return (unsigned int) size;
+  }
+
+
+  static std::string getCachePolicy(){
+    char* envpara = getenv( "CACHE_POLICY" );
+    std::string policy;
+    if( envpara ) policy = std::string( envpara );
+    else policy = CACHE_POLICY;
+    return policy;
+  }
+
+
+  static float getCacheImageQuota(){
+    float quota = CACHE_IMAGE_QUOTA;
+    char* envpara = getenv( "CACHE_IMAGE_QUOTA" );
+    if( envpara ){
+      quota = atof( envpara );
+      if( quota < 0 || quota >= 1.0 ) quota = 0;
+    }
+    return quota;
+  }
+
+
+  static std::string getCacheCompression(){
+    char* envpara = getenv( "CACHE_COMPRESSION" );
+    std::string compression;
+    if( envpara ) compression = std::string( envpara );
+    else compression = CACHE_COMPRESSION;
+    return compression;
+  }
+
+
+  static unsigned int getCodecThreads(){
+    unsigned int threads;
+    char* envpara = getenv( "CODEC_THREADS" );
+    if( envpara ){
+      int t = atoi( envpara );
+      threads = (t < 0) ? 0 : t;
+    }
+    else threads = CODEC_THREADS;
+    return threads;
+  }
+
+
+  static unsigned int getWorkerThreads(){
+    unsigned int threads;
+    char* envpara = getenv( "WORKER_THREADS" );
+    if( envpara ){
+      int t = atoi( envpara );
+      threads = (t < 1) ? 1 : t;
+    }
+    else threads = WORKER_THREADS;
+    return threads;
+  }
+
+
 };
 
 
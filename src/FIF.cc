@@ -33,8 +33,6 @@
 #include "OpenJPEGImage.h"
 #endif
 
-#define MAXIMAGECACHE 1000  // Max number of items in image cache
-
 
 
 using namespace std;
@@ -76,44 +74,51 @@ void FIF::run( Session* session, const string& src ){
   // Get our image pattern variable
   string filename_pattern = Environment::getFileNamePattern();
 
+  // Get the minimum interval between checks of image modification times
+  unsigned int revalidation_interval = Environment::getImageRevalidationInterval();
+
   // Timestamp of cached image
   time_t timestamp = 0;
 
+  // Whether this path is known to have recently failed to open
+  bool negative = false;
+
 
   // Put the image setup into a try block as object creation can throw an exception
   try{
 
-    // Check whether cache is empty
-    if( session->imageCache->empty() ){
-      if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialization" << endl;
+    // Look up our object in the image cache, which copies out the cached entry
+    unsigned int cache_size = session->imageCache->getNumElements();
+
+    // Cache Hit
+    if( session->imageCache->find( argument, test ) ){
+      timestamp = test.timestamp;       // Record timestamp if we have a cached image
+      if( session->loglevel >= 2 ){
+	*(session->logfile) << "FIF :: Image cache hit. Number of elements: " << cache_size << endl;
+      }
+    }
+    // Cache Miss
+    else{
+      if( cache_size == 0 ){
+	if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialization" << endl;
+      }
+      else if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
+
+      // Reject paths which recently failed to open without touching the file system again
+      string error;
+      if( session->negativeCache && session->negativeCache->find( argument, error ) ){
+	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Negative image cache hit" << endl;
+	negative = true;
+	throw file_error( error, true );
+      }
+
       test = IIPImage( argument );
       test.setFileNamePattern( filename_pattern );
       test.setFileSystemPrefix( filesystem_prefix );
       test.setFileSystemSuffix( filesystem_suffix );
+      test.setRevalidationInterval( revalidation_interval );
       test.Initialise();
     }
-    // If not, look up our object
-    else{
-      // Cache Hit
-      if( session->imageCache->find(argument) != session->imageCache->end() ){
-	test = (*session->imageCache)[ argument ];
-	timestamp = test.timestamp;       // Record timestamp if we have a cached image
-	if( session->loglevel >= 2 ){
-	  *(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->size() << endl;
-	}
-      }
-      // Cache Miss
-      else{
-	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
-	test = IIPImage( argument );
-	test.setFileNamePattern( filename_pattern );
-	test.setFileSystemPrefix( filesystem_prefix );
-	test.setFileSystemSuffix( filesystem_suffix );
-	test.Initialise();
-	// Delete items if our list of images is too long.
-	if( session->imageCache->size() >= MAXIMAGECACHE ) session->imageCache->erase( session->imageCache->begin() );
-      }
-    }
 
 
 
@@ -126,6 +131,8 @@ void FIF::run( Session* session, const string& src ){
     if( format == TIF ){
       if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: TIFF image detected" << endl;
       *session->image = new TPTImage( test );
+      ((TPTImage*)*session->image)->jpeg_passthrough = session->codecOptions["JPEG_PASSTHROUGH"];
+      ((TPTImage*)*session->image)->tiff_io = (TPTImage::IOMode) session->codecOptions["TIFF_IO"];
     }
 #if defined(HAVE_KAKADU) || defined(HAVE_OPENJPEG)
     else if( format == JPEG2000 ){
@@ -136,8 +143,10 @@ void FIF::run( Session* session, const string& src ){
       if( session->codecOptions["KAKADU_READMODE"] ){
 	((KakaduImage*)*session->image)->kdu_readmode = (KakaduImage::KDU_READMODE) session->codecOptions["KAKADU_READMODE"];
       }
+      ((KakaduImage*)*session->image)->kdu_threads = session->codecOptions["CODEC_THREADS"];
 #elif defined(HAVE_OPENJPEG)
       *session->image = new OpenJPEGImage( test );
+      ((OpenJPEGImage*)*session->image)->opj_threads = session->codecOptions["CODEC_THREADS"];
 #endif
     }
 #endif
@@ -178,9 +187,13 @@ void FIF::run( Session* session, const string& src ){
     */
 
 
-    // Open image and update timestamp
+    // Open image and update timestamp, reusing any pooled decoder handle
+    (*session->image)->setHandlePool( session->handlePool );
     (*session->image)->openImage();
 
+    // Forget any earlier failure of a newly opened image
+    if( timestamp == 0 && session->negativeCache ) session->negativeCache->erase( argument );
+
     // Check timestamp consistency. If cached timestamp is older, update metadata
     if( timestamp>0 && (timestamp < (*session->image)->timestamp) ){
       if( session->loglevel >= 2 ){
@@ -189,8 +202,9 @@ void FIF::run( Session* session, const string& src ){
       (*session->image)->loadImageInfo( (*session->image)->currentX, (*session->image)->currentY );
     }
 
-    // Add this image to our cache, overwriting previous version if it exists
-    (*session->imageCache)[argument] = *(*session->image);
+    // Add this image to our cache, overwriting previous version if it exists.
+    // The least recently used image is dropped if our cache is full.
+    session->imageCache->insert( argument, *(*session->image) );
 
     if( session->loglevel >= 3 ){
       *(session->logfile) << "FIF :: Created image" << endl;
@@ -206,14 +220,14 @@ void FIF::run( Session* session, const string& src ){
 			  << "FIF :: Image contains " << (*session->image)->channels
 			  << " channel" << (((*session->image)->channels>1)?"s":"") << " with "
 			  << (*session->image)->bpc << " bit" << (((*session->image)->bpc>1)?"s":"") << " per channel" << endl;
-      tm *t = gmtime( &(*session->image)->timestamp );
-      char strt[64];
-      strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
-      *(session->logfile) << "FIF :: Image timestamp: " << strt << endl;
+      *(session->logfile) << "FIF :: Image timestamp: " << (*session->image)->getTimestamp() << endl;
     }
 
   }
   catch( const file_error& error ){
+    // Remember images which do not exist, but without extending the lifetime of an existing entry.
+    // Other failures, such as running out of file descriptors or permissions, may be transient
+    if( error.missing && !negative && session->negativeCache ) session->negativeCache->insert( argument, error.what() );
     // Unavailable file error code is 1 3
     session->response->setError( "1 3", "FIF" );
     throw error;
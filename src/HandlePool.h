@@ -0,0 +1,236 @@
+/*
+    IIPImage Server - Open Decoder Handle Pool
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HANDLEPOOL_H
+#define _HANDLEPOOL_H
+
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <ctime>
+
+
+
+/// Bounded pool of idle open decoder handles
+/** Opening an image and parsing its headers can cost more than reading a single tile,
+    so image objects may return their open decoder handles to this pool when they are
+    closed, rather than closing them, and take them back when the same file is next
+    opened. Handles are opaque to the pool and are stored together with the function
+    used to close them. Each handle is used by only one image object at a time, so
+    several handles may be held for the same file. Handles are keyed by file path and
+    modification time, so that handles to files which have since been modified are
+    closed rather than reused. Once the pool is full, the least recently returned
+    handles are closed. Handles are closed outside of our lock.
+ */
+class HandlePool {
+
+ public:
+
+  /// Function used to close a handle
+  typedef void (*Closer)( void* );
+
+
+ private:
+
+  /// An idle handle
+  struct Handle {
+    std::string path;       ///< File path
+    time_t timestamp;       ///< File modification time at which the handle was opened
+    void* handle;           ///< Opaque decoder handle
+    Closer close;           ///< Function used to close this handle
+  };
+
+  /// Index typedef
+  typedef std::multimap < std::string, std::list<Handle>::iterator > HandleMap;
+
+  /// Idle handles, most recently returned first
+  std::list<Handle> handles;
+
+  /// Index into our handle list
+  HandleMap index;
+
+  /// Mutex protecting our handles
+  std::mutex mutex;
+
+  /// Maximum number of idle handles
+  unsigned int maxHandles;
+
+  /// Number of opens served from our pool
+  std::atomic<unsigned long> hits;
+
+  /// Number of opens for which no handle was available
+  std::atomic<unsigned long> misses;
+
+
+  /// Remove a handle - must be called with lock held
+  void _erase( HandleMap::iterator i ){
+    handles.erase( i->second );
+    index.erase( i );
+  }
+
+
+  /// Remove the least recently returned handle - must be called with lock held
+  Handle _pop(){
+    Handle h = handles.back();
+    std::pair<HandleMap::iterator,HandleMap::iterator> range = index.equal_range( h.path );
+    for( HandleMap::iterator i = range.first; i != range.second; ++i ){
+      if( i->second == --handles.end() ){
+	index.erase( i );
+	break;
+      }
+    }
+    handles.pop_back();
+    return h;
+  }
+
+
+  /// Close a list of handles - called without our lock held
+  static void _close( const std::vector<Handle>& l ){
+    for( unsigned int i=0; i<l.size(); i++ ) (l[i].close)( l[i].handle );
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param max maximum number of idle handles or 0 to disable */
+  HandlePool( unsigned int max ) : maxHandles( max ), hits( 0 ), misses( 0 ) {};
+
+  /// Destructor - closes all idle handles
+  ~HandlePool(){ clear(); };
+
+
+  /// Return whether the pool is enabled
+  bool enabled() const { return maxHandles > 0; };
+
+
+  /// Take an idle handle for a file
+  /** @param path file path
+      @param timestamp current file modification time
+      @param close function used to close handles of the required type
+      @return handle, which now belongs to the caller, or NULL if none is available
+   */
+  void* acquire( const std::string& path, time_t timestamp, Closer close ){
+    if( !enabled() ) return NULL;
+    void* handle = NULL;
+    std::vector<Handle> stale;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      std::pair<HandleMap::iterator,HandleMap::iterator> range = index.equal_range( path );
+      HandleMap::iterator i = range.first;
+      while( i != range.second ){
+	HandleMap::iterator j = i++;
+	const Handle& h = *(j->second);
+	if( h.close != close ) continue;
+	// Close handles opened before the file was last modified
+	if( h.timestamp != timestamp ){
+	  stale.push_back( h );
+	  this->_erase( j );
+	}
+	else if( !handle ){
+	  handle = h.handle;
+	  this->_erase( j );
+	}
+      }
+    }
+    _close( stale );
+    if( handle ) hits++;
+    else misses++;
+    return handle;
+  }
+
+
+  /// Return a handle to the pool
+  /** @param path file path
+      @param timestamp file modification time at which the handle was opened
+      @param handle handle, which now belongs to the pool
+      @param close function used to close this handle
+   */
+  void release( const std::string& path, time_t timestamp, void* handle, Closer close ){
+    std::vector<Handle> evicted;
+    if( !enabled() ){
+      (close)( handle );
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      Handle h;
+      h.path = path;
+      h.timestamp = timestamp;
+      h.handle = handle;
+      h.close = close;
+      handles.push_front( h );
+      index.insert( std::make_pair( path, handles.begin() ) );
+      while( handles.size() > maxHandles ) evicted.push_back( this->_pop() );
+    }
+    _close( evicted );
+  }
+
+
+  /// Close the least recently returned idle handle, for example when running out of file descriptors
+  /** @return true if a handle was closed */
+  bool evict(){
+    std::vector<Handle> evicted;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      if( handles.empty() ) return false;
+      evicted.push_back( this->_pop() );
+    }
+    _close( evicted );
+    return true;
+  }
+
+
+  /// Close all idle handles
+  void clear(){
+    std::vector<Handle> l;
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      l.assign( handles.begin(), handles.end() );
+      handles.clear();
+      index.clear();
+    }
+    _close( l );
+  }
+
+
+  /// Return the number of idle handles
+  unsigned int getNumElements(){
+    std::lock_guard<std::mutex> lock( mutex );
+    return handles.size();
+  }
+
+
+  /// Return the number of opens served from our pool
+  unsigned long getHits(){ return hits; };
+
+
+  /// Return the number of opens for which no handle was available
+  unsigned long getMisses(){ return misses; };
+
+};
+
+
+#endif
@@ -0,0 +1,67 @@
+// Hashed Map Type Selection
+
+/*  IIP Image Server
+
+    Copyright (C) 2005-2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HASHMAP_H
+#define _HASHMAP_H
+
+
+#include <string>
+
+
+// Test for available map types. Try to use an efficient hashed map type if possible
+// and define this as HASHMAP, which we can then use elsewhere.
+#if defined(HAVE_UNORDERED_MAP)
+#include <unordered_map>
+#define HASHMAP std::unordered_map
+
+#elif defined(HAVE_TR1_UNORDERED_MAP)
+#include <tr1/unordered_map>
+#define HASHMAP std::tr1::unordered_map
+
+// Use the gcc hash_map extension if we have it
+#elif defined(HAVE_EXT_HASH_MAP)
+#include <ext/hash_map>
+#define HASHMAP __gnu_cxx::hash_map
+
+/* Explicit template specialization of hash of a string class,
+   which just uses the internal char* representation as a wrapper.
+   Required for older versions of gcc as hashing on a string is
+   not supported.
+ */
+namespace __gnu_cxx {
+  template <>
+    struct hash<std::string> {
+      size_t operator() (const std::string& x) const {
+	return hash<const char*>()(x.c_str());
+      }
+    };
+}
+
+// If no hash type available, just use map
+#else
+#include <map>
+#define HASHMAP std::map
+
+#endif // End of #if defined
+
+
+#endif
@@ -33,6 +33,8 @@
 
 #include <cstdio>
 #include <cstring>
+#include <cerrno>
+#include <ctime>
 #include <sstream>
 #include <algorithm>
 #include <sys/stat.h>
@@ -51,9 +53,13 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
   std::swap( first.suffix, second.suffix );
   std::swap( first.virtual_levels, second.virtual_levels );
   std::swap( first.format, second.format );
+  std::swap( first.handles, second.handles );
+  std::swap( first.directory_offsets, second.directory_offsets );
   std::swap( first.fileSystemPrefix, second.fileSystemPrefix );
   std::swap( first.fileSystemSuffix, second.fileSystemSuffix );
   std::swap( first.fileNamePattern, second.fileNamePattern );
+  std::swap( first.revalidation, second.revalidation );
+  std::swap( first.validated, second.validated );
   std::swap( first.horizontalAnglesList, second.horizontalAnglesList );
   std::swap( first.verticalAnglesList, second.verticalAnglesList );
   std::swap( first.lut, second.lut );
@@ -91,7 +97,12 @@ void IIPImage::testImageType()
   const char *pstr = path.c_str();
 
 
-  if( (stat(pstr,&sb)==0) && S_ISREG(sb.st_mode) ){
+  int status = stat( pstr, &sb );
+
+  // Only a path which does not exist at all is reported as missing
+  bool missing = ( status == -1 ) && ( errno == ENOENT || errno == ENOTDIR );
+
+  if( (status==0) && S_ISREG(sb.st_mode) ){
 
     unsigned char header[10];
 
@@ -146,10 +157,11 @@ void IIPImage::testImageType()
     glob_t gdat;
     string filename = path + fileNamePattern + "000_090.*";
 
-    if( glob( filename.c_str(), 0, NULL, &gdat ) != 0 ){
+    int result = glob( filename.c_str(), 0, NULL, &gdat );
+    if( result != 0 ){
       globfree( &gdat );
       string message = path + string( " is neither a file nor part of an image sequence" );
-      throw file_error( message );
+      throw file_error( message, missing && result == GLOB_NOMATCH );
     }
     if( gdat.gl_pathc != 1 ){
       globfree( &gdat );
@@ -174,7 +186,7 @@ void IIPImage::testImageType()
 
 #else
     string message = path + string( " is not a regular file and no glob support enabled" );
-    throw file_error( message );
+    throw file_error( message, missing );
 #endif
 
   }
@@ -185,25 +197,35 @@ void IIPImage::testImageType()
 
 void IIPImage::updateTimestamp( const string& path )
 {
+  // Avoid a stat() on every request if our timestamp has been checked recently
+  time_t now = time( NULL );
+  if( revalidation > 0 && timestamp > 0 && validated > 0 && now - validated < (time_t) revalidation ) return;
+
   // Get a modification time for our image
   struct stat sb;
 
   if( stat( path.c_str(), &sb ) == -1 ){
     string message = string( "Unable to open file " ) + path;
-    throw file_error( message );
+    throw file_error( message, errno == ENOENT || errno == ENOTDIR );
   }
   timestamp = sb.st_mtime;
+  validated = now;
 }
 
 
 
 const std::string IIPImage::getTimestamp()
 {
-  tm *t;
+  tm t;
   const time_t tm1 = timestamp;
-  t = gmtime( &tm1 );
+  // Use the re-entrant versions as we may be called from several threads
+#ifdef WIN32
+  gmtime_s( &t, &tm1 );
+#else
+  gmtime_r( &tm1, &t );
+#endif
   char strt[64];
-  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
+  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", &t );
 
   return string(strt);
 }
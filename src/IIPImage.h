@@ -35,15 +35,21 @@
 #include <vector>
 #include <map>
 #include <stdexcept>
+#include <stdint.h>
 
 #include "RawTile.h"
+#include "HandlePool.h"
 
 
 /// Define our own derived exception class for file errors
 class file_error : public std::runtime_error {
  public:
-  /** @param s error message */
-  file_error(std::string s) : std::runtime_error(s) { }
+  /// Whether the file does not exist, as opposed to being unreadable or invalid
+  bool missing;
+
+  /** @param s error message
+      @param m whether the file does not exist */
+  file_error(std::string s, bool m = false) : std::runtime_error(s), missing(m) { }
 };
 
 
@@ -75,6 +81,12 @@ class IIPImage {
   /// Pattern for sequences
   std::string fileNamePattern;
 
+  /// Minimum interval in seconds between checks of the image modification time
+  unsigned int revalidation;
+
+  /// Time at which the image modification time was last checked
+  time_t validated;
+
   /// Indicates whether our image is a single file or part or a sequence
   bool isFile;
 
@@ -108,6 +120,13 @@ class IIPImage {
   /// Return the image format e.g. tif
   ImageFormat format;
 
+  /// Pool of open decoder handles shared between requests or NULL
+  HandlePool* handles;
+
+  /// File offsets of the directory holding each resolution, largest first, for formats such as TIFF
+  /** These allow each resolution to be located directly without walking through the file */
+  std::vector <uint64_t> directory_offsets;
+
 
  public:
 
@@ -165,9 +184,12 @@ class IIPImage {
 
   /// Default Constructor
   IIPImage()
-   : isFile( false ),
+   : revalidation( 0 ),
+    validated( 0 ),
+    isFile( false ),
     virtual_levels( 0 ),
     format( UNSUPPORTED ),
+    handles( NULL ),
     tile_width( 0 ),
     tile_height( 0 ),
     colourspace( NONE ),
@@ -189,9 +211,12 @@ class IIPImage {
    */
   IIPImage( const std::string& s )
    : imagePath( s ),
+    revalidation( 0 ),
+    validated( 0 ),
     isFile( false ),
     virtual_levels( 0 ),
     format( UNSUPPORTED ),
+    handles( NULL ),
     tile_width( 0 ),
     tile_height( 0 ),
     colourspace( NONE ),
@@ -216,6 +241,8 @@ class IIPImage {
     fileSystemPrefix( image.fileSystemPrefix ),
     fileSystemSuffix( image.fileSystemSuffix ),
     fileNamePattern( image.fileNamePattern ),
+    revalidation( image.revalidation ),
+    validated( image.validated ),
     isFile( image.isFile ),
     suffix( image.suffix ),
     horizontalAnglesList( image.horizontalAnglesList ),
@@ -223,6 +250,8 @@ class IIPImage {
     lut( image.lut ),
     virtual_levels( image.virtual_levels ),
     format( image.format ),
+    handles( image.handles ),
+    directory_offsets( image.directory_offsets ),
     image_widths( image.image_widths ),
     image_heights( image.image_heights ),
     tile_width( image.tile_width ),
@@ -277,7 +306,8 @@ class IIPImage {
   ImageFormat getImageFormat() { return format; };
 
   /// Get the image timestamp
-  /** @param s file path
+  /** The file is only checked if the revalidation interval has elapsed since the last check
+      @param s file path
    */
   void updateTimestamp( const std::string& s );
 
@@ -296,9 +326,20 @@ class IIPImage {
   /// Set the file name pattern used in image sequences
   void setFileNamePattern( const std::string& pattern ) { fileNamePattern = pattern; };
 
+  /// Set the pool from which open decoder handles are taken and to which they are returned
+  /** @param pool handle pool or NULL to open and close files on each request */
+  void setHandlePool( HandlePool* pool ) { handles = pool; };
+
+  /// Set the minimum interval between checks of the image modification time
+  /** @param seconds interval in seconds or 0 to check on every request */
+  void setRevalidationInterval( unsigned int seconds ) { revalidation = seconds; };
+
   /// Return the number of available resolutions in the image
   unsigned int getNumResolutions() { return numResolutions; };
 
+  /// Return the number of virtual resolutions, which are reduced from the smallest resolution held in the image
+  unsigned int getVirtualLevels() { return virtual_levels; };
+
   /// Return the number of bits per pixel for this image
   unsigned int getNumBitsPerPixel() { return bpc; };
 
@@ -346,6 +387,10 @@ class IIPImage {
   /// Return whether this image type directly handles region decoding
   virtual bool regionDecoding(){ return false; };
 
+  /// Return a new unopened copy of this image, used for decoding tiles from several threads at once
+  /** @return copy, which belongs to the caller, or NULL if not supported by this image type */
+  virtual IIPImage* clone() const { return NULL; };
+
   /// Load the appropriate codec module for this image type
   /** Used only for dynamically loading codec modules. Overloaded by DSOImage class.
       @param module the codec module path
@@ -379,6 +424,18 @@ class IIPImage {
   virtual RawTile getTile( int h, int v, unsigned int r, int l, unsigned int t ) { return RawTile(); };
 
 
+  /// Return a tile as JPEG data taken directly from the file without decoding
+  /** Overloaded by child classes whose files can hold ready compressed JPEG tiles.
+      @param h horizontal sequence angle
+      @param v vertical sequence angle
+      @param r resolution
+      @param t tile number
+      @param tile tile to fill with JPEG data
+      @return true if the tile is available in this form, otherwise false and the tile must be decoded
+   */
+  virtual bool getJPEGTile( int h, int v, unsigned int r, unsigned int t, RawTile& tile ) { return false; };
+
+
   /// Return a region for a given angle and resolution
   /** Return a RawTile object: Overloaded by child class.
       @param ha horizontal angle
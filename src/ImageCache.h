@@ -0,0 +1,140 @@
+/*
+    IIPImage Server - Image Metadata Cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _IMAGECACHE_H
+#define _IMAGECACHE_H
+
+
+#include <string>
+#include <list>
+#include <vector>
+#include <utility>
+#include <mutex>
+
+#include "IIPImage.h"
+#include "HashMap.h"
+
+
+
+/// Bounded least recently used cache of image metadata
+/** Opening an image and reading its metadata requires several file system calls and
+    header reads, so the metadata of each opened image is kept and copied into new image
+    objects for subsequent requests. The cache is shared between worker threads and is
+    limited to a maximum number of images, with the least recently requested image
+    discarded first.
+ */
+class ImageCache {
+
+ private:
+
+  /// Cached image, keyed by image path
+  typedef std::pair<std::string,IIPImage> Entry;
+
+  /// Index typedef
+  typedef HASHMAP < std::string, std::list<Entry>::iterator > EntryMap;
+
+  /// Entries, most recently used first
+  std::list<Entry> entries;
+
+  /// Index into our entry list
+  EntryMap index;
+
+  /// Mutex protecting our entries
+  std::mutex mutex;
+
+  /// Maximum number of entries
+  unsigned int maxEntries;
+
+
+ public:
+
+  /// Constructor
+  /** @param max maximum number of images */
+  ImageCache( unsigned int max ) : maxEntries( max ) {};
+
+
+  /// Look up an image
+  /** @param path image path
+      @param image set to a copy of the cached image
+      @return true if the image is in our cache
+   */
+  bool find( const std::string& path, IIPImage& image ){
+    std::lock_guard<std::mutex> lock( mutex );
+    EntryMap::iterator i = index.find( path );
+    if( i == index.end() ) return false;
+    // Move the entry to the head of the list
+    entries.splice( entries.begin(), entries, i->second );
+    image = i->second->second;
+    return true;
+  }
+
+
+  /// Insert or replace an image
+  /** @param path image path
+      @param image image object to copy into the cache
+   */
+  void insert( const std::string& path, const IIPImage& image ){
+    if( maxEntries == 0 ) return;
+    std::lock_guard<std::mutex> lock( mutex );
+    EntryMap::iterator i = index.find( path );
+    if( i != index.end() ){
+      i->second->second = image;
+      entries.splice( entries.begin(), entries, i->second );
+      return;
+    }
+    while( entries.size() >= maxEntries ){
+      index.erase( entries.back().first );
+      entries.pop_back();
+    }
+    entries.push_front( Entry( path, image ) );
+    index[ path ] = entries.begin();
+  }
+
+
+  /// Update the histogram of a cached image
+  /** @param path image path
+      @param histogram image histogram
+   */
+  void setHistogram( const std::string& path, const std::vector<unsigned int>& histogram ){
+    std::lock_guard<std::mutex> lock( mutex );
+    EntryMap::iterator i = index.find( path );
+    if( i != index.end() ) i->second->second.histogram = histogram;
+  }
+
+
+  /// Empty the cache
+  void clear(){
+    std::lock_guard<std::mutex> lock( mutex );
+    entries.clear();
+    index.clear();
+  }
+
+
+  /// Return the number of images in our cache
+  unsigned int getNumElements(){
+    std::lock_guard<std::mutex> lock( mutex );
+    return entries.size();
+  }
+
+};
+
+
+#endif
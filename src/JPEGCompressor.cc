@@ -437,12 +437,12 @@ unsigned int JPEGCompressor::Compress( RawTile& rawtile )
   jpeg_finish_compress( &cinfo );
 
   // Check that we have enough memory in our Rawtile for the JPEG data.
-  // This can happen on small tiles with high quality factors. If so delete and reallocate memory.
+  // This can happen on small tiles with high quality factors. If so, or if our
+  // raw data is shared with the tile cache, allocate a new buffer for our output.
   unsigned long dataLength;
   dataLength = dest->written;
-  if( dataLength > rawtile.dataLength ){
-    delete[] (unsigned char*) rawtile.data;
-    rawtile.data = new unsigned char[dataLength];
+  if( dataLength > rawtile.dataLength || rawtile.shared() ){
+    rawtile.adopt( new unsigned char[dataLength] );
   }
   
   // Copy memory back to the tile
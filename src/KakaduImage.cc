@@ -31,26 +31,7 @@
 #include <cmath>
 #include <sstream>
 
-// Required for get_nprocs_conf() on Linux
-#ifdef NPROCS
-#include <sys/sysinfo.h>
-#endif
-
-// On Mac OS X, define our own get_nprocs_conf()
-#if defined (__APPLE__) || defined(__FreeBSD__)
-#include <pthread.h>
-#include <sys/sysctl.h>
-unsigned int get_nprocs_conf(){
-  int numProcessors = 0;
-  size_t size = sizeof(numProcessors);
-  int returnCode = sysctlbyname("hw.ncpu", &numProcessors, &size, NULL, 0);
-  if( returnCode != 0 ) return 1;
-  else return (unsigned int)numProcessors;
-}
-#define NPROCS
-#endif
-
-
+#include "BoxFilter.h"
 #include "Timer.h"
 //#define DEBUG 1
 
@@ -58,6 +39,76 @@ unsigned int get_nprocs_conf(){
 using namespace std;
 
 
+
+/// Persistent Kakadu thread group
+/** Creating and joining a thread group for every decode is expensive, so each of our worker
+    threads keeps its own group, which is created on first use and reused for all subsequent
+    decodes. Kakadu thread groups may only be used by the thread which created them. The group
+    is destroyed when its worker thread exits.
+ */
+class KakaduThreads {
+
+ private:
+
+  /// Kakadu thread group
+  kdu_thread_env env;
+
+  /// Number of threads in our group, including the calling thread
+  unsigned int size;
+
+ public:
+
+  /// Constructor
+  KakaduThreads(): size( 0 ) {};
+
+  /// Destructor
+  ~KakaduThreads(){ destroy(); };
+
+  /// Get our thread group, creating it if necessary
+  /** @param threads total number of decoding threads including the calling thread
+      @return thread group or NULL if decoding is single threaded
+   */
+  kdu_thread_env* get( unsigned int threads ){
+    if( threads <= 1 ) return NULL;
+    if( env.exists() && size == threads ) return &env;
+    destroy();
+    env.create();
+    // Our calling thread is the first thread of the group
+    size = 1;
+    while( size < threads && env.add_thread() ) size++;
+    return &env;
+  }
+
+  /// Return our thread group if it exists
+  kdu_thread_env* current(){ return env.exists() ? &env : NULL; };
+
+  /// Return the number of threads in our group
+  unsigned int getSize(){ return size; };
+
+  /// Destroy our thread group, which is also needed after an exception
+  void destroy(){
+    if( env.exists() ) env.destroy();
+    size = 0;
+  }
+
+};
+
+
+static thread_local KakaduThreads threadGroup;
+
+
+
+// Close a JPEG2000 file and its codestream, including those held by our handle pool
+static void closeKakadu( void* f ){
+  KakaduFile *file = (KakaduFile*) f;
+  // Need to make sure our codestream exists or it'll crash
+  if( file->codestream.exists() ) file->codestream.destroy();
+  file->src.close();
+  file->jpx_input.close();
+  delete file;
+}
+
+
 void KakaduImage::openImage()
 {
   string filename = getFileName( currentX, currentY );
@@ -74,36 +125,50 @@ void KakaduImage::openImage()
   timer.start();
 #endif
 
-  // Open the JPX or JP2 file
-  try{
-    src.open( filename.c_str(), true );
-    if( jpx_input.open( &src, false ) != 1 ) throw 1;
-  }
-  catch (...){
-    throw file_error( "Kakadu :: Unable to open '"+filename+"'"); // Rethrow the exception
-  }
+  // Reuse an already open codestream for this file if available, together with the tile and
+  // precinct structures and compressed data already loaded by previous requests
+  if( handles ) file = (KakaduFile*) handles->acquire( filename, timestamp, closeKakadu );
 
+  if( file ) codestream = file->codestream;
+  else{
+
+    file = new KakaduFile;
+    file->input = NULL;
+
+    // Open the JPX or JP2 file
+    try{
+      file->src.open( filename.c_str(), true );
+      if( file->jpx_input.open( &file->src, false ) != 1 ) throw 1;
+    }
+    catch (...){
+      throw file_error( "Kakadu :: Unable to open '"+filename+"'"); // Rethrow the exception
+    }
 
-  // Get our JPX codestream
-  try{
-    jpx_stream = jpx_input.access_codestream(0);
-    if( !jpx_stream.exists() ) throw 1;
-  }
-  catch (...){
-    throw file_error( "Kakadu :: No codestream in file '"+filename+"'"); // Rethrow exception
-  }
+
+    // Get our JPX codestream
+    try{
+      file->jpx_stream = file->jpx_input.access_codestream(0);
+      if( !file->jpx_stream.exists() ) throw 1;
+    }
+    catch (...){
+      throw file_error( "Kakadu :: No codestream in file '"+filename+"'"); // Rethrow exception
+    }
 
 
-  // Open the underlying JPEG2000 codestream
-  input = NULL;
-  input = jpx_stream.open_stream();
+    // Open the underlying JPEG2000 codestream
+    file->input = file->jpx_stream.open_stream();
 
-  // Create codestream
-  codestream.create(input);
-  if( !codestream.exists() ) throw file_error( "Kakadu :: Unable to create codestream for '"+filename+"'"); // Throw exception
+    // Create codestream
+    file->codestream.create( file->input );
+    codestream = file->codestream;
+    if( !codestream.exists() ) throw file_error( "Kakadu :: Unable to create codestream for '"+filename+"'"); // Throw exception
 
-  // Set up the cache size and allow restarting
-  //codestream.augment_cache_threshold(1024);
+    codestream.set_persistent();
+
+    // Codestreams kept in our handle pool may keep a limited amount of compressed data loaded
+    // between requests, beyond which it is unloaded and read again from the file when needed
+    if( handles && handles->enabled() ) codestream.augment_cache_threshold( KDU_CACHE_THRESHOLD );
+  }
 
   // Set Kakadu read mode
   switch( kdu_readmode ) {
@@ -118,12 +183,11 @@ void KakaduImage::openImage()
       codestream.set_fast();
   }
 
-  codestream.set_persistent();
-  //  codestream.enable_restart();
-
   // Load our metadata if not already loaded
   if( bpc == 0 ) loadImageInfo( currentX, currentY );
 
+  pooled = true;
+
 #ifdef DEBUG
   logfile << "Kakadu :: openImage() :: " << timer.getTime() << " microseconds" << endl;
 #endif
@@ -142,7 +206,7 @@ void KakaduImage::loadImageInfo( int seq, int ang )
 
   // Malformed images can throw exceptions here with older versions of Kakadu
   try{
-    jpx_layer = jpx_input.access_layer(0);
+    jpx_layer = file->jpx_input.access_layer(0);
   }
   catch( ... ){
     throw file_error( "Kakadu :: Core Exception Caught During Metadata Extraction"); // Rethrow the exception
@@ -233,7 +297,7 @@ void KakaduImage::loadImageInfo( int seq, int ang )
   j2k_channels.get_colour_mapping(0,cmp,plt,stream_id);
 #endif
 
-  j2k_palette = jpx_stream.access_palette();
+  j2k_palette = file->jpx_stream.access_palette();
 
   if( j2k_palette.exists() && j2k_palette.get_num_luts()>0 ){
     int entries = j2k_palette.get_num_entries();
@@ -323,12 +387,18 @@ void KakaduImage::closeImage()
   timer.start();
 #endif
 
-  // Close our codestream - need to make sure it exists or it'll crash
-  if( codestream.exists() ) codestream.destroy();
-
-  // Close our JP2 family and JPX files
-  src.close();
-  jpx_input.close();
+  if( file ){
+    // Any state held for our codestream by our persistent thread group must first be released
+    kdu_thread_env *env = threadGroup.current();
+    if( env && codestream.exists() ) env->cs_terminate( codestream );
+
+    // Keep our codestream open for subsequent requests if possible
+    if( handles && pooled ) handles->release( getFileName( currentX, currentY ), timestamp, file, closeKakadu );
+    else closeKakadu( file );
+    file = NULL;
+    codestream = kdu_codestream();
+    pooled = false;
+  }
 
 #ifdef DEBUG
   logfile << "Kakadu :: closeImage() :: " << timer.getTime() << " microseconds" << endl;
@@ -402,8 +472,8 @@ RawTile KakaduImage::getTile( int seq, int ang, unsigned int res, int layers, un
 
 
   // Create our raw tile buffer and initialize some values
-  if( obpc == 16 ) rawtile.data = new unsigned short[tw*th*channels];
-  else if( obpc == 8 ) rawtile.data = new unsigned char[tw*th*channels];
+  if( obpc == 16 ) rawtile.adopt( new unsigned short[tw*th*channels] );
+  else if( obpc == 8 ) rawtile.adopt( new unsigned char[tw*th*channels] );
   else throw file_error( "Kakadu :: Unsupported number of bits" );
 
   rawtile.dataLength = tw*th*channels*(obpc/8);
@@ -439,8 +509,8 @@ RawTile KakaduImage::getRegion( int seq, int ang, unsigned int res, int layers,
 
   RawTile rawtile( 0, res, seq, ang, w, h, channels, obpc );
 
-  if( obpc == 16 ) rawtile.data = new unsigned short[w*h*channels];
-  else if( obpc == 8 ) rawtile.data = new unsigned char[w*h*channels];
+  if( obpc == 16 ) rawtile.adopt( new unsigned short[w*h*channels] );
+  else if( obpc == 8 ) rawtile.adopt( new unsigned char[w*h*channels] );
   else throw file_error( "Kakadu :: Unsupported number of bits" );
 
   rawtile.dataLength = w*h*channels*(obpc/8);
@@ -470,8 +540,9 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
   int vipsres = ( numResolutions - 1 ) - res;
 
   // Handle virtual resolutions
+  unsigned int factor = 1;
   if( res < virtual_levels ){
-    unsigned int factor = 1 << (virtual_levels-res);
+    factor = 1 << (virtual_levels-res);
     xoffset *= factor;
     yoffset *= factor;
     tw *= factor;
@@ -505,35 +576,20 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
   codestream.map_region( 0, canvas_dims, image_dims, true );
 
 
-  // Create some worker threads
-#ifdef NPROCS
-  int num_threads = get_nprocs_conf();
-#else
-  int num_threads = 0;
-#endif
-
-
-  kdu_thread_env env, *env_ref = NULL;
-  if( num_threads > 0 ){
-    env.create();
-    for (int nt=0; nt < num_threads; nt++){
-      // Unable to create all the threads requested
-      if( !env.add_thread() ) num_threads = nt;
-    }
-    env_ref = &env;
-  }
-
+  // Get our persistent thread group
+  kdu_thread_env *env_ref = threadGroup.get( kdu_threads );
 
 
 #ifdef DEBUG
-  logfile << "Kakadu :: decompressor init with " << num_threads << " threads" << endl;
+  logfile << "Kakadu :: decompressor init with " << (env_ref ? threadGroup.getSize() : 1) << " threads" << endl;
   logfile << "Kakadu :: decoding " << layers << " quality layers" << endl;
 #endif
 
 
-  // Setup tile and stripe buffers
-  void *buffer = NULL;
+  // Setup stripe buffer and any filter for reducing to a virtual resolution
   void *stripe_buffer = NULL;
+  BoxFilter<kdu_uint16> *filter16 = NULL;
+  BoxFilter<kdu_byte> *filter8 = NULL;
   int *stripe_heights = NULL;
 
   try{
@@ -577,15 +633,16 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
     logfile << "Kakadu :: Allocating memory for stripe height " << stripe_heights[0] << endl;
 #endif
 
-    // Create our buffers
+    // Create our stripe buffer. Stripes are copied directly into our output or, for virtual
+    // resolutions, reduced into it as they are decoded
 
     if( obpc == 16 ){
       stripe_buffer = new kdu_uint16[tw*stripe_heights[0]*channels];
-      buffer = new unsigned short[tw*th*channels];
+      if( factor > 1 ) filter16 = new BoxFilter<kdu_uint16>( tw, th/factor, channels, factor, (kdu_uint16*) d );
     }
     else if( obpc == 8 ){
       stripe_buffer = new kdu_byte[tw*stripe_heights[0]*channels];
-      buffer = new unsigned char[tw*th*channels];
+      if( factor > 1 ) filter8 = new BoxFilter<kdu_byte>( tw, th/factor, channels, factor, (kdu_byte*) d );
     }
 
     // Keep track of changes in stripe heights
@@ -640,14 +697,12 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 #endif
 
       // Copy the data into the supplied buffer
-      void *b1, *b2;
+      void *b1;
       if( obpc == 16 ){
 	b1 = &( ((kdu_uint16*)stripe_buffer)[0] );
-	b2 = &( ((unsigned short*)buffer)[index] );
       }
       else{ // if( obpc == 8 ){
 	b1 = &( ((kdu_byte*)stripe_buffer)[0] );
-	b2 = &( ((unsigned char*)buffer)[index] );
 
 	/* Handle 1 bit bilevel images, which we output scaled to 8 bits
 	   - ideally we would do this in the Kakadu pull_stripe function,
@@ -673,7 +728,14 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 	}
       }
 
-      memcpy( b2, b1, tw * stripe_heights[0] * channels * (obpc/8) );
+      // Reduce each row of our stripe for virtual resolutions
+      if( filter16 ){
+	for( int r=0; r<stripe_heights[0]; r++ ) filter16->addRow( (kdu_uint16*) b1 + r*tw*channels );
+      }
+      else if( filter8 ){
+	for( int r=0; r<stripe_heights[0]; r++ ) filter8->addRow( (kdu_byte*) b1 + r*tw*channels );
+      }
+      else memcpy( (char*) d + index*(obpc/8), b1, tw * stripe_heights[0] * channels * (obpc/8) );
 
       // Advance our output buffer pointer
       index += tw * stripe_heights[0] * channels;
@@ -690,33 +752,9 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
     }
 
 
-    // Shrink virtual resolution tiles
-    if( res < virtual_levels ){
-
-#ifdef DEBUG
-      logfile << "Kakadu :: resizing tile to virtual resolution with factor " << (1 << (virtual_levels-res)) << endl;
-#endif
-
-      unsigned int n = 0;
-      unsigned int factor = 1 << (virtual_levels-res);
-      for( unsigned int j=0; j<th; j+=factor ){
-	for( unsigned int i=0; i<tw; i+=factor ){
-	  for( unsigned int k=0; k<channels; k++ ){
-	    // Handle 16 and 8 bit data
-	    if( obpc==16 ){
-	      ((unsigned short*)d)[n++] = ((unsigned short*)buffer)[j*tw*channels + i*channels + k];
-	    }
-	    else if( obpc==8 ){
-	      ((unsigned char*)d)[n++] = ((unsigned char*)buffer)[j*tw*channels + i*channels + k];
-	    }
-	  }
-	}
-      }
-    }
-    else memcpy( d, buffer, tw*th*channels * (obpc/8) );
-
-    // Delete our local buffer
-    delete_buffer( buffer );
+    // Write out any partial block of rows at the bottom edge of virtual resolutions
+    if( filter16 ) filter16->finish();
+    else if( filter8 ) filter8->finish();
 
 #ifdef DEBUG
     logfile << "Kakadu :: decompressor completed" << endl;
@@ -725,21 +763,23 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 
   }
   catch (...){
-    // Shut down our decompressor, delete our buffers, destroy our threads and codestream before rethrowing the exception
+    // Shut down our decompressor, delete our buffers and destroy our threads, which cannot be reused
+    // after an exception, before rethrowing the exception. Nor should our codestream be reused
     decompressor.finish();
-    if( env.exists() ) env.destroy();
+    threadGroup.destroy();
+    pooled = false;
     delete_buffer( stripe_buffer );
-    delete_buffer( buffer );
+    if( filter16 ) delete filter16;
+    if( filter8 ) delete filter8;
     if( stripe_heights ) delete[] stripe_heights;
     throw file_error( "Kakadu :: Core Exception Caught"); // Rethrow the exception
   }
 
 
-  // Destroy our threads
-  if( env.exists() ) env.destroy();
-
-  // Delete our stripe buffer
+  // Delete our stripe buffer and filters
   delete_buffer( stripe_buffer );
+  if( filter16 ) delete filter16;
+  if( filter8 ) delete filter8;
   if( stripe_heights ){
     delete[] stripe_heights;
     stripe_heights = NULL;
@@ -42,6 +42,9 @@
 
 #define TILESIZE 256
 
+// Memory in bytes each codestream kept in our handle pool may use for compressed data
+#define KDU_CACHE_THRESHOLD 16777216
+
 // Kakadu 7.5 uses namespaces
 #if KDU_MAJOR_VERSION > 7 || (KDU_MAJOR_VERSION == 7 && KDU_MINOR_VERSION >= 5)
 using namespace kdu_supp; // Also includes the `kdu_core' namespace
@@ -81,25 +84,30 @@ static kdu_message_formatter pretty_cerr(&cerr_message);
 
 
 
+/// Open JPEG2000 file and codestream, which may be kept open in our handle pool between requests
+struct KakaduFile {
+  jp2_family_src src;                  ///< JP2 file format object
+  jpx_source jpx_input;                ///< JPX format object
+  jpx_codestream_source jpx_stream;    ///< JPX codestream source
+  kdu_compressed_source *input;        ///< Codestream source
+  kdu_codestream codestream;           ///< Kakadu codestream object
+};
+
+
+
 /// Image class for Kakadu JPEG2000 Images: Inherits from IIPImage. Uses the Kakadu library.
 class KakaduImage : public IIPImage {
 
  private:
 
-  /// Kakadu codestream object
-  kdu_codestream codestream;
-
-  /// Codestream source
-  kdu_compressed_source *input;
-
-  /// JPX format object
-  jpx_source jpx_input;
+  /// Open file and codestream
+  KakaduFile *file;
 
-  /// JP2 file format object
-  jp2_family_src src;
+  /// Kakadu codestream object belonging to our open file
+  kdu_codestream codestream;
 
-  /// JPX codestream source
-  jpx_codestream_source jpx_stream;
+  /// Whether our open file can be returned to the handle pool
+  bool pooled;
 
   /// Kakadu decompressor object
   kdu_stripe_decompressor decompressor;
@@ -128,26 +136,26 @@ class KakaduImage : public IIPImage {
 
   /// Constructor
   KakaduImage(): IIPImage(){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; file = NULL; pooled = false; kdu_threads = 0;
   };
 
   /// Constructor
   /** @param path image path
    */
   KakaduImage( const std::string& path ): IIPImage( path ){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; file = NULL; pooled = false; kdu_threads = 0;
   };
 
   /// Copy Constructor
   /** @param image Kakadu object
    */
-  KakaduImage( const KakaduImage& image ): IIPImage( image ) {};
+  KakaduImage( const KakaduImage& image ): IIPImage( image ), file( NULL ), pooled( false ), kdu_threads( image.kdu_threads ) {};
 
   /// Constructor from IIPImage object
   /** @param image IIPImage object
    */
   KakaduImage( const IIPImage& image ): IIPImage( image ){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; file = NULL; pooled = false; kdu_threads = 0;
   };
 
   /// Assignment Operator
@@ -157,6 +165,7 @@ class KakaduImage : public IIPImage {
     if( this != &image ){
       closeImage();
       IIPImage::operator=(image);
+      kdu_threads = image.kdu_threads;
     }
     return *this;
   }
@@ -213,6 +222,9 @@ class KakaduImage : public IIPImage {
   /// Read-mode
   KDU_READMODE kdu_readmode;
 
+  /// Number of decoding threads, including the calling thread, or 0 or 1 for single threaded decoding
+  unsigned int kdu_threads;
+
 
 };
 
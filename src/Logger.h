@@ -26,6 +26,7 @@
 #include <fstream>
 #include <streambuf>
 #include <string>
+#include <mutex>
 
 
 
@@ -75,6 +76,70 @@ class SyslogStream : public std::streambuf {
 #endif
 
 
+/// Thread-safe stream buffer
+/** Characters are accumulated in a per-thread buffer and only forwarded to the
+    underlying stream buffer as a complete message when the stream is flushed
+    (for example via std::endl). This prevents output from several worker threads
+    becoming interleaved.
+ */
+class LogBuffer : public std::streambuf {
+
+ private:
+
+  /// The real output stream buffer
+  std::streambuf* _sink;
+
+  /// Mutex serializing writes to our sink
+  std::mutex _mutex;
+
+  /// Per-thread message buffer
+  static std::string& buffer(){
+    static thread_local std::string _buf;
+    return _buf;
+  }
+
+
+ public:
+
+  /// Constructor
+  LogBuffer() : _sink( NULL ) { };
+
+  /// Set the underlying stream buffer
+  void setSink( std::streambuf* sink ){
+    std::lock_guard<std::mutex> lock( _mutex );
+    _sink = sink;
+  }
+
+  /// Override streambuf sync() function - forward our message to the sink
+  int sync(){
+    std::string& buf = buffer();
+    if( buf.empty() ) return 0;
+    std::lock_guard<std::mutex> lock( _mutex );
+    if( _sink ){
+      _sink->sputn( buf.data(), buf.size() );
+      _sink->pubsync();
+    }
+    buf.erase();
+    return 0;
+  }
+
+  /// Override streambuf overflow() function
+  int_type overflow( int_type c ){
+    if( c == traits_type::eof() ) sync();
+    else buffer() += static_cast<char>(c);
+    return c;
+  }
+
+  /// Override streambuf xsputn() function to avoid per-character calls to overflow()
+  std::streamsize xsputn( const char* s, std::streamsize n ){
+    buffer().append( s, n );
+    return n;
+  }
+
+};
+
+
+
 /// Logger class - handles ofstreams and syslog
 class Logger : public std::ostream {
 
@@ -88,6 +153,9 @@ class Logger : public std::ostream {
   /// File stream
   std::ofstream _fstream;
 
+  /// Thread-safe buffer through which all output is routed
+  LogBuffer _logBuffer;
+
   /// Supported output types
   enum Type {
 #ifdef HAVE_SYSLOG_H
@@ -117,7 +185,8 @@ class Logger : public std::ostream {
     // Open a syslog connection - assign syslog stream to our stream buffer
     if( file == "syslog" ){
       _type = SYSLOG;
-      this->rdbuf( &_syslogStream );
+      _logBuffer.setSink( &_syslogStream );
+      this->rdbuf( &_logBuffer );
       _syslogStream.open();
     }
     // Create an output file stream and assign it to our stream buffer
@@ -125,8 +194,9 @@ class Logger : public std::ostream {
 #endif
       _type = FILE;
       _fstream.open( file.c_str(), ios_base::app );
-      std::streambuf *buffer = _fstream.rdbuf();
-      this->rdbuf( buffer );
+      _logBuffer.setSink( _fstream.rdbuf() );
+      this->rdbuf( &_logBuffer );
+      if( !_fstream ) this->setstate( std::ios_base::badbit );
 #ifdef HAVE_SYSLOG_H
     }
 #endif
@@ -135,6 +205,7 @@ class Logger : public std::ostream {
 
   /// Close depending on type
   void close(){
+    this->flush();
     switch( _type ){
 #ifdef HAVE_SYSLOG_H
       case SYSLOG:
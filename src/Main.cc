@@ -30,6 +30,15 @@
 #include <utility>
 #include <map>
 #include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
 
 #include "TPTImage.h"
 #include "JPEGCompressor.h"
@@ -93,20 +102,26 @@ using namespace std;
 */
 int loglevel;
 Logger logfile;
-unsigned long IIPcount;
+std::atomic<unsigned long> IIPcount;
 char *tz = NULL;
 
 
 
-// Create pointers to our cache structures for use in our signal handler function
-imageCacheMapType* ic = NULL;
+// Create pointers to our cache structures for use when reloading and on termination
+ImageCache* ic = NULL;
 Cache* tc = NULL;
+NegativeCache* nc = NULL;
+HandlePool* hp = NULL;
 
+// Number of worker threads still accepting requests
+std::atomic<unsigned int> IIPWorkers;
 
 void IIPReloadCache( int signal )
 {
   if( ic ) ic->clear();
   if( tc ) tc->clear();
+  if( nc ) nc->clear();
+  if( hp ) hp->clear();
 
   if( loglevel >= 1 ){
     // No strsignal on Windows
@@ -121,49 +136,148 @@ void IIPReloadCache( int signal )
 
 
 
-/* Handle a termination signal - print out some stats and exit
+#ifdef WIN32
+/* Handle a termination signal where our main thread cannot wait for signals: only
+   stop accepting requests. Our main thread saves our caches and exits once our
+   workers have finished any request in progress
  */
+volatile sig_atomic_t IIPTerminate = 0;
+
 void IIPSignalHandler( int signal )
 {
-  if( loglevel >= 1 ){
+  IIPTerminate = signal;
+  FCGX_ShutdownPending();
+}
+#endif
+
+
 
-    // Reset our time zone environment
-    if(tz) setenv("TZ", tz, 1);
-    else unsetenv("TZ");
-    tzset();
+/* Print out some stats on termination, once all our workers have stopped
+ */
+void IIPReport( int signal )
+{
+  // Reset our time zone environment
+  if(tz) setenv("TZ", tz, 1);
+  else unsetenv("TZ");
+  tzset();
 
-    time_t current_time = time( NULL );
-    char *date = ctime( &current_time );
+  time_t current_time = time( NULL );
+  char *date = ctime( &current_time );
 
-    // Remove trailing newline
-    date[strcspn(date, "\n")] = '\0';
+  // Remove trailing newline
+  date[strcspn(date, "\n")] = '\0';
 
+  logfile << endl;
+  if( signal ){
     // No strsignal on Windows
 #ifdef WIN32
     int sigstr = signal;
 #else
     char *sigstr = strsignal( signal );
 #endif
+    logfile << "Caught " << sigstr << " signal. ";
+  }
+  logfile << "Terminating after " << IIPcount << " accesses" << endl
+	  << date << endl;
 
-    logfile << endl << "Caught " << sigstr << " signal. "
-	    << "Terminating after " << IIPcount << " accesses" << endl
-	    << date << endl
-	    << "<----------------------------------->" << endl << endl;
-    logfile.close();
+  // Report how many requests for missing images were rejected without checking the file system
+  if( nc && nc->enabled() && loglevel >= 2 ){
+    logfile << "Negative image cache hits: " << nc->getHits() << endl;
+  }
+
+  // Report how often open decoder handles were reused
+  if( hp && hp->enabled() && loglevel >= 2 ){
+    logfile << "Decoder handle pool hits: " << hp->getHits() << ", misses: " << hp->getMisses() << endl;
+  }
+
+  // Report how many requests shared a tile decoded on their behalf by another request
+  if( tc && loglevel >= 2 ){
+    unsigned long waits = tc->getCoalescedWaits();
+    logfile << "Coalesced tile requests: " << waits;
+    if( waits > 0 ) logfile << ", average wait " << tc->getCoalescedTime() / waits << " microseconds";
+    logfile << endl;
   }
 
-  exit( 0 );
+  // Report the images occupying most of our tile cache
+  if( tc && loglevel >= 2 ){
+    vector<Cache::ImageStats> stats = tc->getImageStats();
+    if( tc->getQuotaEvictions() > 0 ) logfile << "Tile cache quota evictions: " << tc->getQuotaEvictions() << endl;
+    if( !stats.empty() ) logfile << "Tile cache occupancy by image (" << tc->getNumImages() << " image paths interned):" << endl;
+    for( unsigned int i=0; i<stats.size() && i<20; i++ ){
+      logfile << "  " << stats[i].filename << ": " << stats[i].tiles << " tiles, "
+	      << stats[i].size / 1024000.0 << " MB, " << stats[i].evictions << " quota evictions" << endl;
+    }
+  }
+
+  logfile << "<----------------------------------->" << endl << endl;
 }
 
 
 
 
 
+/// Server-wide settings and shared objects handed to each of our worker threads
+struct IIPServer {
+  int listen_socket;
+  string version;
+  int jpeg_quality;
+  int max_CVT;
+  int max_layers;
+  bool allow_upscaling;
+  bool embed_icc;
+  bool jpeg_passthrough;
+  unsigned int tiff_io;
+  unsigned int codec_threads;
+  unsigned int iiif_version;
+#ifdef HAVE_KAKADU
+  unsigned int kdu_readmode;
+#endif
+  string cors;
+  string base_url;
+  string cache_control;
+  map<string,string> uri_map;
+  Watermark* watermark;
+  Transform* processor;
+  ImageCache* imageCache;
+  Cache* tileCache;
+  NegativeCache* negativeCache;
+  HandlePool* handlePool;
+#ifdef HAVE_MEMCACHED
+  string memcached_servers;
+  unsigned int memcached_timeout;
+#endif
+#ifdef DEBUG
+  char* debug_request;
+#endif
+};
+
+
+
+#ifndef DEBUG
+/* Accept a new request. Not all platforms allow accept() to be called concurrently
+   on the same socket, so serialize access between our worker threads
+ */
+int IIPAccept( FCGX_Request* request )
+{
+  static std::mutex accept_mutex;
+  std::lock_guard<std::mutex> lock( accept_mutex );
+  return FCGX_Accept_r( request );
+}
+#endif
+
+
+
+// Our worker request loop
+void IIPWorker( IIPServer* server );
+
+
+
+
+
 int main( int argc, char *argv[] )
 {
 
   IIPcount = 0;
-  int i;
 
 
   // Define ourselves a version
@@ -219,12 +333,15 @@ int main( int argc, char *argv[] )
 
   // Set up some FCGI items and make sure we are in FCGI mode
 
+  int listen_socket = 0;
+
 #ifndef DEBUG
 
-  FCGX_Request request;
-  int listen_socket = 0;
   bool standalone = false;
 
+  // Initialize the FCGI library - required before any use of the re-entrant functions
+  if( FCGX_Init() ) return(1);
+
   if( argv[1] && (string(argv[1]) == "--bind") ){
     string socket = argv[2];
     if( !socket.length() ){
@@ -245,8 +362,6 @@ int main( int argc, char *argv[] )
     logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
   }
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
-
   // Check whether we are really in FCGI mode - only if we are not in standalone mode
   if( FCGX_IsCGI() ){
     if( !standalone ){
@@ -263,9 +378,19 @@ int main( int argc, char *argv[] )
 
   // Set our maximum image cache size
   float max_image_cache_size = Environment::getMaxImageCacheSize();
-  imageCacheMapType imageCache;
+
+  // Create our image metadata cache
+  ImageCache imageCache( Environment::getMetadataCacheSize() );
   ic = &imageCache;
 
+  // Create our cache of image paths which recently failed to open
+  NegativeCache negativeCache( Environment::getNegativeCacheTTL(), Environment::getNegativeCacheSize() );
+  nc = &negativeCache;
+
+  // Create our pool of open decoder handles
+  HandlePool handlePool( Environment::getHandlePoolSize() );
+  hp = &handlePool;
+
 
   // Get our image pattern variable
   string filename_pattern = Environment::getFileNamePattern();
@@ -322,10 +447,46 @@ int main( int argc, char *argv[] )
   bool embed_icc = Environment::getEmbedICC();
 
 
+  // Get the JPEG tile passthrough setting
+  bool jpeg_passthrough = Environment::getJPEGPassthrough();
+
+
+  // Get the I/O mode used to read TIFF files
+  string tiff_io_mode = Environment::getTIFFIO();
+  transform( tiff_io_mode.begin(), tiff_io_mode.end(), tiff_io_mode.begin(), ::tolower );
+  unsigned int tiff_io = TPTImage::TIFF_IO_LIBTIFF;
+#ifdef HAVE_PREAD
+  if( tiff_io_mode == "pread" ) tiff_io = TPTImage::TIFF_IO_PREAD;
+#ifdef HAVE_SYS_MMAN_H
+  else if( tiff_io_mode == "mmap" ) tiff_io = TPTImage::TIFF_IO_MMAP;
+#endif
+#endif
+
+
   // Set our IIIF version
   unsigned int iiif_version = Environment::getIIIFVersion();
 
 
+  // Get the number of worker threads used to handle requests concurrently
+  unsigned int worker_threads = Environment::getWorkerThreads();
+#ifdef DEBUG
+  worker_threads = 1;
+#endif
+
+
+  // Get the number of threads used by each worker for decoding and image processing. By default
+  // share our processors between our workers so that they do not oversubscribe the machine
+  unsigned int codec_threads = Environment::getCodecThreads();
+  if( codec_threads == 0 ){
+    unsigned int ncpus = thread::hardware_concurrency();
+    codec_threads = ( ncpus > worker_threads ) ? ncpus / worker_threads : 1;
+  }
+#ifdef _OPENMP
+  // OpenMP uses the same number of threads, unless explicitly set
+  if( !getenv( "OMP_NUM_THREADS" ) ) omp_set_num_threads( codec_threads );
+#endif
+
+
   // Create our image processing engine
   Transform* processor = new Transform();
 
@@ -346,6 +507,8 @@ int main( int argc, char *argv[] )
     logfile << "Setting HTTP Cache-Control header to '" << cache_control << "'" << endl;
     logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
     logfile << "Setting IIIF version to " << iiif_version << endl;
+    logfile << "Setting number of worker threads to " << worker_threads << endl;
+    logfile << "Setting number of decoding threads per worker to " << codec_threads << endl;
     if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
     if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
     if( max_layers != 0 ){
@@ -355,6 +518,21 @@ int main( int argc, char *argv[] )
     }
     logfile << "Setting Allow Upscaling to " << (allow_upscaling? "true" : "false") << endl;
     logfile << "Setting ICC profile embedding to " << (embed_icc? "true" : "false") << endl;
+    logfile << "Setting JPEG tile passthrough to " << (jpeg_passthrough? "true" : "false") << endl;
+    logfile << "Setting TIFF I/O mode to "
+	    << ((tiff_io==TPTImage::TIFF_IO_MMAP) ? "mmap" : (tiff_io==TPTImage::TIFF_IO_PREAD) ? "pread" : "libtiff") << endl;
+    logfile << "Setting image metadata cache size to " << Environment::getMetadataCacheSize() << " images" << endl;
+    if( Environment::getImageRevalidationInterval() > 0 ){
+      logfile << "Checking image modification times at most every "
+	      << Environment::getImageRevalidationInterval() << " seconds" << endl;
+    }
+    if( handlePool.enabled() ){
+      logfile << "Keeping up to " << Environment::getHandlePoolSize() << " open image handles between requests" << endl;
+    }
+    if( negativeCache.enabled() ){
+      logfile << "Remembering missing images for " << Environment::getNegativeCacheTTL()
+	      << " seconds (up to " << Environment::getNegativeCacheSize() << " images)" << endl;
+    }
 #ifdef HAVE_KAKADU
     logfile << "Setting up JPEG2000 support via Kakadu SDK" << endl;
     logfile << "Setting Kakadu read-mode to " << ((kdu_readmode==2) ? "resilient" : (kdu_readmode==1) ? "fussy" : "fast") << endl;
@@ -430,9 +608,9 @@ int main( int argc, char *argv[] )
   string memcached_servers = Environment::getMemcachedServers();
   unsigned int memcached_timeout = Environment::getMemcachedTimeout();
 
-  // Create our memcached object
-  Memcache memcached( memcached_servers, memcached_timeout );
+  // Check our memcached connection - each worker creates its own memcached object
   if( loglevel >= 1 ){
+    Memcache memcached( memcached_servers, memcached_timeout );
     if( memcached.connected() ){
       logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
 	      << "' with timeout " << memcached_timeout << endl;
@@ -494,19 +672,19 @@ int main( int argc, char *argv[] )
 
 
   /***********************************************************
-    Set up a signal handler for USR1, TERM, HUP and INT signals
-    - to simplify things, they can all just shutdown the
-      server. We can rely on mod_fastcgi to restart us.
-    - SIGUSR1 and SIGHUP don't exist on Windows, though. 
+    Signals USR1, TERM and INT shut down the server and HUP
+    empties our caches. We can rely on mod_fastcgi to restart us.
+    - Our main thread waits for these signals once our workers
+      have started, so that they are handled outside of any
+      signal handler.
+    - SIGUSR1 and SIGHUP don't exist on Windows, though, where
+      our handler can only stop our workers accepting requests.
   ***********************************************************/
 
-#ifndef WIN32
-  signal( SIGUSR1, IIPSignalHandler );
-  signal( SIGHUP, IIPReloadCache );
-#endif
-
+#ifdef WIN32
   signal( SIGTERM, IIPSignalHandler );
   signal( SIGINT, IIPSignalHandler );
+#endif
 
 
 
@@ -517,15 +695,279 @@ int main( int argc, char *argv[] )
   }
 
 
-  // Set up our request timers and seed our random number generator with the millisecond count from it
+  // Seed our random number generator with the millisecond count from a timer
   Timer request_timer;
   srand( request_timer.getTime() );
 
-  // Create our tile cache
-  Cache tileCache( max_image_cache_size );
+  // Create our tile cache. When running several workers, split the cache into independently
+  // locked shards to avoid lock contention between threads. The cache limits the number of
+  // shards according to its size
+  unsigned int cache_shards = (worker_threads > 1) ? 4*worker_threads : 1;
+  Cache tileCache( max_image_cache_size, cache_shards, Environment::getCachePolicy() );
   tc = &tileCache;
+  if( loglevel >= 2 ){
+    logfile << "Tile cache split into " << tileCache.getNumShards() << " shard(s) using "
+	    << tileCache.getPolicyName() << " eviction" << endl << endl;
+  }
+
+  // Limit the share of the cache that can be taken by any single image
+  float cache_image_quota = Environment::getCacheImageQuota();
+  if( cache_image_quota > 0 ){
+    tileCache.setImageQuota( cache_image_quota );
+    if( loglevel >= 1 ){
+      logfile << "Limiting tiles from each image to " << cache_image_quota*100.0 << "% of the tile cache" << endl << endl;
+    }
+  }
+
+  // Optionally compress uncompressed tiles held within our tile cache
+  TileCodec tileCodec( Environment::getCacheCompression() );
+  if( tileCodec.getCodec() != TileCodec::CODEC_NONE ){
+    tileCache.setCodec( &tileCodec );
+    if( loglevel >= 1 ){
+      logfile << "Compressing uncompressed tiles within the tile cache using " << tileCodec.name() << endl << endl;
+    }
+  }
+
+#ifdef HAVE_SHM_OPEN
+  // Attach our optional shared memory tile cache, which is shared between iipsrv processes
+  SharedCache* shared_cache = NULL;
+  float shm_cache_size = Environment::getShmCacheSize();
+  if( shm_cache_size > 0 ){
+    string shm_cache_name = Environment::getShmCacheName();
+    try{
+      shared_cache = new SharedCache( shm_cache_name, shm_cache_size );
+      tileCache.setSharedCache( shared_cache );
+      if( loglevel >= 1 ){
+	logfile << "Using shared memory tile cache '" << shm_cache_name << "' of size "
+		<< shared_cache->getSegmentSize() << "MB" << endl << endl;
+      }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl << endl;
+    }
+  }
+#endif
+
+
+#ifdef HAVE_PREAD
+  // Attach our optional persistent disk tier for JPEG tiles
+  DiskCache* disk_cache = NULL;
+  string disk_cache_dir = Environment::getDiskCacheDir();
+  float disk_cache_size = Environment::getDiskCacheSize();
+  if( !disk_cache_dir.empty() && disk_cache_size > 0 ){
+    try{
+      disk_cache = new DiskCache( disk_cache_dir, disk_cache_size );
+      tileCache.setDiskCache( disk_cache );
+      if( loglevel >= 1 ){
+	logfile << "Using disk tile cache in '" << disk_cache->getDirectory() << "' of size "
+		<< disk_cache->getMaxSize() << "MB holding " << disk_cache->getNumElements() << " tiles" << endl << endl;
+      }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl << endl;
+    }
+  }
+#endif
+
+
+#ifdef HAVE_SYS_MMAN_H
+  // Warm our tile cache from any snapshot saved on shutdown
+  string snapshot_file = Environment::getCacheSnapshot();
+  float snapshot_size = Environment::getCacheSnapshotSize();
+  if( !snapshot_file.empty() ){
+    Timer snapshot_timer;
+    snapshot_timer.start();
+    unsigned int n = tileCache.loadSnapshot( snapshot_file, filesystem_prefix, filesystem_suffix );
+    if( loglevel >= 1 ){
+      logfile << "Loaded " << n << " tiles from tile cache snapshot '" << snapshot_file << "' in "
+	      << snapshot_timer.getTime()/1000 << " ms" << endl << endl;
+    }
+  }
+#endif
+
+
+  // Gather together everything our workers need
+  IIPServer server;
+  server.listen_socket = listen_socket;
+  server.version = version;
+  server.jpeg_quality = jpeg_quality;
+  server.max_CVT = max_CVT;
+  server.max_layers = max_layers;
+  server.allow_upscaling = allow_upscaling;
+  server.embed_icc = embed_icc;
+  server.jpeg_passthrough = jpeg_passthrough;
+  server.tiff_io = tiff_io;
+  server.codec_threads = codec_threads;
+  server.iiif_version = iiif_version;
+#ifdef HAVE_KAKADU
+  server.kdu_readmode = kdu_readmode;
+#endif
+  server.cors = cors;
+  server.base_url = base_url;
+  server.cache_control = cache_control;
+  server.uri_map = uri_map;
+  server.watermark = &watermark;
+  server.processor = processor;
+  server.imageCache = &imageCache;
+  server.tileCache = &tileCache;
+  server.negativeCache = &negativeCache;
+  server.handlePool = &handlePool;
+#ifdef HAVE_MEMCACHED
+  server.memcached_servers = memcached_servers;
+  server.memcached_timeout = memcached_timeout;
+#endif
+#ifdef DEBUG
+  server.debug_request = argv[1];
+#endif
+
+
+
+  /*******************************************************
+    Main FCGI loop - requests are handled by a pool of
+    worker threads sharing our tile and image caches
+  *******************************************************/
+
+  // Signal which terminated the server, if any
+  int caught = 0;
+
+#ifdef DEBUG
+  IIPWorker( &server );
+#else
+
+#ifndef WIN32
+  // Block our signals in all threads, including those started by our workers,
+  // so that only our main thread receives them through sigwait()
+  sigset_t signals;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGUSR1 );
+  sigaddset( &signals, SIGHUP );
+  sigaddset( &signals, SIGTERM );
+  sigaddset( &signals, SIGINT );
+  pthread_sigmask( SIG_BLOCK, &signals, NULL );
+#endif
+
+  IIPWorkers = worker_threads;
+  vector<thread> workers;
+  for( unsigned int n=0; n<worker_threads; n++ ){
+    workers.push_back( thread( IIPWorker, &server ) );
+  }
+
+#ifndef WIN32
+  // Empty our caches on SIGHUP until we are asked to terminate. Workers which
+  // have all stopped of their own accord wake us with SIGTERM
+  while( true ){
+    int sig = 0;
+    if( sigwait( &signals, &sig ) != 0 ) continue;
+    if( sig == SIGHUP ){
+      IIPReloadCache( sig );
+      continue;
+    }
+    if( IIPWorkers > 0 ) caught = sig;
+    break;
+  }
+
+  // Stop accepting requests and wake any worker waiting for one. Workers
+  // finish any request in progress before leaving their request loop
+  FCGX_ShutdownPending();
+  shutdown( listen_socket, SHUT_RDWR );
+#endif
+
+  // Wait for our workers to finish
+  for( unsigned int n=0; n<workers.size(); n++ ) workers[n].join();
+
+#ifdef WIN32
+  caught = IIPTerminate;
+#endif
+
+#endif
+
+
+#ifdef HAVE_SHM_OPEN
+  tileCache.setSharedCache( NULL );
+  delete shared_cache;
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+  if( !snapshot_file.empty() ){
+    unsigned int n = tileCache.saveSnapshot( snapshot_file, snapshot_size );
+    if( loglevel >= 1 ) logfile << "Saved " << n << " tiles to tile cache snapshot '" << snapshot_file << "'" << endl;
+  }
+#endif
+
+#ifdef HAVE_PREAD
+  // Our disk tier saves its index so that it can be reloaded on restart
+  tileCache.setDiskCache( NULL );
+  delete disk_cache;
+#endif
+
+  if( loglevel >= 1 ){
+    IIPReport( caught );
+    logfile.close();
+  }
+
+  return( 0 );
+
+}
+
+
+
+
+/* Worker request loop. Each worker has its own FCGI request, compressor, view, response
+   and session objects, but shares the tile and image metadata caches with other workers
+ */
+void IIPWorker( IIPServer* server )
+{
+  int i;
   Task* task = NULL;
 
+  // Make local references to our settings
+  const string& version = server->version;
+  const int jpeg_quality = server->jpeg_quality;
+  const int max_CVT = server->max_CVT;
+  const int max_layers = server->max_layers;
+  const bool allow_upscaling = server->allow_upscaling;
+  const bool embed_icc = server->embed_icc;
+  const bool jpeg_passthrough = server->jpeg_passthrough;
+  const unsigned int tiff_io = server->tiff_io;
+  const unsigned int codec_threads = server->codec_threads;
+  const unsigned int iiif_version = server->iiif_version;
+#ifdef HAVE_KAKADU
+  const unsigned int kdu_readmode = server->kdu_readmode;
+#endif
+  const string& cors = server->cors;
+  const string& base_url = server->base_url;
+  const string& cache_control = server->cache_control;
+  const map<string,string>& uri_map = server->uri_map;
+  Watermark* watermark = server->watermark;
+  Transform* processor = server->processor;
+  ImageCache* imageCache = server->imageCache;
+  Cache* tileCache = server->tileCache;
+  NegativeCache* negativeCache = server->negativeCache;
+  HandlePool* handlePool = server->handlePool;
+
+#ifdef DEBUG
+  char* argv[2] = { NULL, server->debug_request };
+#else
+  FCGX_Request request;
+  if( FCGX_InitRequest( &request, server->listen_socket, 0 ) ){
+    if( loglevel >= 1 ) logfile << "Unable to initialize FCGI request" << endl;
+    return;
+  }
+#endif
+
+#ifdef _OPENMP
+  // Each thread has its own OpenMP thread count
+  if( !getenv( "OMP_NUM_THREADS" ) ) omp_set_num_threads( codec_threads );
+#endif
+
+#ifdef HAVE_MEMCACHED
+  // Each worker has its own memcached connection
+  Memcache memcached( server->memcached_servers, server->memcached_timeout );
+#endif
+
+  // Set up our request timer
+  Timer request_timer;
+
 
 
   /****************
@@ -542,7 +984,7 @@ int main( int argc, char *argv[] )
 
 #else
 
-  while( FCGX_Accept_r( &request ) >= 0 ){
+  while( IIPAccept( &request ) >= 0 ){
 
     FCGIWriter writer( request.out );
 
@@ -584,13 +1026,18 @@ int main( int argc, char *argv[] )
       session.jpeg = &jpeg;
       session.loglevel = loglevel;
       session.logfile = &logfile;
-      session.imageCache = &imageCache;
-      session.tileCache = &tileCache;
+      session.imageCache = imageCache;
+      session.tileCache = tileCache;
+      session.negativeCache = negativeCache;
+      session.handlePool = handlePool;
       session.out = &writer;
-      session.watermark = &watermark;
+      session.watermark = watermark;
       session.headers.clear();
       session.processor = processor;
       session.codecOptions["IIIF_VERSION"] = iiif_version;
+      session.codecOptions["JPEG_PASSTHROUGH"] = jpeg_passthrough;
+      session.codecOptions["TIFF_IO"] = tiff_io;
+      session.codecOptions["CODEC_THREADS"] = codec_threads;
 #ifdef HAVE_KAKADU
       session.codecOptions["KAKADU_READMODE"] = kdu_readmode;
 #endif
@@ -945,13 +1392,13 @@ int main( int argc, char *argv[] )
     ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
   }
 
+#ifndef DEBUG
+  FCGX_Free( &request, 1 );
 
-
-  if( loglevel >= 1 ){
-    logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
-    logfile.close();
-  }
-
-  return( 0 );
+#ifndef WIN32
+  // Wake our main thread if we were the last worker accepting requests
+  if( --IIPWorkers == 0 ) kill( getpid(), SIGTERM );
+#endif
+#endif
 
 }
@@ -0,0 +1,172 @@
+/*
+    IIPImage Server - Negative Image Cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _NEGATIVECACHE_H
+#define _NEGATIVECACHE_H
+
+
+#include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <ctime>
+#include "HashMap.h"
+
+
+
+/// Bounded cache of image paths which were recently found not to exist
+/** Requests for non-existent images, typically from broken links and crawlers, are
+    otherwise each checked against the file system with several stat(), fopen() and
+    glob() calls before failing. Missing paths are remembered together with their error
+    message for a limited time, so that repeated requests can be rejected immediately.
+    Other failures to open an image, which may be transient, are not remembered.
+    Entries expire after their time to live, so that images which subsequently appear
+    are picked up, and the whole cache is emptied by clear(), which is called on SIGHUP.
+    Entries are held in order of insertion, which is also their order of expiry, and the
+    oldest are dropped once the cache is full.
+ */
+class NegativeCache {
+
+ private:
+
+  /// A failed path
+  struct Entry {
+    std::string path;       ///< Image path
+    std::string error;      ///< Error message
+    time_t expires;         ///< Time after which this entry is no longer valid
+  };
+
+  /// Index typedef
+  typedef HASHMAP < std::string, std::list<Entry>::iterator > EntryMap;
+
+  /// Entries, oldest first
+  std::list<Entry> entries;
+
+  /// Index into our entry list
+  EntryMap index;
+
+  /// Mutex protecting our entries
+  std::mutex mutex;
+
+  /// Time to live in seconds
+  unsigned int ttl;
+
+  /// Maximum number of entries
+  unsigned int maxEntries;
+
+  /// Number of requests rejected from our cache
+  std::atomic<unsigned long> hits;
+
+
+  /// Remove an entry - must be called with lock held
+  void _erase( EntryMap::iterator i ){
+    entries.erase( i->second );
+    index.erase( i );
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param t time to live in seconds or 0 to disable
+      @param max maximum number of entries
+   */
+  NegativeCache( unsigned int t, unsigned int max ) : ttl( t ), maxEntries( max ), hits( 0 ) {};
+
+
+  /// Return whether the cache is enabled
+  bool enabled() const { return ttl > 0 && maxEntries > 0; };
+
+
+  /// Look up a path
+  /** @param path image path
+      @param error set to the error message recorded for this path
+      @return true if the path recently failed to open
+   */
+  bool find( const std::string& path, std::string& error ){
+    if( !enabled() ) return false;
+    std::lock_guard<std::mutex> lock( mutex );
+    EntryMap::iterator i = index.find( path );
+    if( i == index.end() ) return false;
+    if( time( NULL ) >= i->second->expires ){
+      this->_erase( i );
+      return false;
+    }
+    error = i->second->error;
+    hits++;
+    return true;
+  }
+
+
+  /// Record a path which failed to open
+  /** @param path image path
+      @param error error message
+   */
+  void insert( const std::string& path, const std::string& error ){
+    if( !enabled() ) return;
+    std::lock_guard<std::mutex> lock( mutex );
+    EntryMap::iterator i = index.find( path );
+    if( i != index.end() ) this->_erase( i );
+    while( entries.size() >= maxEntries ){
+      index.erase( entries.front().path );
+      entries.pop_front();
+    }
+    Entry e;
+    e.path = path;
+    e.error = error;
+    e.expires = time( NULL ) + ttl;
+    entries.push_back( e );
+    index[ path ] = --entries.end();
+  }
+
+
+  /// Forget a path, for example once it has been successfully opened
+  /** @param path image path */
+  void erase( const std::string& path ){
+    if( !enabled() ) return;
+    std::lock_guard<std::mutex> lock( mutex );
+    EntryMap::iterator i = index.find( path );
+    if( i != index.end() ) this->_erase( i );
+  }
+
+
+  /// Empty the cache
+  void clear(){
+    std::lock_guard<std::mutex> lock( mutex );
+    entries.clear();
+    index.clear();
+  }
+
+
+  /// Return the number of entries
+  unsigned int getNumElements(){
+    std::lock_guard<std::mutex> lock( mutex );
+    return entries.size();
+  }
+
+
+  /// Return the number of requests rejected from our cache
+  unsigned long getHits(){ return hits; };
+
+};
+
+
+#endif
@@ -22,17 +22,22 @@
 #include <sstream>
 #include <fstream>
 #include <cmath>
+#include "BoxFilter.h"
 #include "Timer.h"
 
 
 using namespace std;
 
 
-// Handle info, warning and error messages from OpenJPEG
-static void error_callback( const char* msg, void* ){
-  stringstream ss;
-  ss << "OpenJPEG error :: " << msg;
-  throw file_error( ss.str() );
+// Handle info, warning and error messages from OpenJPEG. Errors can be raised within OpenJPEG's
+// own decoding threads, so rather than throwing here, record the message and report it once the
+// failing OpenJPEG call returns
+static void error_callback( const char* msg, void* client_data ){
+  string* error = (string*) client_data;
+  if( error ){
+    error->assign( msg );
+    if( !error->empty() && (*error)[error->size()-1] == '\n' ) error->erase( error->size()-1 );
+  }
 }
 
 #ifdef DEBUG
@@ -46,6 +51,18 @@ static void info_callback( const char* msg, void* ){
 
 
 
+// Close an OpenJPEG codestream held by our handle pool
+static void closeOpenJPEG( void* f ){
+  OpenJPEGFile* file = (OpenJPEGFile*) f;
+  opj_end_decompress( file->codec, file->stream );
+  opj_destroy_codec( file->codec );
+  opj_stream_destroy( file->stream );
+  opj_image_destroy( file->image );
+  delete file;
+}
+
+
+
 void OpenJPEGImage::openImage()
 {
   string filename = getFileName( currentX, currentY );
@@ -53,45 +70,81 @@ void OpenJPEGImage::openImage()
   // Update our timestamp
   updateTimestamp( filename );
 
-  // Create decompression codec
-  _codec = opj_create_decompress( OPJ_CODEC_JP2 );
-
-  // Set info, warning and error handlers for codec
 #ifdef DEBUG
-  opj_set_info_handler( _codec, info_callback, NULL );
-  opj_set_warning_handler( _codec, warning_callback, NULL );
+  Timer timer;
+  timer.start();
 #endif
-  opj_set_error_handler( _codec, error_callback, NULL );
 
-  // Setup decoder
-  opj_dparameters_t parameters; // Set default decoder parameters
-  opj_set_default_decoder_parameters( &parameters );
-  if( !opj_setup_decoder( _codec, &parameters ) ){
-    throw file_error( "OpenJPEG :: openImage() :: error setting up decoder" );
+  // Reuse an already open codestream for this file if available
+  OpenJPEGFile* file = handles ? (OpenJPEGFile*) handles->acquire( filename, timestamp, closeOpenJPEG ) : NULL;
+  if( file ){
+    _stream = file->stream;
+    _codec = file->codec;
+    _image = file->image;
+    _layers = file->layers;
+    _reusable = true;
+    delete file;
+    // Our error handler needs to point to this object
+    opj_set_error_handler( _codec, error_callback, &_error );
   }
+  else{
+
+    _reusable = false;
 
+    // Create decompression codec
+    _codec = opj_create_decompress( OPJ_CODEC_JP2 );
+
+    // Set info, warning and error handlers for codec
 #ifdef DEBUG
-  Timer timer;
-  timer.start();
+    opj_set_info_handler( _codec, info_callback, NULL );
+    opj_set_warning_handler( _codec, warning_callback, NULL );
 #endif
+    opj_set_error_handler( _codec, error_callback, &_error );
 
-  // Open the JPEG2000 file in read mode
-  if( !(_stream = opj_stream_create_default_file_stream( filename.c_str(), true) ) ){
-    throw file_error( "OpenJPEG :: Unable to open '" + filename + "'" );
-  }
+    // Setup decoder
+    opj_dparameters_t parameters; // Set default decoder parameters
+    opj_set_default_decoder_parameters( &parameters );
+    if( !opj_setup_decoder( _codec, &parameters ) ){
+      throw file_error( "OpenJPEG :: openImage() :: error setting up decoder" );
+    }
+    _layers = -1;
 
+#ifdef OPJ_THREADS
+    // Set the number of decoding threads - fails if OpenJPEG has been built without thread support
+    if( opj_threads > 1 && !opj_codec_set_threads( _codec, opj_threads ) ){
 #ifdef DEBUG
-  logfile << "OpenJPEG :: openImage() :: " << "Stream created" << endl;
+      logfile << "OpenJPEG :: openImage() :: unable to set number of threads" << endl;
+#endif
+    }
 #endif
 
-  // Read header
-  if( !opj_read_header( _stream, _codec, &_image ) ){
-    throw file_error( "OpenJPEG :: process() :: opj_read_header() failed" );
-  }
+    // Open the JPEG2000 file in read mode
+    if( !(_stream = opj_stream_create_default_file_stream( filename.c_str(), true) ) ){
+      throw file_error( "OpenJPEG :: Unable to open '" + filename + "'" );
+    }
+
+#ifdef DEBUG
+    logfile << "OpenJPEG :: openImage() :: " << "Stream created" << endl;
+#endif
+
+    // Read header
+    if( !opj_read_header( _stream, _codec, &_image ) ){
+      throw file_error( "OpenJPEG :: openImage() :: opj_read_header() failed: " + _error );
+    }
 
 #ifdef DEBUG
-  logfile << "OpenJPEG :: openImage() :: " << "Header read" << endl;
+    logfile << "OpenJPEG :: openImage() :: " << "Header read" << endl;
+#endif
+
+    // Single-tiled codestreams can be decoded repeatedly without re-opening them
+#ifdef OPJ_REPEATED_DECODE
+    opj_codestream_info_v2_t* cst_info = opj_get_cstr_info( _codec );
+    if( cst_info ){
+      _reusable = ( cst_info->tw == 1 && cst_info->th == 1 );
+      opj_destroy_cstr_info( &cst_info );
+    }
 #endif
+  }
 
   // Load our metadata if not already loaded
   if( bpc == 0 ) loadImageInfo( currentX, currentY );
@@ -111,6 +164,20 @@ void OpenJPEGImage::closeImage()
   timer.start();
 #endif
 
+  // Keep reusable codestreams open for subsequent requests if possible
+  if( handles && _reusable && _codec && _stream && _image ){
+    OpenJPEGFile* file = new OpenJPEGFile;
+    file->stream = _stream;
+    file->codec = _codec;
+    file->image = _image;
+    file->layers = _layers;
+    opj_set_error_handler( _codec, error_callback, NULL );
+    handles->release( getFileName( currentX, currentY ), timestamp, file, closeOpenJPEG );
+    _stream = NULL;
+    _codec = NULL;
+    _image = NULL;
+  }
+
   if( _codec && _stream ) opj_end_decompress( _codec, _stream );
   if( _codec ){
     opj_destroy_codec( _codec );
@@ -325,8 +392,8 @@ RawTile OpenJPEGImage::getTile( int seq, int ang, unsigned int res, int layers,
   // Create our Rawtile object and initialize with data
   RawTile rawtile( tile, res, seq, ang, tw, th, channels, obpc );
 
-  if( obpc == 16 ) rawtile.data = new unsigned short[tw*th*channels];
-  else if( obpc == 8 ) rawtile.data = new unsigned char[tw*th*channels];
+  if( obpc == 16 ) rawtile.adopt( new unsigned short[tw*th*channels] );
+  else if( obpc == 8 ) rawtile.adopt( new unsigned char[tw*th*channels] );
   else throw file_error( "OpenJPEG :: Unsupported number of bits" );
 
   rawtile.dataLength = tw*th*channels*(obpc/8);
@@ -360,8 +427,8 @@ RawTile OpenJPEGImage::getRegion( int ha, int va, unsigned int res, int layers,
 
   RawTile rawtile( 0, res, ha, va, w, h, channels, obpc );
 
-  if( obpc == 16 ) rawtile.data = new unsigned short[w * h * channels];
-  else if( obpc == 8 ) rawtile.data = new unsigned char[w * h * channels];
+  if( obpc == 16 ) rawtile.adopt( new unsigned short[w * h * channels] );
+  else if( obpc == 8 ) rawtile.adopt( new unsigned char[w * h * channels] );
   else throw file_error( "OpenJPEG :: Unsupported number of bits" );
 
   rawtile.dataLength = w*h*channels*(obpc/8);
@@ -382,8 +449,7 @@ RawTile OpenJPEGImage::getRegion( int ha, int va, unsigned int res, int layers,
 // Main processing function
 void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoffset, unsigned int tw, unsigned int th, void *d )
 {
-  // Unfortunately, it's not currently possible to re-use OpenJPEG's stream or image structures,
-  // so re-open if necessary
+  // Multi-tiled codestreams cannot be decoded repeatedly, so re-open if necessary
   if( !_image ) openImage();
 
   // Scale up our output bit depth to the nearest factor of 8
@@ -396,7 +462,7 @@ void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoff
 
   // Calculate number of extra resolutions needed that have not been encoded in the image
   if( res < virtual_levels ){
-    factor = 2 * (virtual_levels - res);
+    factor = 1 << (virtual_levels - res);
     xoffset *= factor;
     yoffset *= factor;
     tw *= factor;
@@ -417,27 +483,37 @@ void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoff
   if( layers < 1 ) layers = 1;
 
 
-  // Set number of quality layer and resolution
-  opj_dparameters_t params;
-  params.cp_layer = layers;
-  params.cp_reduce = vipsres;
-
-
-  if( !opj_setup_decoder( _codec, &params ) ){
-    throw file_error( "OpenJPEG :: process() :: opj_setup_decoder() failed" );
+  // Set number of quality layers - only necessary if they have changed since our last decode
+  if( layers != _layers ){
+    opj_dparameters_t params;
+    opj_set_default_decoder_parameters( &params );
+    params.cp_layer = layers;
+    params.cp_reduce = vipsres;
+    if( !opj_setup_decoder( _codec, &params ) ){
+      throw file_error( "OpenJPEG :: process() :: opj_setup_decoder() failed" );
+    }
+    _layers = layers;
   }
 
+  // Set resolution
+  if( !opj_set_decoded_resolution_factor( _codec, vipsres ) ){
+    _reusable = false;
+    throw file_error( "OpenJPEG :: process() :: opj_set_decoded_resolution_factor() failed: " + _error );
+  }
 
   // Set resolution - hack for openjpeg up to 2.2.0
   for( OPJ_UINT32 i = 0; i < _image->numcomps; i++ ){
     _image->comps[i].factor = vipsres;
   }
 
-  // Image location and size at requested resolution
-  unsigned int x0 = xoffset << vipsres;
-  unsigned int y0 = yoffset << vipsres;
-  unsigned int w0 = (xoffset + tw) << vipsres;
-  unsigned int h0 = (yoffset + th) << vipsres;
+  // Decoding area on the full resolution reference grid, which is offset by the image origin.
+  // Clip it to the image, so that no code-blocks beyond the image edge are requested
+  unsigned int x0 = _image->x0 + ( (unsigned int) xoffset << vipsres );
+  unsigned int y0 = _image->y0 + ( (unsigned int) yoffset << vipsres );
+  unsigned int w0 = _image->x0 + ( (unsigned int) (xoffset + tw) << vipsres );
+  unsigned int h0 = _image->y0 + ( (unsigned int) (yoffset + th) << vipsres );
+  if( w0 > _image->x1 ) w0 = _image->x1;
+  if( h0 > _image->y1 ) h0 = _image->y1;
 
 #ifdef DEBUG
   logfile << "OpenJPEG :: decoding " << layers << " quality layers" << endl;
@@ -449,12 +525,14 @@ void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoff
 
   // Define our decoding region
   if( !opj_set_decode_area( _codec, _image, x0, y0, w0, h0 ) ){
-    throw file_error( "OpenJPEG :: process() :: opj_set_decode_area() failed" );
+    _reusable = false;
+    throw file_error( "OpenJPEG :: process() :: opj_set_decode_area() failed: " + _error );
   }
 
   // Perform decoding
   if( !opj_decode( _codec, _stream, _image ) ){
-    throw file_error( "OpenJPEG :: process() :: opj_decode() failed" );
+    _reusable = false;
+    throw file_error( "OpenJPEG :: process() :: opj_decode() failed: " + _error );
   }
 
 
@@ -469,33 +547,65 @@ void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoff
 #endif
 
 
-  // Copy our decoded data by looping over all pixels
-  unsigned int n = 0;
-  unsigned int nk = 0;
+  // Copy our decoded data by looping over all pixels. Use the width of the decoded area as our
+  // row stride, as this can be larger than our requested width at the image edge. For virtual
+  // resolutions, each row is first converted into a temporary row and reduced into our output.
+  // Replicate the last decoded row and column should our request extend beyond the decoded area
+  unsigned int stride = _image->comps[0].w;
+  unsigned int decoded_height = _image->comps[0].h;
+  BoxFilter<unsigned short> *filter16 = NULL;
+  BoxFilter<unsigned char> *filter8 = NULL;
+  void *row = NULL;
+  if( factor > 1 ){
+    if( obpc == 16 ){
+      filter16 = new BoxFilter<unsigned short>( tw, th/factor, channels, factor, (unsigned short*) d );
+      row = new unsigned short[tw*channels];
+    }
+    else{
+      filter8 = new BoxFilter<unsigned char>( tw, th/factor, channels, factor, (unsigned char*) d );
+      row = new unsigned char[tw*channels];
+    }
+  }
 
-  for( unsigned int j=0; j < th; j += factor ){
-    for( unsigned int i = 0; i < tw; i += factor ){
+  for( unsigned int j=0; j < th; j++ ){
+    void *out = row ? row : d;
+    unsigned int nk = row ? 0 : j*tw*channels;
+    unsigned int y = ( j < decoded_height ) ? j : decoded_height - 1;
+    for( unsigned int i = 0; i < tw; i++ ){
+      unsigned int n = y*stride + ( ( i < stride ) ? i : stride - 1 );
       for( unsigned int k = 0; k < channels; k++ ){
         // Handle 16 and 8 bit data:
 	// OpenJPEG's output data is 32 bit unsigned int, so just mask of the bottom 2 bytes
 	// for 16 bit output or bottom 1 byte for 8 bit
 	if( obpc == 16 ){
-	  ((unsigned short*)d)[nk++] =(  (_image->comps[k].data[n]) & 0x0000ffff );
+	  ((unsigned short*)out)[nk++] =(  (_image->comps[k].data[n]) & 0x0000ffff );
 	}
 	// Binary (bi-level) images need to be scaled up to 8 bits
 	else if( bpc == 1 ){
-	  ((unsigned char*)d)[nk++] = ((_image->comps[k].data[n]) & 0x000000f) * 255;
+	  ((unsigned char*)out)[nk++] = ((_image->comps[k].data[n]) & 0x000000f) * 255;
 	}
 	else{
-	  ((unsigned char*)d)[nk++] = (_image->comps[k].data[n]) & 0x000000ff;
+	  ((unsigned char*)out)[nk++] = (_image->comps[k].data[n]) & 0x000000ff;
 	}
       }
-      n++;
     }
+    if( filter16 ) filter16->addRow( (unsigned short*) row );
+    else if( filter8 ) filter8->addRow( (unsigned char*) row );
+  }
+
+  if( filter16 ){
+    filter16->finish();
+    delete filter16;
+    delete[] (unsigned short*) row;
+  }
+  else if( filter8 ){
+    filter8->finish();
+    delete filter8;
+    delete[] (unsigned char*) row;
   }
 
-  // We need to close the image here in case we try to use the OpenJPEG
-  // stream or image structures multiple times in the same request pipeline
-  closeImage();
+  // Multi-tiled codestreams cannot be decoded again, so we need to close the image here in case
+  // we try to use the OpenJPEG stream or image structures multiple times in the same request pipeline
+  if( !_reusable ) closeImage();
 
 }
@@ -26,8 +26,27 @@
 
 #define TILESIZE 256
 
+// Multi-threaded decoding is available from OpenJPEG 2.2 and repeated decoding of
+// the same single-tiled codestream from OpenJPEG 2.3
+#if defined(OPJ_VERSION_MAJOR) && (OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 2))
+#define OPJ_THREADS
+#endif
+#if defined(OPJ_VERSION_MAJOR) && (OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 3))
+#define OPJ_REPEATED_DECODE
+#endif
+
 extern std::ofstream logfile;
 
+/// Open OpenJPEG codestream, which may be kept open in our handle pool between requests
+struct OpenJPEGFile {
+  opj_stream_t* stream;   ///< file stream
+  opj_codec_t* codec;     ///< codec
+  opj_image_t* image;     ///< image
+  int layers;             ///< number of quality layers the decoder is set up for
+};
+
+
+
 /// Image class for JPEG 2000 Images:
 /// Inherits from IIPImage. Uses the OpenJPEG library.
 class OpenJPEGImage : public IIPImage {
@@ -37,6 +56,9 @@ class OpenJPEGImage : public IIPImage {
   opj_stream_t* _stream;  /// file stream
   opj_codec_t*  _codec;   /// codec
   opj_image_t*  _image;   /// image
+  int _layers;            /// number of quality layers our decoder is set up for
+  bool _reusable;         /// whether our codestream can be decoded repeatedly and kept in the handle pool
+  std::string _error;     /// last error message from OpenJPEG
 
 
   /// Main processing function
@@ -56,7 +78,7 @@ class OpenJPEGImage : public IIPImage {
 
   /// Constructor
   OpenJPEGImage() : IIPImage(){
-    _stream = NULL; _codec = NULL; _image = NULL;
+    _stream = NULL; _codec = NULL; _image = NULL; _layers = -1; _reusable = false; opj_threads = 0;
     tile_width = TILESIZE; tile_height = TILESIZE; virtual_levels = 0;
   };
 
@@ -65,7 +87,7 @@ class OpenJPEGImage : public IIPImage {
   /** @param path image path
    */
   OpenJPEGImage( const std::string& path)  : IIPImage(path){
-    _stream = NULL; _codec = NULL; _image = NULL;
+    _stream = NULL; _codec = NULL; _image = NULL; _layers = -1; _reusable = false; opj_threads = 0;
     tile_width = TILESIZE; tile_height = TILESIZE; virtual_levels = 0;
   };
 
@@ -73,14 +95,16 @@ class OpenJPEGImage : public IIPImage {
   /// Copy Constructor
   /** @param image OpenJPEG object
    */
-  OpenJPEGImage( const OpenJPEGImage& image ): IIPImage( image ) {};
+  OpenJPEGImage( const OpenJPEGImage& image ): IIPImage( image ){
+    _stream = NULL; _codec = NULL; _image = NULL; _layers = -1; _reusable = false; opj_threads = image.opj_threads;
+  };
 
 
   /// Copy Constructor
   /** @param image IIPImage object
    */
   OpenJPEGImage( const IIPImage& image ) : IIPImage(image){
-    _stream = NULL; _codec = NULL; _image = NULL;
+    _stream = NULL; _codec = NULL; _image = NULL; _layers = -1; _reusable = false; opj_threads = 0;
     tile_width = TILESIZE; tile_height = TILESIZE; virtual_levels = 0;
   };
 
@@ -132,6 +156,10 @@ class OpenJPEGImage : public IIPImage {
   */
   RawTile getRegion( int ha, int va, unsigned int res, int layers, int x, int y, unsigned int w, unsigned int h );
 
+
+  /// Number of decoding threads or 0 or 1 for single threaded decoding
+  unsigned int opj_threads;
+
 };
 
 #endif
@@ -27,6 +27,7 @@
 #include <string>
 #include <cstdlib>
 #include <ctime>
+#include <memory>
 
 
 
@@ -71,13 +72,10 @@ class RawTile{
   time_t timestamp;
 
   /// Pointer to the image data
+  /** This either points into our reference counted buffer or, if the buffer is
+      empty, to memory owned elsewhere such as a decoder's internal tile buffer */
   void *data;
 
-  /// This tracks whether we have allocated memory locally for data
-  /// or whether it is simply a pointer
-  /** This is used in the destructor to make sure we deallocate correctly */
-  int memoryManaged;
-
   /// The size of the data pointed to by data
   unsigned int dataLength;
 
@@ -100,6 +98,18 @@ class RawTile{
   bool padded;
 
 
+ private:
+
+  /// Reference counted owner of our data buffer
+  /** Copies of a tile share the same immutable buffer, which is only freed once the
+      last reference to it is released. Tiles must therefore call unshare() before
+      modifying their data in place. Empty if data is not owned by this tile */
+  std::shared_ptr<void> buffer;
+
+
+ public:
+
+
   /// Main constructor
   /** @param tn tile number
       @param res resolution
@@ -114,32 +124,43 @@ class RawTile{
 	   int w = 0, int h = 0, int c = 0, int b = 0 ) {
     width = w; height = h; bpc = b; dataLength = 0; data = NULL;
     tileNum = tn; resolution = res; hSequence = hs ; vSequence = vs;
-    memoryManaged = 1; channels = c; compressionType = UNCOMPRESSED; quality = 0;
+    channels = c; compressionType = UNCOMPRESSED; quality = 0;
     timestamp = 0; sampleType = FIXEDPOINT; padded = false;
   };
 
 
-  /// Destructor to free the data array if is has previously be allocated locally
-  ~RawTile() {
-    if( data && memoryManaged ){
-      switch( bpc ){
-      case 32:
-        if( sampleType == FLOATINGPOINT ) delete[] (float*) data;
-        else delete[] (unsigned int*) data;
-        break;
-      case 16:
-	delete[] (unsigned short*) data;
-        break;
-      default:
-	delete[] (unsigned char*) data;
-        break;
-      }
+  /// Copy constructor - shares the data buffer of the source tile
+  /** Data not owned by the source tile is copied, as it may be overwritten by its owner */
+  RawTile( const RawTile& tile ) {
+    tileNum = tile.tileNum;
+    resolution = tile.resolution;
+    hSequence = tile.hSequence;
+    vSequence = tile.vSequence;
+    compressionType = tile.compressionType;
+    quality = tile.quality;
+    filename = tile.filename;
+    timestamp = tile.timestamp;
+    dataLength = tile.dataLength;
+    width = tile.width;
+    height = tile.height;
+    channels = tile.channels;
+    bpc = tile.bpc;
+    sampleType = tile.sampleType;
+    padded = tile.padded;
+
+    buffer = tile.buffer;
+    data = tile.data;
+    if( data && !buffer ){
+      allocate( dataLength );
+      memcpy( data, tile.data, dataLength );
     }
   }
 
 
-  /// Copy constructor - handles copying of data buffer
-  RawTile( const RawTile& tile ) {
+  /// Copy assignment operator - shares the data buffer of the source tile
+  RawTile& operator= ( const RawTile& tile ) {
+
+    if( this == &tile ) return *this;
 
     tileNum = tile.tileNum;
     resolution = tile.resolution;
@@ -149,7 +170,6 @@ class RawTile{
     quality = tile.quality;
     filename = tile.filename;
     timestamp = tile.timestamp;
-    memoryManaged = tile.memoryManaged;
     dataLength = tile.dataLength;
     width = tile.width;
     height = tile.height;
@@ -158,28 +178,28 @@ class RawTile{
     sampleType = tile.sampleType;
     padded = tile.padded;
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new unsigned int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
-
-    if( data && (dataLength > 0) && tile.data ){
+    buffer = tile.buffer;
+    data = tile.data;
+    if( data && !buffer ){
+      allocate( dataLength );
       memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
     }
+
+    return *this;
   }
 
 
-  /// Copy assignment constructor
-  RawTile& operator= ( const RawTile& tile ) {
+  /// Move constructor - takes over the data buffer of the source tile
+  RawTile( RawTile&& tile ) : RawTile() {
+    *this = std::move( tile );
+  }
+
+
+  /// Move assignment operator - takes over the data buffer of the source tile, leaving it empty
+  /** Data not owned by the source tile is copied, as for copy assignment */
+  RawTile& operator= ( RawTile&& tile ) {
+
+    if( this == &tile ) return *this;
 
     tileNum = tile.tileNum;
     resolution = tile.resolution;
@@ -187,9 +207,8 @@ class RawTile{
     vSequence = tile.vSequence;
     compressionType = tile.compressionType;
     quality = tile.quality;
-    filename = tile.filename;
+    filename = std::move( tile.filename );
     timestamp = tile.timestamp;
-    memoryManaged = tile.memoryManaged;
     dataLength = tile.dataLength;
     width = tile.width;
     height = tile.height;
@@ -198,25 +217,70 @@ class RawTile{
     sampleType = tile.sampleType;
     padded = tile.padded;
 
+    buffer = std::move( tile.buffer );
+    data = tile.data;
+    if( data && !buffer ){
+      allocate( dataLength );
+      memcpy( data, tile.data, dataLength );
+    }
+
+    tile.data = NULL;
+    tile.dataLength = 0;
+
+    return *this;
+  }
+
+
+  /// Take ownership of an array allocated with new[], releasing our reference to any previous buffer
+  /** @param d newly allocated data array */
+  template <typename T> void adopt( T* d ){
+    buffer.reset( d, std::default_delete<T[]>() );
+    data = d;
+  }
+
+
+  /// Share an existing reference counted buffer, releasing our reference to any previous buffer
+  /** @param b reference counted data buffer */
+  void adopt( const std::shared_ptr<void>& b ){
+    buffer = b;
+    data = b.get();
+  }
+
+
+  /// Allocate a new data buffer of the type given by our bits per channel and sample type
+  /** Our reference to any previous buffer is released
+      @param length size of buffer in bytes
+      @return pointer to the new buffer
+   */
+  void* allocate( unsigned int length ){
     switch( bpc ){
       case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new int[dataLength/4];
+	if( sampleType == FLOATINGPOINT ) adopt( new float[length/4] );
+	else adopt( new unsigned int[length/4] );
 	break;
       case 16:
-	data = new unsigned short[dataLength/2];
+	adopt( new unsigned short[length/2] );
 	break;
       default:
-	data = new unsigned char[dataLength];
+	adopt( new unsigned char[length] );
 	break;
     }
+    return data;
+  }
 
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
-    }
 
-    return *this;
+  /// Check whether our data is shared with other tiles or owned elsewhere and must not be modified
+  bool shared() const { return data && ( !buffer || buffer.use_count() > 1 ); }
+
+
+  /// Copy-on-write: make a private copy of our data if shared, so that it can be modified in place
+  void unshare(){
+    if( !shared() ) return;
+    // Hold on to the shared buffer until we have copied its contents
+    std::shared_ptr<void> source = buffer;
+    void* d = data;
+    allocate( dataLength );
+    memcpy( data, d, dataLength );
   }
 
 
@@ -0,0 +1,219 @@
+/*
+    IIPImage Server - RawTile Buffer Ownership Test
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/* Checks that tile data buffers are only allocated and copied where expected as tiles
+   pass through the tile pipeline: copies and moves of a RawTile, adopting a buffer and
+   inserting into and retrieving from the tile cache must all share the same buffer, while
+   unshare() and tiles pointing to memory owned elsewhere must make a single copy.
+
+   Tile data is always allocated with new[], so we count calls to operator new[].
+
+   Built and run with "make check"
+*/
+
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <new>
+
+#include "Cache.h"
+
+
+using namespace std;
+
+
+// Size in bytes of our test tiles
+#define TEST_TILE_SIZE 65536
+
+
+
+/// Number of array allocations made since the last reset
+static unsigned long allocations = 0;
+
+/// Number of bytes allocated by these
+static unsigned long allocated = 0;
+
+/// Number of failed checks
+static unsigned int failures = 0;
+
+
+
+// Count array allocations. Our replacement operators use malloc and free, which newer
+// versions of gcc mistake for mismatched allocation and deallocation functions
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new[]( size_t size ){
+  allocations++;
+  allocated += size;
+  void* p = malloc( size ? size : 1 );
+  if( !p ) throw bad_alloc();
+  return p;
+}
+
+void operator delete[]( void* p ) noexcept { free( p ); }
+
+void operator delete[]( void* p, size_t ) noexcept { free( p ); }
+
+
+
+/// Reset our allocation counters
+static void reset(){
+  allocations = 0;
+  allocated = 0;
+}
+
+
+/// Report the result of a check
+/** @param name description of check
+    @param ok whether the check passed */
+static void check( const string& name, bool ok ){
+  cout << ( ok ? "ok   " : "FAIL " ) << name << endl;
+  if( !ok ) failures++;
+}
+
+
+/// Check that no tile buffer has been allocated since the last reset
+static void none( const string& name, bool ok ){
+  check( name, ok && allocated < TEST_TILE_SIZE );
+}
+
+
+/// Check that exactly one tile buffer has been allocated since the last reset
+static void one( const string& name, bool ok ){
+  check( name, ok && allocations == 1 && allocated == TEST_TILE_SIZE );
+}
+
+
+/// Create a test tile owning a new buffer
+static RawTile make( int n ){
+  RawTile tile( n, 0, 0, 90, 128, 128, 4, 8 );
+  tile.filename = "test.tif";
+  tile.timestamp = 1;
+  tile.dataLength = TEST_TILE_SIZE;
+  tile.allocate( tile.dataLength );
+  return tile;
+}
+
+
+
+int main(){
+
+  // Allocation of a new buffer by bpc
+  reset();
+  RawTile a = make( 0 );
+  one( "allocate() makes a single allocation", a.data != NULL );
+
+  RawTile f( 0, 0, 0, 90, 64, 64, 1, 32 );
+  f.sampleType = FLOATINGPOINT;
+  reset();
+  f.allocate( TEST_TILE_SIZE );
+  one( "allocate() of floating point data", f.data != NULL );
+
+  // Copies share our buffer
+  reset();
+  RawTile b( a );
+  none( "copy constructor shares buffer", b.data == a.data && a.shared() && b.shared() );
+
+  RawTile c;
+  reset();
+  c = a;
+  none( "copy assignment shares buffer", c.data == a.data );
+
+  // Moves take over our buffer, leaving the source empty
+  void* d = a.data;
+  reset();
+  RawTile m( std::move( a ) );
+  none( "move constructor takes over buffer", m.data == d && a.data == NULL && a.dataLength == 0 );
+
+  RawTile n;
+  reset();
+  n = std::move( m );
+  none( "move assignment takes over buffer", n.data == d && m.data == NULL );
+
+  reset();
+  vector<RawTile> tiles;
+  tiles.reserve( 4 );
+  tiles.push_back( std::move( n ) );
+  none( "move into container", tiles[0].data == d );
+
+  // Adopting a buffer takes ownership without copying
+  unsigned char* raw = new unsigned char[TEST_TILE_SIZE];
+  RawTile e( 1, 0, 0, 90, 128, 128, 4, 8 );
+  e.dataLength = TEST_TILE_SIZE;
+  reset();
+  e.adopt( raw );
+  none( "adopt() of array takes ownership", e.data == raw && !e.shared() );
+
+  std::shared_ptr<void> buffer( new unsigned char[TEST_TILE_SIZE], std::default_delete<unsigned char[]>() );
+  RawTile g( 1, 0, 0, 90, 128, 128, 4, 8 );
+  g.dataLength = TEST_TILE_SIZE;
+  reset();
+  g.adopt( buffer );
+  none( "adopt() of reference counted buffer shares it", g.data == buffer.get() && g.shared() );
+
+  // Copy-on-write only copies shared data
+  reset();
+  e.unshare();
+  none( "unshare() of private buffer", e.data == raw );
+
+  reset();
+  b.unshare();
+  one( "unshare() of shared buffer copies once", b.data != d && c.data == d );
+
+  // Data owned elsewhere, such as by a decoder, is copied once
+  static unsigned char external[TEST_TILE_SIZE];
+  RawTile x( 2, 0, 0, 90, 128, 128, 4, 8 );
+  x.dataLength = TEST_TILE_SIZE;
+  x.data = external;
+  reset();
+  RawTile y( x );
+  one( "copy of externally owned data", y.data != external && !y.shared() );
+
+  // Round trip through our tile cache without a codec
+  Cache cache( 10.0 );
+  const CacheImage* image = cache.getImage( "test.tif" );
+  TileKey key = TileKey::make( image, 0, 3, 0, 90, UNCOMPRESSED, 0 );
+  RawTile t = make( 3 );
+  d = t.data;
+  reset();
+  cache.insert( image, t );
+  none( "cache insert shares buffer", cache.getNumElements() == 1 );
+
+  RawTile r;
+  reset();
+  bool found = cache.getTile( key, r );
+  none( "cache hit shares buffer", found && r.data == d && r.shared() );
+
+  // Modifying a tile retrieved from the cache copies it, leaving the cached tile intact
+  reset();
+  r.unshare();
+  ((unsigned char*) r.data)[0] = 1;
+  RawTile s;
+  found = cache.getTile( key, s );
+  one( "unshare() of cached tile copies once", found && r.data != d && s.data == d );
+  cache.releaseImage( image );
+
+  cout << ( failures ? "FAILED" : "All tests passed" ) << endl;
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+/*
+    IIPImage Server - Banded Resampling Test
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/* Checks that resizing a region a band at a time, as CVT does when streaming large
+   regions, gives byte-identical output to resizing the whole region at once. Bands are
+   aligned with rows of tiles as in CVT, including regions which do not start at a tile
+   boundary, for both nearest neighbour and bilinear interpolation and for both up and
+   down scaling. Bands of a single row exercise the carrying over of the last row of the
+   previous band, and large reductions give bands which complete no output rows.
+
+   Built and run with "make check"
+*/
+
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+#include "Transforms.h"
+
+
+using namespace std;
+
+
+// Number of channels in our test images
+#define TEST_CHANNELS 3
+
+
+
+/// Number of failed checks
+static unsigned int failures = 0;
+
+
+
+/// Report the result of a check
+/** @param name description of check
+    @param ok whether the check passed */
+static void check( const string& name, bool ok ){
+  cout << ( ok ? "ok   " : "FAIL " ) << name << endl;
+  if( !ok ) failures++;
+}
+
+
+/// Create a test image filled with pseudo-random data
+static RawTile make( unsigned int width, unsigned int height ){
+  RawTile image( 0, 0, 0, 90, width, height, TEST_CHANNELS, 8 );
+  image.dataLength = width * height * TEST_CHANNELS;
+  image.allocate( image.dataLength );
+  uint32_t state = 2463534242U;
+  unsigned char* data = (unsigned char*) image.data;
+  for( unsigned int i=0; i<image.dataLength; i++ ){
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    data[i] = state >> 24;
+  }
+  return image;
+}
+
+
+/// Resize a region of an image band by band as CVT does, with bands aligned with rows of tiles
+/** @param image whole image
+    @param top first image row of our region
+    @param height number of rows in our region
+    @param tile tile height
+    @param w target width
+    @param h target height
+    @param interpolation 0 for nearest neighbour, otherwise bilinear
+    @return resized region
+ */
+static vector<unsigned char> banded( const RawTile& image, unsigned int top, unsigned int height, unsigned int tile,
+				     unsigned int w, unsigned int h, int interpolation ){
+  Transform transform;
+  vector<unsigned char> output;
+  vector<unsigned char> carry;
+  unsigned int next = 0;
+  unsigned int row = image.width * image.channels;
+
+  for( unsigned int b0=0, b1; b0<height; b0=b1 ){
+    b1 = ( (top+b0)/tile + 1 ) * tile - top;
+    if( b1 > height ) b1 = height;
+
+    RawTile band( 0, 0, 0, 90, image.width, b1-b0, image.channels, 8 );
+    band.dataLength = row * (b1-b0);
+    band.allocate( band.dataLength );
+    memcpy( band.data, (const unsigned char*) image.data + (top+b0)*row, band.dataLength );
+
+    transform.resample_band( band, b0, height, w, h, interpolation, next, carry );
+    const unsigned char* data = (const unsigned char*) band.data;
+    output.insert( output.end(), data, data + band.dataLength );
+  }
+  return output;
+}
+
+
+/// Resize a region of an image in a single pass
+/** Parameters are as for banded() */
+static vector<unsigned char> whole( const RawTile& image, unsigned int top, unsigned int height,
+				    unsigned int w, unsigned int h, int interpolation ){
+  Transform transform;
+  unsigned int row = image.width * image.channels;
+  RawTile region( 0, 0, 0, 90, image.width, height, image.channels, 8 );
+  region.dataLength = row * height;
+  region.allocate( region.dataLength );
+  memcpy( region.data, (const unsigned char*) image.data + top*row, region.dataLength );
+
+  if( interpolation == 0 ) transform.interpolate_nearestneighbour( region, w, h );
+  else transform.interpolate_bilinear( region, w, h );
+
+  const unsigned char* data = (const unsigned char*) region.data;
+  return vector<unsigned char>( data, data + region.dataLength );
+}
+
+
+
+int main(){
+
+  // Region sizes and targets: downscaling, upscaling and mixed
+  const unsigned int sizes[][4] = {
+    { 517, 400, 171, 97 },    // Downscaling
+    { 517, 400, 13, 5 },      // Large reduction, giving bands without output rows
+    { 97, 61, 389, 250 },     // Upscaling
+    { 256, 300, 128, 601 }    // Horizontal reduction and vertical enlargement
+  };
+  const unsigned int tiles[] = { 1, 7, 64, 256 };
+  const unsigned int offsets[] = { 0, 37 };
+  const char* names[] = { "nearest neighbour", "bilinear" };
+
+  for( unsigned int s=0; s<4; s++ ){
+    unsigned int width = sizes[s][0], height = sizes[s][1];
+    unsigned int w = sizes[s][2], h = sizes[s][3];
+    RawTile image = make( width, height + offsets[1] );
+
+    for( int interpolation=0; interpolation<2; interpolation++ ){
+      for( unsigned int o=0; o<2; o++ ){
+	vector<unsigned char> expected = whole( image, offsets[o], height, w, h, interpolation );
+	for( unsigned int t=0; t<4; t++ ){
+	  vector<unsigned char> output = banded( image, offsets[o], height, tiles[t], w, h, interpolation );
+	  ostringstream name;
+	  name << names[interpolation] << " " << width << "x" << height << " to " << w << "x" << h
+	       << " from row " << offsets[o] << " in bands of " << tiles[t] << " row(s)";
+	  check( name.str(), output.size() == (unsigned long) w*h*TEST_CHANNELS && output == expected );
+	}
+      }
+    }
+  }
+
+  cout << ( failures ? "FAILED" : "All tests passed" ) << endl;
+  return failures ? 1 : 0;
+}
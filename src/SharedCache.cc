@@ -0,0 +1,548 @@
+/*
+    IIPImage Server - Shared Memory Tile Cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifdef HAVE_SHM_OPEN
+
+#include "SharedCache.h"
+
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+using namespace std;
+
+
+// Identifiers for our segment layout
+#define SHAREDCACHE_MAGIC 0x49495043  // "IIPC"
+#define SHAREDCACHE_VERSION 2
+
+// Number of hash buckets to allocate per page
+#define BUCKETS_PER_PAGE 64
+
+// Slots per page for our smallest slab class
+#define SLOTS_PER_PAGE (SharedCache::PAGE_SIZE/SharedCache::MIN_SLOT_SIZE)
+
+// Number of evictions within a slab class after which it may reclaim a page from another class
+#define RECLAIM_INTERVAL 64
+
+
+// Round up to a multiple of a power of two
+static size_t align( size_t n, size_t a ){ return (n + a - 1) & ~(a - 1); }
+
+
+
+SharedCache::SharedCache( const string& n, float max ) :
+  name( n ), base( NULL ), size( 0 ), header( NULL ), buckets( NULL ), pages( NULL ), slots( NULL ), data( NULL )
+{
+  size_t requested = (size_t)( max * 1024000 );
+  if( requested < 4*PAGE_SIZE ){
+    throw string( "SharedCache :: Shared memory segment must be at least 4 pages in size" );
+  }
+
+  // Try to create the segment. If it already exists, attach to it instead
+  bool created = true;
+  int fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+  if( fd < 0 && errno == EEXIST ){
+    created = false;
+    fd = shm_open( name.c_str(), O_RDWR, 0600 );
+  }
+  if( fd < 0 ){
+    throw string( "SharedCache :: Unable to open shared memory segment '" + name + "': " + strerror(errno) );
+  }
+
+  if( created ){
+    if( ftruncate( fd, requested ) != 0 ){
+      string error = strerror( errno );
+      close( fd );
+      shm_unlink( name.c_str() );
+      throw string( "SharedCache :: Unable to size shared memory segment '" + name + "': " + error );
+    }
+    size = requested;
+  }
+  else{
+    // Wait for the creating process to size the segment
+    struct stat sb;
+    sb.st_size = 0;
+    for( int i=0; i<100; i++ ){
+      if( fstat( fd, &sb ) == 0 && sb.st_size > 0 ) break;
+      usleep( 10000 );
+    }
+    if( sb.st_size < (off_t) sizeof(Header) ){
+      close( fd );
+      throw string( "SharedCache :: Shared memory segment '" + name + "' has not been initialized" );
+    }
+    size = sb.st_size;
+  }
+
+  void* m = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( m == MAP_FAILED ){
+    if( created ) shm_unlink( name.c_str() );
+    throw string( "SharedCache :: Unable to map shared memory segment '" + name + "': " + strerror(errno) );
+  }
+
+  base = (unsigned char*) m;
+  header = (Header*) base;
+
+
+  if( created ){
+
+    // Work out how many pages we can fit after our header, index and slot descriptors
+    size_t header_size = align( sizeof(Header), 64 );
+    size_t per_page = PAGE_SIZE + sizeof(Page) + SLOTS_PER_PAGE*sizeof(Slot) + BUCKETS_PER_PAGE*sizeof(int32_t);
+    uint32_t num_pages = (size - header_size - PAGE_SIZE) / per_page;
+
+    uint32_t num_buckets = 1;
+    while( num_buckets < num_pages*BUCKETS_PER_PAGE ) num_buckets <<= 1;
+
+    header->size = size;
+    header->num_pages = num_pages;
+    header->num_buckets = num_buckets;
+    header->buckets_offset = header_size;
+    header->pages_offset = align( header->buckets_offset + num_buckets*sizeof(int32_t), 64 );
+    header->slots_offset = align( header->pages_offset + num_pages*sizeof(Page), 64 );
+    header->data_offset = align( header->slots_offset + (size_t)num_pages*SLOTS_PER_PAGE*sizeof(Slot), 4096 );
+
+    // Our bucket array was sized generously, so make sure we still fit
+    while( header->num_pages > 0 && header->data_offset + (size_t)header->num_pages*PAGE_SIZE > size ){
+      header->num_pages--;
+    }
+
+    // Set up our robust process-shared mutex
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+    pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+    pthread_mutex_init( &header->mutex, &attr );
+    pthread_mutexattr_destroy( &attr );
+
+    buckets = (int32_t*)( base + header->buckets_offset );
+    pages = (Page*)( base + header->pages_offset );
+    slots = (Slot*)( base + header->slots_offset );
+    data = base + header->data_offset;
+    this->reset();
+
+    // Only mark ourselves as ready once everything else is visible to other processes
+    header->version = SHAREDCACHE_VERSION;
+    __sync_synchronize();
+    header->magic = SHAREDCACHE_MAGIC;
+  }
+  else{
+
+    // Wait for the creating process to finish initializing
+    for( int i=0; i<100 && header->magic != SHAREDCACHE_MAGIC; i++ ) usleep( 10000 );
+    __sync_synchronize();
+
+    if( header->magic != SHAREDCACHE_MAGIC || header->version != SHAREDCACHE_VERSION || header->size != size ){
+      munmap( base, size );
+      base = NULL;
+      throw string( "SharedCache :: Shared memory segment '" + name + "' is incompatible or not initialized. "
+		    "Remove it (for example from /dev/shm) and restart" );
+    }
+
+    buckets = (int32_t*)( base + header->buckets_offset );
+    pages = (Page*)( base + header->pages_offset );
+    slots = (Slot*)( base + header->slots_offset );
+    data = base + header->data_offset;
+  }
+
+}
+
+
+
+SharedCache::~SharedCache()
+{
+  if( base ) munmap( base, size );
+}
+
+
+
+void SharedCache::lock()
+{
+  int rc = pthread_mutex_lock( &header->mutex );
+  if( rc == EOWNERDEAD ){
+    // Previous owner died while holding the lock, so our index may be
+    // inconsistent: mark the mutex usable again and start afresh
+    pthread_mutex_consistent( &header->mutex );
+    this->reset();
+  }
+}
+
+
+
+void SharedCache::unlock()
+{
+  pthread_mutex_unlock( &header->mutex );
+}
+
+
+
+void SharedCache::reset()
+{
+  for( uint32_t i=0; i<header->num_buckets; i++ ) buckets[i] = -1;
+  for( uint32_t i=0; i<header->num_pages; i++ ){
+    pages[i].slab_class = -1;
+    pages[i].next = -1;
+  }
+  for( unsigned int c=0; c<NUM_CLASSES; c++ ){
+    SlabClass& cls = header->classes[c];
+    cls.slot_size = MIN_SLOT_SIZE << c;
+    cls.pages = -1;
+    cls.free_slots = -1;
+    cls.clock_page = -1;
+    cls.clock_slot = 0;
+    cls.num_pages = 0;
+    cls.evictions = 0;
+  }
+  header->next_free_page = 0;
+  header->num_elements = 0;
+  header->data_size = 0;
+}
+
+
+
+int SharedCache::slabClass( size_t length )
+{
+  for( unsigned int c=0; c<NUM_CLASSES; c++ ){
+    if( length <= (size_t)(MIN_SLOT_SIZE << c) ) return c;
+  }
+  return -1;
+}
+
+
+
+int32_t SharedCache::find( const TileKey& key, uint64_t h )
+{
+  const string& filename = key.image->filename;
+  int32_t s = buckets[ h & (header->num_buckets-1) ];
+  while( s >= 0 ){
+    const Slot& slot = slots[s];
+    if( slot.hash == h && slot.resolution == key.resolution && slot.tileNum == key.tile &&
+	slot.hSequence == key.hSequence && slot.vSequence == key.vSequence &&
+	slot.compression == key.compression && slot.quality == key.quality &&
+	slot.key_length == filename.length() &&
+	memcmp( slotData(s), filename.data(), filename.length() ) == 0 ) return s;
+    s = slot.next;
+  }
+  return -1;
+}
+
+
+
+void SharedCache::remove( int32_t s )
+{
+  Slot& slot = slots[s];
+
+  // Unlink from our hash chain
+  int32_t* link = &buckets[ slot.hash & (header->num_buckets-1) ];
+  while( *link >= 0 && *link != s ) link = &slots[*link].next;
+  if( *link == s ) *link = slot.next;
+
+  header->num_elements--;
+  header->data_size -= slot.key_length + slot.data_length;
+  slot.in_use = 0;
+
+  // Return to our free list
+  SlabClass& cls = header->classes[ pages[s/SLOTS_PER_PAGE].slab_class ];
+  slot.next = cls.free_slots;
+  cls.free_slots = s;
+}
+
+
+
+void SharedCache::assignPage( int c, int32_t p )
+{
+  SlabClass& cls = header->classes[c];
+  uint32_t n = PAGE_SIZE / cls.slot_size;
+
+  pages[p].slab_class = c;
+  pages[p].next = cls.pages;
+  cls.pages = p;
+  cls.num_pages++;
+  if( cls.clock_page < 0 ){
+    cls.clock_page = p;
+    cls.clock_slot = 0;
+  }
+
+  // Place all slots on our free list
+  for( uint32_t i=n; i-- > 0; ){
+    int32_t s = p*SLOTS_PER_PAGE + i;
+    slots[s].in_use = 0;
+    slots[s].next = cls.free_slots;
+    cls.free_slots = s;
+  }
+}
+
+
+
+int32_t SharedCache::reclaimPage( int c )
+{
+  // Find the class with the most pages, leaving each class at least one page
+  int v = -1;
+  uint32_t max = 1;
+  for( unsigned int i=0; i<NUM_CLASSES; i++ ){
+    if( (int)i != c && header->classes[i].num_pages > max ){
+      max = header->classes[i].num_pages;
+      v = i;
+    }
+  }
+  if( v < 0 ) return -1;
+
+  SlabClass& victim = header->classes[v];
+
+  // Take the page under the CLOCK hand and move the hand on to the next page
+  int32_t p = victim.clock_page;
+  victim.clock_page = (pages[p].next >= 0) ? pages[p].next : victim.pages;
+  victim.clock_slot = 0;
+
+  // Unlink from the page list of this class
+  int32_t* link = &victim.pages;
+  while( *link != p ) link = &pages[*link].next;
+  *link = pages[p].next;
+  if( victim.clock_page == p ) victim.clock_page = victim.pages;
+  victim.num_pages--;
+
+  // Evict all its tiles
+  uint32_t n = PAGE_SIZE / victim.slot_size;
+  for( uint32_t i=0; i<n; i++ ){
+    int32_t s = p*SLOTS_PER_PAGE + i;
+    if( slots[s].in_use ) this->remove( s );
+  }
+
+  // And remove its slots from the free list
+  link = &victim.free_slots;
+  while( *link >= 0 ){
+    if( (uint32_t)(*link) / SLOTS_PER_PAGE == (uint32_t) p ) *link = slots[*link].next;
+    else link = &slots[*link].next;
+  }
+
+  pages[p].slab_class = -1;
+  pages[p].next = -1;
+  return p;
+}
+
+
+
+int32_t SharedCache::allocate( int c )
+{
+  SlabClass& cls = header->classes[c];
+  uint32_t n = PAGE_SIZE / cls.slot_size;
+  int32_t s, p = -1;
+
+  // Assign a new page to this slab class if our free list is empty. Use an unassigned
+  // page if any remain. Otherwise, if we have no pages at all or are regularly evicting,
+  // try to reclaim a page from the largest class
+  if( cls.free_slots < 0 ){
+    if( header->next_free_page < header->num_pages ) p = header->next_free_page++;
+    else if( cls.num_pages == 0 || cls.evictions >= RECLAIM_INTERVAL ){
+      cls.evictions = 0;
+      p = this->reclaimPage( c );
+    }
+    if( p >= 0 ) this->assignPage( c, p );
+  }
+
+  // Use a free slot if we have one
+  if( cls.free_slots >= 0 ){
+    s = cls.free_slots;
+    cls.free_slots = slots[s].next;
+    return s;
+  }
+
+  // Otherwise evict using our CLOCK hand. Give each slot a second chance
+  // if it has been referenced since the hand last passed
+  if( cls.clock_page < 0 ) return -1;
+
+  for( size_t k=0; k<2*(size_t)cls.num_pages*n + 1; k++ ){
+
+    s = cls.clock_page*SLOTS_PER_PAGE + cls.clock_slot;
+
+    // Advance our hand
+    if( ++cls.clock_slot == n ){
+      cls.clock_slot = 0;
+      cls.clock_page = pages[cls.clock_page].next;
+      if( cls.clock_page < 0 ) cls.clock_page = cls.pages;
+    }
+
+    Slot& slot = slots[s];
+    if( !slot.in_use ) continue;
+    if( slot.referenced ){
+      slot.referenced = 0;
+      continue;
+    }
+
+    // Evict and take back off the free list
+    this->remove( s );
+    cls.free_slots = slot.next;
+    cls.evictions++;
+    return s;
+  }
+
+  return -1;
+}
+
+
+
+bool SharedCache::insert( const TileKey& key, const RawTile& r )
+{
+  if( !r.data || r.dataLength == 0 ) return false;
+
+  const string& filename = key.image->filename;
+  size_t length = filename.length() + r.dataLength;
+  int c = slabClass( length );
+  if( c < 0 ) return false;
+
+  uint64_t h = key.hash();
+
+  this->lock();
+
+  // If this tile already exists and is up to date, do nothing
+  int32_t s = this->find( key, h );
+  if( s >= 0 ){
+    if( slots[s].timestamp >= (int64_t) r.timestamp ){
+      this->unlock();
+      return true;
+    }
+    this->remove( s );
+  }
+
+  s = this->allocate( c );
+  if( s < 0 ){
+    this->unlock();
+    return false;
+  }
+
+  // Fill in our tile meta-data
+  Slot& slot = slots[s];
+  slot.hash = h;
+  slot.key_length = filename.length();
+  slot.data_length = r.dataLength;
+  slot.referenced = 0;
+  slot.padded = r.padded;
+  slot.compression = key.compression;
+  slot.tileNum = key.tile;
+  slot.resolution = key.resolution;
+  slot.hSequence = key.hSequence;
+  slot.vSequence = key.vSequence;
+  slot.quality = key.quality;
+  slot.timestamp = r.timestamp;
+  slot.width = r.width;
+  slot.height = r.height;
+  slot.channels = r.channels;
+  slot.bpc = r.bpc;
+  slot.sampleType = r.sampleType;
+
+  // Store our image path followed by the tile data
+  unsigned char* ptr = this->slotData( s );
+  memcpy( ptr, filename.data(), filename.length() );
+  memcpy( ptr + filename.length(), r.data, r.dataLength );
+
+  // Add to our index
+  int32_t& bucket = buckets[ h & (header->num_buckets-1) ];
+  slot.next = bucket;
+  bucket = s;
+  slot.in_use = 1;
+
+  header->num_elements++;
+  header->data_size += length;
+
+  this->unlock();
+  return true;
+}
+
+
+
+bool SharedCache::getTile( const TileKey& key, RawTile& tile )
+{
+  uint64_t h = key.hash();
+
+  this->lock();
+
+  int32_t s = this->find( key, h );
+  if( s < 0 ){
+    this->unlock();
+    return false;
+  }
+
+  Slot& slot = slots[s];
+  slot.referenced = 1;
+
+  tile.tileNum = slot.tileNum;
+  tile.resolution = slot.resolution;
+  tile.hSequence = slot.hSequence;
+  tile.vSequence = slot.vSequence;
+  tile.compressionType = (CompressionType) slot.compression;
+  tile.quality = slot.quality;
+  tile.timestamp = slot.timestamp;
+  tile.width = slot.width;
+  tile.height = slot.height;
+  tile.channels = slot.channels;
+  tile.bpc = slot.bpc;
+  tile.sampleType = (SampleType) slot.sampleType;
+  tile.padded = slot.padded;
+  tile.dataLength = slot.data_length;
+
+  try{
+    tile.allocate( tile.dataLength );
+  }
+  catch( ... ){
+    this->unlock();
+    throw;
+  }
+  memcpy( tile.data, this->slotData(s) + slot.key_length, tile.dataLength );
+
+  this->unlock();
+  return true;
+}
+
+
+
+void SharedCache::clear()
+{
+  this->lock();
+  this->reset();
+  this->unlock();
+}
+
+
+
+unsigned int SharedCache::getNumElements()
+{
+  this->lock();
+  unsigned int n = header->num_elements;
+  this->unlock();
+  return n;
+}
+
+
+
+float SharedCache::getMemorySize()
+{
+  this->lock();
+  uint64_t n = header->data_size;
+  this->unlock();
+  return (float)( n / 1024000.0 );
+}
+
+#endif
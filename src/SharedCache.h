@@ -0,0 +1,223 @@
+/*
+    IIPImage Server - Shared Memory Tile Cache
+
+    Tile cache held within a POSIX shared memory segment, allowing several
+    iipsrv processes to share a single set of cached tiles.
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SHAREDCACHE_H
+#define _SHAREDCACHE_H
+
+
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+#include "RawTile.h"
+#include "TileKey.h"
+
+
+
+/// Tile cache stored within a POSIX shared memory segment
+/** The segment is created by the first process to start and attached to by
+    subsequent processes. Memory is divided into fixed-size pages, which are
+    assigned on demand to slab classes of power-of-two slot sizes. Each slot
+    holds the image path followed by the tile data. A shared hash index maps keys
+    to slots and, once all pages have been assigned, slots are recycled within
+    each slab class using a CLOCK (second-chance) eviction policy. Classes under
+    eviction pressure periodically take over a page from the largest class, so that
+    memory follows the distribution of tile sizes. All access is
+    serialized through a robust process-shared mutex, so the death of a process
+    while holding the lock cannot deadlock the others.
+ */
+class SharedCache {
+
+ public:
+
+  /// Number of slab classes
+  static const unsigned int NUM_CLASSES = 9;
+
+  /// Smallest slot size in bytes
+  static const unsigned int MIN_SLOT_SIZE = 4096;
+
+  /// Page size in bytes - also the largest slot size
+  static const unsigned int PAGE_SIZE = MIN_SLOT_SIZE << (NUM_CLASSES-1);
+
+
+ private:
+
+  /// Per slab class bookkeeping
+  struct SlabClass {
+    uint32_t slot_size;    ///< Slot size in bytes
+    int32_t pages;         ///< Most recently assigned page of this class or -1
+    int32_t free_slots;    ///< Head of list of free slots or -1
+    int32_t clock_page;    ///< Page containing the CLOCK hand
+    uint32_t clock_slot;   ///< Slot index within page of the CLOCK hand
+    uint32_t num_pages;    ///< Number of pages assigned to this class
+    uint32_t evictions;    ///< Number of evictions from this class
+  };
+
+  /// Page descriptor
+  struct Page {
+    int32_t slab_class;    ///< Slab class to which this page has been assigned or -1
+    int32_t next;          ///< Next page of the same class or -1
+  };
+
+  /// Slot descriptor - holds the tile meta-data
+  struct Slot {
+    uint64_t hash;          ///< Tile key hash
+    int32_t next;          ///< Next slot within hash chain or free list
+    uint32_t key_length;   ///< Length of the image path stored before the tile data
+    uint32_t data_length;
+    uint8_t in_use;
+    uint8_t referenced;    ///< CLOCK reference bit
+    uint8_t padded;
+    uint8_t compression;
+    int32_t tileNum;
+    int32_t resolution;
+    int32_t hSequence;
+    int32_t vSequence;
+    int32_t quality;
+    int64_t timestamp;
+    uint32_t width;
+    uint32_t height;
+    int32_t channels;
+    int32_t bpc;
+    int32_t sampleType;
+  };
+
+  /// Segment header
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint32_t num_pages;
+    uint32_t num_buckets;
+    uint32_t next_free_page;
+    uint32_t num_elements;
+    uint64_t data_size;
+    uint64_t buckets_offset;
+    uint64_t pages_offset;
+    uint64_t slots_offset;
+    uint64_t data_offset;
+    pthread_mutex_t mutex;
+    SlabClass classes[NUM_CLASSES];
+  };
+
+
+  /// Name of our shared memory object
+  std::string name;
+
+  /// Base address of our mapping
+  unsigned char* base;
+
+  /// Size of our mapping
+  size_t size;
+
+  /// Convenience pointers into our mapping
+  Header* header;
+  int32_t* buckets;
+  Page* pages;
+  Slot* slots;
+  unsigned char* data;
+
+
+  /// Lock our segment, recovering if the previous owner died while holding the lock
+  void lock();
+
+  /// Unlock our segment
+  void unlock();
+
+  /// Reset our index and allocation structures - must be called with lock held
+  void reset();
+
+  /// Return the slab class index for an object of the given size or -1 if too large
+  static int slabClass( size_t length );
+
+  /// Return a pointer to the storage of a particular slot
+  unsigned char* slotData( int32_t s ){
+    return data + (size_t)(s / (PAGE_SIZE/MIN_SLOT_SIZE)) * PAGE_SIZE +
+      (size_t)(s % (PAGE_SIZE/MIN_SLOT_SIZE)) * header->classes[ pages[s/(PAGE_SIZE/MIN_SLOT_SIZE)].slab_class ].slot_size;
+  }
+
+  /// Find the slot holding a particular key - must be called with lock held
+  int32_t find( const TileKey& key, uint64_t h );
+
+  /// Unlink a slot from our hash index and place it on its class free list - must be called with lock held
+  void remove( int32_t s );
+
+  /// Assign a page to a slab class and place its slots on the free list - must be called with lock held
+  void assignPage( int c, int32_t p );
+
+  /// Reclaim a page from the slab class with the most pages, evicting its contents - must be called with lock held
+  /** @param c slab class requesting a page
+      @return page index or -1 if no page could be reclaimed
+   */
+  int32_t reclaimPage( int c );
+
+  /// Obtain a free slot for a given slab class, evicting if necessary - must be called with lock held
+  int32_t allocate( int c );
+
+
+ public:
+
+  /// Constructor - create or attach to a shared memory segment
+  /** @param n name of shared memory object (must begin with a '/')
+      @param max size of shared memory segment in MB
+      Throws a std::string on error
+   */
+  SharedCache( const std::string& n, float max );
+
+  /// Destructor - unmap our segment, but leave it in place for other processes
+  ~SharedCache();
+
+  /// Insert a tile
+  /** @param key tile key
+      @param r tile to be inserted
+      @return false if tile too large to be stored
+   */
+  bool insert( const TileKey& key, const RawTile& r );
+
+  /// Get a tile from the cache
+  /** Note that the tile file name is not stored and is left untouched
+      @param key tile key
+      @param tile RawTile into which the cached tile is copied
+      @return true if found, false otherwise
+   */
+  bool getTile( const TileKey& key, RawTile& tile );
+
+  /// Empty the cache for all processes
+  void clear();
+
+  /// Return the number of tiles in the cache
+  unsigned int getNumElements();
+
+  /// Return the number of MB stored
+  float getMemorySize();
+
+  /// Return the total size of the segment in MB
+  float getSegmentSize(){ return (float)( size / 1024000.0 ); };
+
+  /// Return the largest tile size in bytes that can be stored
+  size_t getMaxTileSize(){ return PAGE_SIZE; };
+
+};
+
+
+#endif
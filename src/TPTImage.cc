@@ -23,11 +23,175 @@
 
 #include "TPTImage.h"
 #include <sstream>
+#include <cerrno>
+
+#ifdef HAVE_PREAD
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 
 using namespace std;
 
 
+
+#ifdef HAVE_PREAD
+
+/* I/O layer for libtiff via TIFFClientOpen(). Reads use pread() at our own file position, so no
+   lseek() calls are needed, or are served from a read-only memory mapping of the whole file,
+   which libtiff also uses directly to access tile data without copying it through a buffer.
+ */
+
+/// File state for our libtiff I/O layer
+struct TIFFFile {
+  int fd;              ///< File descriptor
+  toff_t offset;       ///< Current file position
+  toff_t size;         ///< File size
+  void* base;          ///< Memory mapping of the file or NULL if reading with pread()
+};
+
+
+static tmsize_t tiffRead( thandle_t handle, void* buffer, tmsize_t size ){
+  TIFFFile* file = (TIFFFile*) handle;
+  if( size <= 0 || file->offset >= file->size ) return 0;
+  if( (toff_t) size > file->size - file->offset ) size = file->size - file->offset;
+
+  // Copy from our mapping if we have one
+  if( file->base ){
+    memcpy( buffer, (const char*) file->base + file->offset, size );
+    file->offset += size;
+    return size;
+  }
+
+  tmsize_t total = 0;
+  while( total < size ){
+    ssize_t n = pread( file->fd, (char*) buffer + total, size - total, file->offset );
+    if( n < 0 ){
+      if( errno == EINTR ) continue;
+      return -1;
+    }
+    if( n == 0 ) break;
+    total += n;
+    file->offset += n;
+  }
+  return total;
+}
+
+
+static tmsize_t tiffWrite( thandle_t, void*, tmsize_t ){
+  return -1;
+}
+
+
+static toff_t tiffSeek( thandle_t handle, toff_t offset, int whence ){
+  TIFFFile* file = (TIFFFile*) handle;
+  switch( whence ){
+    case SEEK_SET: file->offset = offset; break;
+    case SEEK_CUR: file->offset += offset; break;
+    case SEEK_END: file->offset = file->size + offset; break;
+    default: return (toff_t) -1;
+  }
+  return file->offset;
+}
+
+
+static int tiffClose( thandle_t handle ){
+  TIFFFile* file = (TIFFFile*) handle;
+#ifdef HAVE_SYS_MMAN_H
+  if( file->base ) munmap( file->base, file->size );
+#endif
+  int status = close( file->fd );
+  delete file;
+  return status;
+}
+
+
+static toff_t tiffSize( thandle_t handle ){
+  return ((TIFFFile*) handle)->size;
+}
+
+
+static int tiffMap( thandle_t handle, void** base, toff_t* size ){
+  TIFFFile* file = (TIFFFile*) handle;
+  if( !file->base ) return 0;
+  *base = file->base;
+  *size = file->size;
+  return 1;
+}
+
+
+static void tiffUnmap( thandle_t, void*, toff_t ){
+  // Our mapping is released when the file is closed
+}
+
+
+// Open a TIFF file through our I/O layer
+static TIFF* clientOpenTIFF( const string& filename, TPTImage::IOMode mode ){
+
+  int fd = open( filename.c_str(), O_RDONLY );
+  if( fd < 0 ) return NULL;
+
+  struct stat sb;
+  if( fstat( fd, &sb ) != 0 ){
+    close( fd );
+    return NULL;
+  }
+
+  TIFFFile* file = new TIFFFile;
+  file->fd = fd;
+  file->offset = 0;
+  file->size = sb.st_size;
+  file->base = NULL;
+
+#ifdef HAVE_SYS_MMAN_H
+  // Fall back to pread() if the file cannot be mapped
+  if( mode == TPTImage::TIFF_IO_MMAP && file->size > 0 ){
+    void* base = mmap( NULL, file->size, PROT_READ, MAP_SHARED, fd, 0 );
+    if( base != MAP_FAILED ) file->base = base;
+  }
+#endif
+
+  // Only allow libtiff to use our mapping in mmap mode
+  TIFF* tiff = TIFFClientOpen( filename.c_str(), file->base ? "r" : "rm", (thandle_t) file,
+			       tiffRead, tiffWrite, tiffSeek, tiffClose, tiffSize, tiffMap, tiffUnmap );
+
+  // libtiff does not close our file if it fails to open it
+  if( !tiff ) tiffClose( (thandle_t) file );
+  return tiff;
+}
+
+#endif
+
+
+
+// Close a TIFF handle held by our handle pool
+static void closeTIFF( void* tiff ){
+  TIFFClose( (TIFF*) tiff );
+}
+
+
+
+// Open a TIFF file with the requested I/O mode, closing idle pooled handles if we run out of file descriptors
+static TIFF* openTIFF( const string& filename, HandlePool* handles, TPTImage::IOMode mode ){
+  TIFF* tiff;
+  while( true ){
+#ifdef HAVE_PREAD
+    if( mode != TPTImage::TIFF_IO_LIBTIFF ) tiff = clientOpenTIFF( filename, mode );
+    else
+#endif
+    tiff = TIFFOpen( filename.c_str(), "rm" );
+    if( tiff ) break;
+    if( !handles || ( errno != EMFILE && errno != ENFILE ) || !handles->evict() ) break;
+  }
+  return tiff;
+}
+
+
 void TPTImage::openImage()
 {
 
@@ -41,11 +205,17 @@ void TPTImage::openImage()
   // Update our timestamp
   updateTimestamp( filename );
 
-  // Try to open and allocate a buffer
-  if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
+  // Reuse an already open handle for this file if available. Pooled handles are left on the
+  // directory last used, so that its tile offsets and byte counts remain loaded
+  if( handles ) tiff = (TIFF*) handles->acquire( filename, timestamp, closeTIFF );
+
+  // Otherwise try to open the file
+  if( !tiff && ( tiff = openTIFF( filename, handles, tiff_io ) ) == NULL ){
     throw file_error( "TPTImage :: TIFFOpen() failed for: " + filename );
   }
 
+  pooled = true;
+
   // Load our metadata if not already loaded
   if( bpc == 0 ) loadImageInfo( currentX, currentY );
 
@@ -61,7 +231,7 @@ void TPTImage::openImage()
 
 void TPTImage::loadImageInfo( int seq, int ang )
 {
-  tdir_t current_dir;
+  toff_t current_offset;
   int count;
   uint16 colour, samplesperpixel, bitspersample, sampleformat;
   double sminvaluearr[4] = {0.0}, smaxvaluearr[4] = {0.0};
@@ -73,6 +243,11 @@ void TPTImage::loadImageInfo( int seq, int ang )
   currentX = seq;
   currentY = ang;
 
+  // Our full resolution image is in the first directory, but our handle may have been left
+  // on another directory, so note where we are and rewind
+  current_offset = TIFFCurrentDirOffset( tiff );
+  TIFFSetDirectory( tiff, 0 );
+
   // Get the tile and image sizes
   TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tile_width );
   TIFFGetField( tiff, TIFFTAG_TILELENGTH, &tile_height );
@@ -94,24 +269,50 @@ void TPTImage::loadImageInfo( int seq, int ang )
   bpc = (unsigned int) bitspersample;
   sampleType = (sampleformat==3) ? FLOATINGPOINT : FIXEDPOINT;
 
-  // Check for the no. of resolutions in the pyramidal image
-  current_dir = TIFFCurrentDirectory( tiff );
-  TIFFSetDirectory( tiff, 0 );
-
-  // Store the list of image dimensions available
+  // Store the list of image dimensions available together with the offset of the directory
+  // holding each resolution, so that getTile() can switch directly to any resolution
+  directory_offsets.clear();
+  directory_offsets.push_back( TIFFCurrentDirOffset( tiff ) );
   image_widths.push_back( w );
   image_heights.push_back( h );
 
-  for( count = 0; TIFFReadDirectory( tiff ); count++ ){
-    TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
-    TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
-    image_widths.push_back( w );
-    image_heights.push_back( h );
+  // Check for the no. of resolutions in the pyramidal image. These are either stored as
+  // reduced resolution SubIFDs of our first directory, as in OME-TIFF, or as the
+  // subsequent directories in the file, as in classic pyramid TIFF and COG
+  uint16 nsubifds = 0;
+  toff_t *subifds = NULL;
+  if( TIFFGetField( tiff, TIFFTAG_SUBIFD, &nsubifds, &subifds ) && nsubifds > 0 ){
+    // Copy the offsets as they belong to the current directory
+    vector<toff_t> offsets( subifds, subifds + nsubifds );
+    for( unsigned int i = 0; i < offsets.size(); i++ ){
+      uint32 subfiletype = 0;
+      if( !TIFFSetSubDirectory( tiff, offsets[i] ) ) break;
+      TIFFGetField( tiff, TIFFTAG_SUBFILETYPE, &subfiletype );
+      if( !( subfiletype & FILETYPE_REDUCEDIMAGE ) ) continue;
+      TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
+      TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
+      image_widths.push_back( w );
+      image_heights.push_back( h );
+      directory_offsets.push_back( offsets[i] );
+    }
+    TIFFSetDirectory( tiff, 0 );
   }
-  // Reset the TIFF directory
-  TIFFSetDirectory( tiff, current_dir );
 
-  numResolutions = count+1;
+  // Otherwise, use the subsequent directories
+  if( directory_offsets.size() == 1 ){
+    while( TIFFReadDirectory( tiff ) ){
+      TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
+      TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
+      image_widths.push_back( w );
+      image_heights.push_back( h );
+      directory_offsets.push_back( TIFFCurrentDirOffset( tiff ) );
+    }
+  }
+
+  // Return to our full resolution image for the remaining tags
+  TIFFSetDirectory( tiff, 0 );
+
+  numResolutions = directory_offsets.size();
 
   // Handle various colour spaces
   if( colour == PHOTOMETRIC_CIELAB ) colourspace = CIELAB;
@@ -179,14 +380,20 @@ void TPTImage::loadImageInfo( int seq, int ang )
   if( TIFFGetField( tiff, TIFFTAG_XMLPACKET, &count, &tmp ) ) metadata["xmp"] = string(tmp,count);
   if( TIFFGetField( tiff, TIFFTAG_ICCPROFILE, &count, &tmp ) ) metadata["icc"] = string(tmp,count);
 
+  // Reset the TIFF directory
+  if( current_offset != TIFFCurrentDirOffset( tiff ) ) TIFFSetSubDirectory( tiff, current_offset );
+
 }
 
 
 void TPTImage::closeImage()
 {
   if( tiff != NULL ){
-    TIFFClose( tiff );
+    // Keep our handle open for subsequent requests if possible
+    if( handles && pooled ) handles->release( getFileName( currentX, currentY ), timestamp, tiff, closeTIFF );
+    else TIFFClose( tiff );
     tiff = NULL;
+    pooled = false;
   }
   if( tile_buf != NULL ){
     _TIFFfree( tile_buf );
@@ -195,6 +402,30 @@ void TPTImage::closeImage()
 }
 
 
+void TPTImage::setResolution( unsigned int res )
+{
+  // The first resolution is the highest, so we need to invert
+  //  the resolution - can avoid this if we store our images with
+  //  the smallest image first.
+  int vipsres = ( numResolutions - 1 ) - res;
+
+
+  // Change to the right directory for the resolution. Go directly to its offset rather than
+  // letting libtiff walk the directory chain from the start of the file, and only if we are not
+  // already there, so that the tile offsets and byte counts already loaded are reused
+  if( (unsigned int) vipsres < directory_offsets.size() ){
+    if( TIFFCurrentDirOffset( tiff ) != directory_offsets[vipsres] &&
+	!TIFFSetSubDirectory( tiff, directory_offsets[vipsres] ) ){
+      throw file_error( "TPTImage :: TIFFSetSubDirectory() failed" );
+    }
+  }
+  else if( !TIFFSetDirectory( tiff, vipsres ) ) {
+    throw file_error( "TPTImage :: TIFFSetDirectory() failed" );
+  }
+}
+
+
+
 RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile )
 {
   uint32 im_width, im_height, tw, th, ntlx, ntly;
@@ -221,7 +452,7 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   // Open the TIFF if it's not already open
   if( !tiff ){
     filename = getFileName( seq, ang );
-    if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
+    if( ( tiff = openTIFF( filename, handles, tiff_io ) ) == NULL ){
       throw file_error( "TPTImage :: TIFFOpen() failed for:" + filename );
     }
   }
@@ -233,16 +464,8 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   }
 
 
-  // The first resolution is the highest, so we need to invert
-  //  the resolution - can avoid this if we store our images with
-  //  the smallest image first.
-  int vipsres = ( numResolutions - 1 ) - res;
-
-
   // Change to the right directory for the resolution
-  if( !TIFFSetDirectory( tiff, vipsres ) ) {
-    throw file_error( "TPTImage :: TIFFSetDirectory() failed" );
-  }
+  setResolution( res );
 
 
   // Check that a valid tile number was given
@@ -333,11 +556,11 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 
   RawTile rawtile( tile, res, seq, ang, tw, th, channels, bpc );
+  // Point directly to our tile buffer, which is not owned by the tile - copies of the tile make their own copy of the data
   rawtile.data = tile_buf;
   rawtile.dataLength = length;
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
-  rawtile.memoryManaged = 0;
   rawtile.padded = true;
   rawtile.sampleType = sampleType;
 
@@ -371,9 +594,8 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
     }
 
     rawtile.dataLength = n;
-    rawtile.data = buffer;
+    rawtile.adopt( buffer );
     rawtile.bpc = 8;
-    rawtile.memoryManaged = 1;
   }
 
 
@@ -381,3 +603,118 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 }
 
+
+
+
+bool TPTImage::getJPEGTile( int seq, int ang, unsigned int res, unsigned int tile, RawTile& rawtile )
+{
+  uint32 im_width, im_height, tw, th, ntlx, ntly;
+  uint32 rem_x, rem_y, tables_length = 0;
+  uint16 compression, colour, planar, samplesperpixel, bitspersample;
+  toff_t *bytecounts = NULL;
+  unsigned char *tables = NULL;
+
+  // Only use our open image for the current sequence position
+  if( !jpeg_passthrough || !tiff || (currentX != seq) || (currentY != ang) || res >= numResolutions ) return false;
+
+  setResolution( res );
+
+  // Only JPEG compressed 8 bit greyscale or YCbCr tiles can be sent as they are stored
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_COMPRESSION, &compression );
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &colour );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_BITSPERSAMPLE, &bitspersample );
+  if( compression != COMPRESSION_JPEG || planar != PLANARCONFIG_CONTIG || bitspersample != 8 ) return false;
+  if( !( (colour == PHOTOMETRIC_YCBCR && samplesperpixel == 3) ||
+	 (colour == PHOTOMETRIC_MINISBLACK && samplesperpixel == 1) ) ) return false;
+
+  if( tile >= TIFFNumberOfTiles( tiff ) ) return false;
+
+  TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tw );
+  TIFFGetField( tiff, TIFFTAG_TILELENGTH, &th );
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
+  if( (tw == 0) || (th == 0) ) return false;
+
+  rem_x = im_width % tw;
+  rem_y = im_height % th;
+  ntlx = (im_width / tw) + (rem_x == 0 ? 0 : 1);
+  ntly = (im_height / th) + (rem_y == 0 ? 0 : 1);
+
+  // Tiles in the last column would need cropping horizontally. The entropy coded data is laid
+  // out in MCUs spanning the full tile width, so this cannot be done without decoding
+  if( ( tile % ntlx == ntlx - 1 ) && ( rem_x != 0 ) ) return false;
+
+  // Tiles in the bottom row can be cropped vertically by reducing the height in the frame header,
+  // as decoders stop once they have the number of lines declared there
+  unsigned int height = th;
+  if( ( tile / ntlx == ntly - 1 ) && ( rem_y != 0 ) ) height = rem_y;
+
+  // Get the size of our stored tile
+  if( !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &bytecounts ) || !bytecounts ) return false;
+  unsigned int length = bytecounts[tile];
+  if( length < 4 ) return false;
+
+  // Tiles usually hold abbreviated JPEG streams, with the quantization and Huffman tables stored
+  // once for all tiles in the JPEGTables tag, which is itself a JPEG stream of the form SOI tables EOI
+  if( TIFFGetField( tiff, TIFFTAG_JPEGTABLES, &tables_length, &tables ) && tables_length >= 4 ){
+    if( tables[0] != 0xFF || tables[1] != 0xD8 ||
+	tables[tables_length-2] != 0xFF || tables[tables_length-1] != 0xD9 ) return false;
+    tables_length -= 2;
+  }
+  else tables_length = 0;
+
+  // Splice the tables in after the SOI marker of our tile: SOI tables [tile data after SOI]
+  unsigned char *buffer = new unsigned char[tables_length + length];
+  tsize_t n = TIFFReadRawTile( tiff, (ttile_t) tile, buffer + tables_length, (tsize_t) length );
+  if( n < 4 || buffer[tables_length] != 0xFF || buffer[tables_length+1] != 0xD8 ){
+    delete[] buffer;
+    return false;
+  }
+
+  unsigned int size;
+  if( tables_length > 0 ){
+    memcpy( buffer, tables, tables_length );
+    memmove( buffer + tables_length, buffer + tables_length + 2, n - 2 );
+    size = tables_length + n - 2;
+  }
+  else size = n;
+
+  // Find the frame header and set our tile dimensions
+  bool sof = false;
+  unsigned int i = 2;
+  while( i + 4 <= size && buffer[i] == 0xFF ){
+    unsigned char marker = buffer[i+1];
+    if( marker == 0xFF ){         // Fill byte
+      i++;
+      continue;
+    }
+    unsigned int segment = (buffer[i+2] << 8) | buffer[i+3];
+    // Baseline, extended sequential and progressive Huffman frames
+    if( marker >= 0xC0 && marker <= 0xC2 ){
+      if( i + 9 > size ) break;
+      buffer[i+5] = (height >> 8) & 0xFF;
+      buffer[i+6] = height & 0xFF;
+      sof = true;
+      break;
+    }
+    if( marker == 0xDA ) break;   // Start of scan without a frame header
+    i += 2 + segment;
+  }
+  if( !sof ){
+    delete[] buffer;
+    return false;
+  }
+
+  rawtile = RawTile( tile, res, seq, ang, tw, height, samplesperpixel, 8 );
+  rawtile.compressionType = JPEG;
+  rawtile.dataLength = size;
+  rawtile.adopt( buffer );
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+  rawtile.padded = false;
+  rawtile.sampleType = FIXEDPOINT;
+
+  return true;
+}
@@ -42,21 +42,42 @@ class TPTImage : public IIPImage {
   /// Tile data buffer pointer
   tdata_t tile_buf;
 
+  /// Whether our TIFF handle was opened for our current timestamp and can be returned to the handle pool
+  bool pooled;
+
+  /// Change to the TIFF directory holding a particular resolution
+  /** @param r resolution number, where 0 is the smallest */
+  void setResolution( unsigned int r );
+
 
  public:
 
+  /// I/O modes for reading TIFF files
+  enum IOMode { TIFF_IO_LIBTIFF,  ///< libtiff's own file I/O
+		TIFF_IO_PREAD,    ///< Positional reads with pread()
+		TIFF_IO_MMAP      ///< Read-only memory mapping of the whole file
+  };
+
+  /// I/O mode used to open TIFF files
+  IOMode tiff_io;
+
+  /// Whether JPEG compressed tiles may be sent as they are stored, without decoding and re-encoding
+  bool jpeg_passthrough;
+
   /// Constructor
-  TPTImage():IIPImage(), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage():IIPImage(), tiff( NULL ), tile_buf( NULL ), pooled( false ), tiff_io( TIFF_IO_LIBTIFF ), jpeg_passthrough( false ) {};
 
   /// Constructor
   /** @param path image path
    */
-  TPTImage( const std::string& path ): IIPImage( path ), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage( const std::string& path ): IIPImage( path ), tiff( NULL ), tile_buf( NULL ), pooled( false ),
+    tiff_io( TIFF_IO_LIBTIFF ), jpeg_passthrough( false ) {};
 
   /// Copy Constructor
   /** @param image IIPImage object
    */
-  TPTImage( const TPTImage& image ): IIPImage( image ), tiff( NULL ),tile_buf( NULL ) {};
+  TPTImage( const TPTImage& image ): IIPImage( image ), tiff( NULL ),tile_buf( NULL ), pooled( false ),
+    tiff_io( image.tiff_io ), jpeg_passthrough( image.jpeg_passthrough ) {};
 
   /// Assignment Operator
   /** @param image TPTImage object
@@ -67,6 +88,9 @@ class TPTImage : public IIPImage {
       IIPImage::operator=(image);
       tiff = image.tiff;
       tile_buf = image.tile_buf;
+      pooled = image.pooled;
+      tiff_io = image.tiff_io;
+      jpeg_passthrough = image.jpeg_passthrough;
     }
     return *this;
   }
@@ -75,12 +99,15 @@ class TPTImage : public IIPImage {
   /** @param image IIPImage object
    */
   TPTImage( const IIPImage& image ): IIPImage( image ) {
-    tiff = NULL; tile_buf = NULL; 
+    tiff = NULL; tile_buf = NULL; pooled = false; tiff_io = TIFF_IO_LIBTIFF; jpeg_passthrough = false;
   };
 
   /// Destructor
   ~TPTImage() { closeImage(); };
 
+  /// Overloaded function for creating a new unopened copy of this image
+  IIPImage* clone() const { return new TPTImage( *this ); };
+
   /// Overloaded function for opening a TIFF image
   void openImage();
 
@@ -102,6 +129,19 @@ class TPTImage : public IIPImage {
    */
   RawTile getTile( int x, int y, unsigned int r, int l, unsigned int t );
 
+  /// Overloaded function for getting a JPEG compressed tile without decoding it
+  /** Only possible for 8 bit greyscale or YCbCr images with JPEG compressed tiles.
+      Tiles in the last column are cropped horizontally, which cannot be done without
+      decoding, so these are not available in this form.
+      @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param t tile number
+      @param tile tile to fill with JPEG data
+      @return true if the JPEG tile could be extracted
+   */
+  bool getJPEGTile( int x, int y, unsigned int r, unsigned int t, RawTile& tile );
+
 };
 
 
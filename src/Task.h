@@ -24,6 +24,7 @@
 
 
 #include <string>
+#include <mutex>
 
 #include "IIPImage.h"
 #include "IIPResponse.h"
@@ -33,6 +34,8 @@
 #include "Timer.h"
 #include "Writer.h"
 #include "Cache.h"
+#include "ImageCache.h"
+#include "NegativeCache.h"
 #include "Watermark.h"
 #include "Transforms.h"
 #include "Logger.h"
@@ -46,20 +49,6 @@
 
 
 
-#ifdef HAVE_EXT_POOL_ALLOCATOR
-#include <ext/pool_allocator.h>
-typedef HASHMAP < std::string, IIPImage,
-			      __gnu_cxx::hash< const std::string >,
-			      std::equal_to< const std::string >,
-			      __gnu_cxx::__pool_alloc< std::pair<const std::string,IIPImage> >
-			      > imageCacheMapType;
-#else
-typedef HASHMAP <std::string,IIPImage> imageCacheMapType;
-#endif
-
-
-
-
 
 
 /// Structure to hold our session data
@@ -78,8 +67,10 @@ struct Session {
   std::map <const std::string, std::string> headers;
   std::map <const std::string, unsigned int> codecOptions;
 
-  imageCacheMapType *imageCache;
+  ImageCache* imageCache;
   Cache* tileCache;
+  NegativeCache* negativeCache;
+  HandlePool* handlePool;
 
 #ifdef DEBUG
   FileWriter* out;
@@ -257,7 +248,52 @@ class TIL : public Task {
 
 /// CVT Region Export Command
 class CVT : public Task {
+
+ private:
+
+  /// Apply colour conversion and our floating point pipeline, leaving 8 bit data
+  /** @param tile image data
+      @param min image minima
+      @param max image maxima
+      @param float_processing whether to use our floating point pipeline
+   */
+  void applyTransforms( RawTile& tile, const std::vector<float>& min, const std::vector<float>& max,
+			bool float_processing );
+
+  /// Apply flattening, colour space conversions, equalization and flipping to resized data
+  /** @param tile image data */
+  void finalize( RawTile& tile );
+
+  /// Initialise compression and send the image header
+  /** @param compressor output compressor
+      @param tile first data to be compressed, which sets our width and number of channels
+      @param height final image height
+   */
+  void sendHeader( Compressor* compressor, const RawTile& tile, unsigned int height );
+
+  /// Compress and send data in strips of fixed height
+  /** @param compressor output compressor
+      @param tile data to be compressed
+      @param output buffer for compressed strips
+   */
+  void sendStrips( Compressor* compressor, const RawTile& tile, unsigned char* output );
+
+  /// Finish compression and send the remaining data
+  /** @param compressor output compressor
+      @param output buffer for compressed data
+   */
+  void sendEnd( Compressor* compressor, unsigned char* output );
+
+  /// Send a block of data
+  /** @param data data
+      @param len data length
+      @param label description used in log messages
+   */
+  void write( const unsigned char* data, int len, const char* label );
+
+
  public:
+
   void run( Session* session, const std::string& argument );
 
   /// Send out our requested region
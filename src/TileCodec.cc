@@ -0,0 +1,234 @@
+/*
+    IIPImage Server - Lossless Tile Cache Codec
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TileCodec.h"
+
+#include <cstring>
+#include <algorithm>
+#include <cctype>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+
+using namespace std;
+
+
+// Maximum size of idle decompression buffers kept for reuse (bytes)
+#define POOL_SIZE 32*1024*1024
+
+
+
+void BufferPool::Recycler::operator()( void* p ) const
+{
+  shared_ptr<State> s = pool.lock();
+  if( s ){
+    lock_guard<mutex> lock( s->mutex );
+    if( s->size + length <= s->maxSize ){
+      s->free[length].push_back( (unsigned char*) p );
+      s->size += length;
+      return;
+    }
+  }
+  delete[] (unsigned char*) p;
+}
+
+
+
+shared_ptr<void> BufferPool::get( size_t length )
+{
+  unsigned char* p = NULL;
+  {
+    lock_guard<mutex> lock( state->mutex );
+    map< size_t, vector<unsigned char*> >::iterator i = state->free.find( length );
+    if( i != state->free.end() && !i->second.empty() ){
+      p = i->second.back();
+      i->second.pop_back();
+      state->size -= length;
+    }
+  }
+  if( !p ) p = new unsigned char[length];
+
+  Recycler recycler;
+  recycler.pool = state;
+  recycler.length = length;
+  return shared_ptr<void>( p, recycler );
+}
+
+
+
+// Gather the bytes of multi-byte samples into separate planes
+static void shuffle( const unsigned char* in, unsigned char* out, unsigned int length, int bytes )
+{
+  unsigned int n = length / bytes;
+  for( int b=0; b<bytes; b++ ){
+    unsigned char* plane = &out[b*n];
+    for( unsigned int i=0; i<n; i++ ) plane[i] = in[i*bytes + b];
+  }
+}
+
+
+
+// Reverse our byte shuffle
+static void unshuffle( const unsigned char* in, unsigned char* out, unsigned int length, int bytes )
+{
+  unsigned int n = length / bytes;
+  for( int b=0; b<bytes; b++ ){
+    const unsigned char* plane = &in[b*n];
+    for( unsigned int i=0; i<n; i++ ) out[i*bytes + b] = plane[i];
+  }
+}
+
+
+
+TileCodec::TileCodec( const string& type ) : pool( POOL_SIZE )
+{
+  string t = type;
+  transform( t.begin(), t.end(), t.begin(), ::tolower );
+
+  codec = CODEC_NONE;
+  if( t == "lz4" ){
+#if defined(HAVE_LZ4)
+    codec = CODEC_LZ4;
+#elif defined(HAVE_ZLIB_H)
+    codec = CODEC_DEFLATE;
+#endif
+  }
+  else if( t == "deflate" || t == "zlib" ){
+#if defined(HAVE_ZLIB_H)
+    codec = CODEC_DEFLATE;
+#elif defined(HAVE_LZ4)
+    codec = CODEC_LZ4;
+#endif
+  }
+}
+
+
+
+const char* TileCodec::name() const
+{
+  switch( codec ){
+    case CODEC_LZ4: return "LZ4";
+    case CODEC_DEFLATE: return "DEFLATE";
+    default: return "none";
+  }
+}
+
+
+
+bool TileCodec::compress( const RawTile& in, RawTile& out )
+{
+  if( codec == CODEC_NONE || !in.data || in.dataLength == 0 ) return false;
+
+  // Per-thread scratch buffers
+  static thread_local vector<unsigned char> shuffled, scratch;
+
+  const unsigned char* src = (const unsigned char*) in.data;
+  unsigned int length = in.dataLength;
+
+  // Shuffle multi-byte samples into byte planes
+  int bytes = in.bpc / 8;
+  if( bytes > 1 && length % bytes == 0 ){
+    shuffled.resize( length );
+    shuffle( src, &shuffled[0], length, bytes );
+    src = &shuffled[0];
+  }
+
+  unsigned long clen = 0;
+
+#ifdef HAVE_LZ4
+  if( codec == CODEC_LZ4 ){
+    int bound = LZ4_compressBound( length );
+    scratch.resize( bound );
+    int n = LZ4_compress_default( (const char*) src, (char*) &scratch[0], length, bound );
+    if( n <= 0 ) return false;
+    clen = n;
+  }
+#endif
+
+#ifdef HAVE_ZLIB_H
+  if( codec == CODEC_DEFLATE ){
+    uLongf n = compressBound( length );
+    scratch.resize( n );
+    if( compress2( &scratch[0], &n, src, length, Z_BEST_SPEED ) != Z_OK ) return false;
+    clen = n;
+  }
+#endif
+
+  // Only keep the compressed data if it saves at least 10%
+  if( clen == 0 || clen > length - length/10 ) return false;
+
+  out = in;
+  out.adopt( new unsigned char[clen] );
+  memcpy( out.data, &scratch[0], clen );
+  out.dataLength = clen;
+
+  return true;
+}
+
+
+
+bool TileCodec::decompress( RawTile& tile, unsigned int length )
+{
+  static thread_local vector<unsigned char> shuffled;
+
+  shared_ptr<void> buffer = pool.get( length );
+  unsigned char* dst = (unsigned char*) buffer.get();
+
+  // Decompress first into our scratch buffer if we need to unshuffle
+  int bytes = tile.bpc / 8;
+  bool shuffle = ( bytes > 1 && length % bytes == 0 );
+  unsigned char* target = dst;
+  if( shuffle ){
+    shuffled.resize( length );
+    target = &shuffled[0];
+  }
+
+  bool ok = false;
+
+#ifdef HAVE_LZ4
+  if( codec == CODEC_LZ4 ){
+    int n = LZ4_decompress_safe( (const char*) tile.data, (char*) target, tile.dataLength, length );
+    ok = ( n == (int) length );
+  }
+#endif
+
+#ifdef HAVE_ZLIB_H
+  if( codec == CODEC_DEFLATE ){
+    uLongf n = length;
+    ok = ( uncompress( target, &n, (const Bytef*) tile.data, tile.dataLength ) == Z_OK && n == length );
+  }
+#endif
+
+  if( !ok ) return false;
+
+  if( shuffle ) unshuffle( target, dst, length, bytes );
+
+  tile.adopt( buffer );
+  tile.dataLength = length;
+
+  return true;
+}
@@ -0,0 +1,155 @@
+/*
+    IIPImage Server - Lossless Tile Cache Codec
+
+    Fast lossless compression of uncompressed tiles held within the tile cache
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TILECODEC_H
+#define _TILECODEC_H
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "RawTile.h"
+
+
+
+/// Pool of reusable data buffers
+/** Buffers are handed out as reference counted pointers, which return the buffer
+    to the pool once the last reference is released, so that repeatedly decompressing
+    tiles of the same size does not require fresh allocations. Buffers are pooled
+    by exact size and the total size of idle buffers is bounded. Buffers outliving
+    the pool are simply freed.
+ */
+class BufferPool {
+
+ private:
+
+  /// Pool state, shared with our buffer deleters
+  struct State {
+
+    /// Mutex protecting our free lists
+    std::mutex mutex;
+
+    /// Idle buffers by size
+    std::map< size_t, std::vector<unsigned char*> > free;
+
+    /// Total size in bytes of idle buffers
+    size_t size;
+
+    /// Maximum total size in bytes of idle buffers
+    size_t maxSize;
+
+    State( size_t max ) : size( 0 ), maxSize( max ) {};
+
+    ~State(){
+      for( std::map< size_t, std::vector<unsigned char*> >::iterator i = free.begin(); i != free.end(); ++i ){
+	for( unsigned int j=0; j<i->second.size(); j++ ) delete[] i->second[j];
+      }
+    };
+  };
+
+
+  /// Deleter returning buffers to their pool
+  struct Recycler {
+    std::weak_ptr<State> pool;
+    size_t length;
+    void operator()( void* p ) const;
+  };
+
+
+  /// Our state
+  std::shared_ptr<State> state;
+
+
+ public:
+
+  /// Constructor
+  /** @param max maximum total size in bytes of idle buffers kept for reuse */
+  BufferPool( size_t max ) : state( new State( max ) ) {};
+
+  /// Obtain a buffer
+  /** @param length size of buffer in bytes
+      @return reference counted buffer
+   */
+  std::shared_ptr<void> get( size_t length );
+
+};
+
+
+
+/// Lossless codec used to compress uncompressed tiles held within the tile cache
+/** Raw tiles, especially 16 bit or floating point scientific data, can be very large,
+    so that the cache holds few of them. When enabled, uncompressed tiles are compressed
+    on insertion into the cache and decompressed into pooled buffers on each hit. The bytes
+    of multi-byte samples are first shuffled into separate planes, which considerably
+    improves the compressibility of 16 and 32 bit data. LZ4 is used if available,
+    otherwise DEFLATE (zlib) at its fastest level.
+ */
+class TileCodec {
+
+ public:
+
+  /// Available codecs
+  enum Codec { CODEC_NONE, CODEC_DEFLATE, CODEC_LZ4 };
+
+
+ private:
+
+  /// Our codec
+  Codec codec;
+
+  /// Pool of decompression buffers
+  BufferPool pool;
+
+
+ public:
+
+  /// Constructor
+  /** @param type codec name: "lz4", "deflate" or "none". LZ4 falls back to DEFLATE if unavailable */
+  TileCodec( const std::string& type );
+
+  /// Return our codec
+  Codec getCodec() const { return codec; };
+
+  /// Return the name of our codec
+  const char* name() const;
+
+  /// Compress a tile
+  /** @param in uncompressed tile
+      @param out tile with the same parameters as the input, but with compressed data
+      @return false if the tile could not be usefully compressed, in which case out is unchanged
+   */
+  bool compress( const RawTile& in, RawTile& out );
+
+  /// Decompress a tile in place
+  /** @param tile tile holding compressed data, which is replaced by the decompressed data
+      @param length uncompressed data length in bytes
+      @return false if the data could not be decompressed
+   */
+  bool decompress( RawTile& tile, unsigned int length );
+
+};
+
+
+#endif
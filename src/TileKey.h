@@ -0,0 +1,158 @@
+// Tile Cache Key
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TILEKEY_H
+#define _TILEKEY_H
+
+
+#include <string>
+#include <cstddef>
+#include <atomic>
+#include <stdint.h>
+#include "RawTile.h"
+
+
+
+/// Interned image file name
+/** The tile cache creates and owns a single instance of this per distinct image path.
+    Tile keys refer to images by a plain pointer to this record, so that no string handling
+    or reference counting is needed on lookup. The record is counted as referenced by each
+    tile cached for the image and by each user of the image, such as a TileManager, which
+    interns the path once and releases it when done. Once no longer referenced, the cache
+    deletes the record.
+ */
+struct CacheImage {
+
+  /// Full image path
+  std::string filename;
+
+  /// 64 bit FNV-1a hash of our image path - identical across processes
+  uint64_t hash;
+
+  /// Number of cached tiles and users referring to this record - maintained by the cache
+  mutable std::atomic<unsigned int> references;
+
+  /// Constructor
+  /** @param f image path */
+  CacheImage( const std::string& f ) : filename( f ), references( 0 ) {
+    hash = 14695981039346656037ULL;
+    for( std::string::const_iterator c = f.begin(); c != f.end(); ++c ){
+      hash ^= (unsigned char) *c;
+      hash *= 1099511628211ULL;
+    }
+  };
+
+};
+
+
+
+/// Compact fixed-size key identifying a cached tile
+struct TileKey {
+
+  /// Interned image
+  const CacheImage* image;
+
+  /// Resolution number
+  int32_t resolution;
+
+  /// Tile number
+  int32_t tile;
+
+  /// Horizontal sequence number
+  int32_t hSequence;
+
+  /// Vertical sequence number
+  int32_t vSequence;
+
+  /// Compression type
+  int32_t compression;
+
+  /// Compression quality
+  int32_t quality;
+
+
+  /// Build a key
+  /**
+   *  @param i interned image
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   */
+  static TileKey make( const CacheImage* i, int r, int t, int h, int v, CompressionType c, int q ) {
+    TileKey key;
+    key.image = i; key.resolution = r; key.tile = t;
+    key.hSequence = h; key.vSequence = v; key.compression = c; key.quality = q;
+    return key;
+  }
+
+
+  /// Calculate a 64 bit hash of our key
+  /** Built only from the image path hash and our key values, so that it is
+      also valid for use across processes
+   */
+  uint64_t hash() const {
+    uint64_t h = image->hash;
+    h = (h ^ (uint32_t) resolution) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (uint32_t) tile) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (((uint64_t)(uint32_t) hSequence << 32) | (uint32_t) vSequence)) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (((uint64_t)(uint32_t) compression << 32) | (uint32_t) quality)) * 0x9E3779B97F4A7C15ULL;
+    // Final avalanche
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    return h;
+  }
+
+
+  /// Equality operator
+  friend bool operator == ( const TileKey& A, const TileKey& B ) {
+    return ( A.image == B.image && A.resolution == B.resolution && A.tile == B.tile &&
+	     A.hSequence == B.hSequence && A.vSequence == B.vSequence &&
+	     A.compression == B.compression && A.quality == B.quality );
+  }
+
+
+  /// Ordering operator for use with ordered maps
+  friend bool operator < ( const TileKey& A, const TileKey& B ) {
+    if( A.image != B.image ) return A.image < B.image;
+    if( A.resolution != B.resolution ) return A.resolution < B.resolution;
+    if( A.tile != B.tile ) return A.tile < B.tile;
+    if( A.hSequence != B.hSequence ) return A.hSequence < B.hSequence;
+    if( A.vSequence != B.vSequence ) return A.vSequence < B.vSequence;
+    if( A.compression != B.compression ) return A.compression < B.compression;
+    return A.quality < B.quality;
+  }
+
+};
+
+
+
+/// Hash functor for use with our hashed map types
+struct TileKeyHash {
+  size_t operator() ( const TileKey& key ) const { return (size_t) key.hash(); }
+};
+
+
+#endif
@@ -24,8 +24,13 @@
 
 
 #include <cmath>
+#include <atomic>
 #include "TileManager.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 using namespace std;
 
@@ -38,10 +43,43 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl;
 
 
-  RawTile ttt;
+  // Time the full cost of producing this tile, which is recorded in the cache for cost-aware eviction
+  decode_timer.start();
+
+
+  // If our image already holds this tile as JPEG, use it as it is rather than decoding and re-encoding
+  // it. Not possible if we need to watermark the tile or embed an ICC profile
+  if( c == JPEG && !( watermark && watermark->isSet() ) && jpeg->getICCProfile().empty() ){
+    RawTile jtile;
+    if( image->getJPEGTile( xangle, yangle, resolution, tile, jtile ) ){
+      // Store under our requested quality, so that subsequent requests find it in the cache
+      jtile.quality = jpeg->getQuality();
+      long cost = decode_timer.getTime();
+      if( loglevel >= 4 ) *logfile << "TileManager :: JPEG tile passed through without decoding in "
+				   << cost << " microseconds" << endl;
+      tileCache->insert( cacheImage, jtile, cost );
+      return jtile;
+    }
+  }
+
 
-  // Get our raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  // Get our raw tile from the IIPImage image object or crop it from a whole virtual resolution
+  RawTile ttt;
+  if( image->regionDecoding() && this->cachesVirtualResolution( resolution ) ){
+    int num_res = image->getNumResolutions();
+    unsigned int w = image->image_widths[num_res-resolution-1];
+    unsigned int h = image->image_heights[num_res-resolution-1];
+    unsigned int tw = image->getTileWidth();
+    unsigned int th = image->getTileHeight();
+    unsigned int ntlx = (w / tw) + (w % tw == 0 ? 0 : 1);
+    unsigned int x = (tile % ntlx) * tw;
+    unsigned int y = (tile / ntlx) * th;
+    if( x >= w || y >= h ) throw file_error( "TileManager :: Asked for non-existent tile" );
+    ttt = this->getVirtualRegion( resolution, xangle, yangle, layers, x, y,
+				  (x + tw > w) ? w - x : tw, (y + th > h) ? h - y : th );
+    ttt.tileNum = tile;
+  }
+  else ttt = image->getTile( xangle, yangle, resolution, layers, tile );
 
 
   // Apply the watermark if we have one.
@@ -68,8 +106,9 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
   // Add our uncompressed tile directly into our cache
   if( c == UNCOMPRESSED ){
     // Add to our tile cache
+    long cost = decode_timer.getTime();
     if( loglevel >= 4 ) insert_timer.start();
-    tileCache->insert( ttt );
+    tileCache->insert( cacheImage, ttt, cost );
     if( loglevel >= 4 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				 << " microseconds" << endl;
     return ttt;
@@ -105,8 +144,9 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
 
   // Add to our tile cache
+  long cost = decode_timer.getTime();
   if( loglevel >= 4 ) insert_timer.start();
-  tileCache->insert( ttt );
+  tileCache->insert( cacheImage, ttt, cost );
   if( loglevel >= 4 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 			       << " microseconds" << endl;
 
@@ -128,23 +168,19 @@ void TileManager::crop( RawTile *ttt ){
 	     << endl;
   }
 
-  // Create a new buffer, fill it with the old data, then copy
-  // back the cropped part into the RawTile buffer
-  int len = tw * th * ttt->channels * (ttt->bpc/8);
-  unsigned char* buffer = (unsigned char*) malloc( len );
-  unsigned char* src_ptr = (unsigned char*) memcpy( buffer, ttt->data, len );
+  // Crop in place, so first make sure we are not modifying data shared with the cache
+  ttt->unshare();
+  unsigned char* src_ptr = (unsigned char*) ttt->data;
   unsigned char* dst_ptr = (unsigned char*) ttt->data;
 
-  // Copy one scanline at a time
-  len =  ttt->width * ttt->channels * (ttt->bpc/8);
+  // Move one scanline at a time - our destination never overtakes our source
+  int len =  ttt->width * ttt->channels * (ttt->bpc/8);
   for( unsigned int i=0; i<ttt->height; i++ ){
-    memcpy( dst_ptr, src_ptr, len );
+    memmove( dst_ptr, src_ptr, len );
     dst_ptr += len;
     src_ptr += tw * ttt->channels * (ttt->bpc/8);
   }
 
-  free( buffer );
-
   // Reset the data length
   len = ttt->width * ttt->height * ttt->channels * (ttt->bpc/8);
   ttt->dataLength = len;
@@ -157,7 +193,8 @@ void TileManager::crop( RawTile *ttt ){
 
 RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
 
-  RawTile* rawtile = NULL;
+  RawTile rawtile;
+  bool found = false;
   string tileCompression;
   string compName;
 
@@ -173,28 +210,28 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
     {
 
     case JPEG:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					  xangle, yangle, JPEG, jpeg->getQuality() )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( TileKey::make( cacheImage, resolution, tile, xangle, yangle,
+						      JPEG, jpeg->getQuality() ), rawtile )) ) break;
+      if( (found = tileCache->getTile( TileKey::make( cacheImage, resolution, tile, xangle, yangle,
+						      DEFLATE, 0 ), rawtile )) ) break;
+      if( (found = tileCache->getTile( TileKey::make( cacheImage, resolution, tile, xangle, yangle,
+						      UNCOMPRESSED, 0 ), rawtile )) ) break;
       break;
 
 
     case DEFLATE:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( TileKey::make( cacheImage, resolution, tile, xangle, yangle,
+						      DEFLATE, 0 ), rawtile )) ) break;
+      if( (found = tileCache->getTile( TileKey::make( cacheImage, resolution, tile, xangle, yangle,
+						      UNCOMPRESSED, 0 ), rawtile )) ) break;
       break;
 
 
     case UNCOMPRESSED:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( TileKey::make( cacheImage, resolution, tile, xangle, yangle,
+						      UNCOMPRESSED, 0 ), rawtile )) ) break;
       break;
 
 
@@ -205,15 +242,42 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
 
   // If we haven't been able to get a tile, get a raw one
-  if( !rawtile || (rawtile && (rawtile->timestamp < image->timestamp)) ){
+  if( !found || (rawtile.timestamp < image->timestamp) ){
 
-    if( rawtile && (rawtile->timestamp < image->timestamp) ){
+    if( found && (rawtile.timestamp < image->timestamp) ){
       if( loglevel >= 3 ) *logfile << "TileManager :: Tile has old timestamp "
-			           << rawtile->timestamp << " - " << image->timestamp
+			           << rawtile.timestamp << " - " << image->timestamp
                                    << " ... updating" << endl;
     }
 
-    RawTile newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c );
+    // If another thread is already producing this tile, wait for it and share its result
+    TileKey key = TileKey::make( cacheImage, resolution, tile, xangle, yangle, c,
+				 (c == JPEG) ? jpeg->getQuality() : 0 );
+    if( !tileCache->claim( key, rawtile ) ){
+      if( loglevel >= 3 ) *logfile << "TileManager :: Coalesced with in-flight decode of tile " << tile << endl
+				   << "TileManager :: Total Tile Access Time: "
+				   << tile_timer.getTime() << " microseconds" << endl;
+      return rawtile;
+    }
+
+    // Another thread may have cached the tile and completed its flight since our lookup
+    if( tileCache->getTile( key, rawtile ) && rawtile.timestamp >= image->timestamp ){
+      tileCache->complete( key, &rawtile );
+      if( loglevel >= 3 ) *logfile << "TileManager :: Tile " << tile << " cached by another thread" << endl
+				   << "TileManager :: Total Tile Access Time: "
+				   << tile_timer.getTime() << " microseconds" << endl;
+      return rawtile;
+    }
+
+    RawTile newtile;
+    try{
+      newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c );
+    }
+    catch( ... ){
+      tileCache->complete( key, NULL );
+      throw;
+    }
+    tileCache->complete( key, &newtile );
 
     if( loglevel >= 3 ) *logfile << "TileManager :: Total Tile Access Time: "
 				 << tile_timer.getTime() << " microseconds" << endl;
@@ -222,7 +286,7 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
 
   // Define our compression names
-  switch( rawtile->compressionType ){
+  switch( rawtile.compressionType ){
     case JPEG: compName = "JPEG"; break;
     case DEFLATE: compName = "DEFLATE"; break;
     case UNCOMPRESSED: compName = "UNCOMPRESSED"; break;
@@ -240,13 +304,14 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
   // Check whether the compression used for out tile matches our requested compression type.
   // If not, we must convert
 
-  if( c == JPEG && rawtile->compressionType == UNCOMPRESSED ){
+  if( c == JPEG && rawtile.compressionType == UNCOMPRESSED ){
 
-    // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
-    RawTile ttt( *rawtile );
+    // Rawtile shares its data with the cache, but cropping and compression
+    // make their own copy before modifying it, so we can compress it directly
+    RawTile& ttt = rawtile;
 
     // Do our JPEG compression iff we have an 8 bit per channel image and either 1 or 3 bands
-    if( rawtile->bpc==8 && (rawtile->channels==1 || rawtile->channels==3) ){
+    if( rawtile.bpc==8 && (rawtile.channels==1 || rawtile.channels==3) ){
 
       // Crop if this is an edge tile
       if( ( (ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight()) ) && ttt.padded ){
@@ -254,40 +319,146 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 	this->crop( &ttt );
       }
 
-      if( loglevel >=2 ) compression_timer.start();
-      unsigned int oldlen = rawtile->dataLength;
+      compression_timer.start();
+      unsigned int oldlen = ttt.dataLength;
       unsigned int newlen = jpeg->Compress( ttt );
+      long cost = compression_timer.getTime();
       if( loglevel >= 3 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
 				   << "TileManager :: JPEG Compression Time: "
-				   << compression_timer.getTime() << " microseconds" << endl
+				   << cost << " microseconds" << endl
 				   << "TileManager :: Compression Ratio: " << newlen << "/" << oldlen << " = "
 				   << ( (float)newlen/(float)oldlen ) << endl;
 
       // Add our compressed tile to the cache
       if( loglevel >= 3 ) insert_timer.start();
-      tileCache->insert( ttt );
+      tileCache->insert( cacheImage, ttt, cost );
       if( loglevel >= 3 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				   << " microseconds" << endl;
 
       if( loglevel >= 3 ) *logfile << "TileManager :: Total Tile Access Time: "
 				   << tile_timer.getTime() << " microseconds" << endl;
-      return RawTile( ttt );
+      return rawtile;
     }
   }
 
   if( loglevel >= 3 ) *logfile << "TileManager :: Total Tile Access Time: "
 			       << tile_timer.getTime() << " microseconds" << endl;
 
-  return RawTile( *rawtile );
+  return rawtile;
+
+
+}
+
+
+RawTile TileManager::getVirtualResolution( unsigned int res, int seq, int ang, int layers ){
+
+  // Whole resolutions are cached with a tile number of -1
+  TileKey key = TileKey::make( cacheImage, res, -1, seq, ang, UNCOMPRESSED, 0 );
+
+  RawTile level;
+  Timer timer;
+  if( tileCache->getTile( key, level ) && level.timestamp >= image->timestamp ){
+    if( loglevel >= 3 ) *logfile << "TileManager :: Virtual resolution " << res << " found in cache" << endl;
+    return level;
+  }
+
+  // If another thread is already producing this resolution, wait for it and share its result
+  if( !tileCache->claim( key, level ) ) return level;
+
+  // Another thread may have cached it and completed its flight since our lookup
+  if( tileCache->getTile( key, level ) && level.timestamp >= image->timestamp ){
+    tileCache->complete( key, &level );
+    return level;
+  }
+
+  int num_res = image->getNumResolutions();
+  unsigned int w = image->image_widths[num_res-res-1];
+  unsigned int h = image->image_heights[num_res-res-1];
+
+  try{
+    timer.start();
+    level = image->getRegion( seq, ang, res, layers, 0, 0, w, h );
+    level.tileNum = -1;
+  }
+  catch( ... ){
+    tileCache->complete( key, NULL );
+    throw;
+  }
+
+  long cost = timer.getTime();
+  if( loglevel >= 3 ) *logfile << "TileManager :: Virtual resolution " << res << " decoded in "
+			       << cost << " microseconds" << endl;
+
+  tileCache->insert( cacheImage, level, cost );
+  tileCache->complete( key, &level );
+
+  return level;
+}
+
+
+
+bool TileManager::cachesVirtualResolution( unsigned int res ){
+  if( res >= image->getVirtualLevels() ) return false;
+  int num_res = image->getNumResolutions();
+  unsigned long pixels = (unsigned long) image->image_widths[num_res-res-1] * image->image_heights[num_res-res-1];
+  if( pixels > MAX_VIRTUAL_RESOLUTION_SIZE ) return false;
+
+  // Only worthwhile if the whole resolution can stay in our cache, otherwise every tile
+  // request would decode it again
+  unsigned int bpc = image->getNumBitsPerPixel();
+  if( bpc < 8 ) bpc = 8;
+  return tileCache->fits( pixels * image->getNumChannels() * (bpc/8) );
+}
+
+
+
+RawTile TileManager::getVirtualRegion( unsigned int res, int seq, int ang, int layers,
+				       unsigned int x, unsigned int y, unsigned int width, unsigned int height ){
+
+  RawTile level = this->getVirtualResolution( res, seq, ang, layers );
+
+  // The whole resolution shares its data with our cache, so give callers their own copy to modify
+  if( x == 0 && y == 0 && width == level.width && height == level.height ){
+    level.unshare();
+    return level;
+  }
+
+  if( x + width > level.width || y + height > level.height ){
+    throw file_error( "TileManager :: Requested region is outside of image" );
+  }
+
+  RawTile region( 0, res, seq, ang, width, height, level.channels, level.bpc );
+  unsigned int bytes = level.channels * (level.bpc/8);
+  region.dataLength = width * height * bytes;
+  region.sampleType = level.sampleType;
+  region.filename = level.filename;
+  region.timestamp = level.timestamp;
+  region.allocate( region.dataLength );
 
+  // Copy one scanline at a time
+  for( unsigned int j=0; j<height; j++ ){
+    memcpy( (unsigned char*) region.data + j*width*bytes,
+	    (unsigned char*) level.data + ((y+j)*level.width + x)*bytes, width*bytes );
+  }
 
+  return region;
 }
 
 
+
 RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers, unsigned int x, unsigned int y, unsigned int width, unsigned int height ){
 
   // If our image type can directly handle region compositing, simply return that
   if( image->regionDecoding() ){
+
+    // Small virtual resolutions are decoded as a whole just once, so crop our region from that
+    if( this->cachesVirtualResolution( res ) ){
+      if( loglevel >= 3 ){
+	*logfile << "TileManager getRegion :: cropping region from virtual resolution" << endl;
+      }
+      return this->getVirtualRegion( res, seq, ang, layers, x, y, width, height );
+    }
+
     if( loglevel >= 3 ){
       *logfile << "TileManager getRegion :: requesting region directly from image" << endl;
     }
@@ -300,14 +471,6 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   unsigned int src_tile_width = image->getTileWidth();
   unsigned int src_tile_height = image->getTileHeight();
 
-  // The tile size of the destination tile
-  unsigned int dst_tile_width = src_tile_width;
-  unsigned int dst_tile_height = src_tile_height;
-
-  // The basic tile size ie. not the current tile
-  unsigned int basic_tile_width = src_tile_width;
-  unsigned int basic_tile_height = src_tile_height;
-
   int num_res = image->getNumResolutions();
   unsigned int im_width = image->image_widths[num_res-res-1];
   unsigned int im_height = image->image_heights[num_res-res-1];
@@ -354,136 +517,177 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   // Assume 1 bit data has been unpacked to 8 bits per channel
   if( bpc == 1 ) bpc = 8;
 
+  // If our region corresponds exactly to a single whole tile, simply return that tile,
+  // which avoids allocating and copying into a new region buffer
+  if( (endx-startx == 1) && (endy-starty == 1) && xoffset == 0 && yoffset == 0 ){
+    RawTile rawtile = this->getTile( res, (starty*ntlx) + startx, seq, ang, layers, UNCOMPRESSED );
+    if( rawtile.width == width && rawtile.height == height && rawtile.bpc == (int) bpc &&
+	rawtile.dataLength == width * height * channels * (bpc/8) ){
+      if( loglevel >= 3 ){
+	*logfile << "TileManager getRegion :: region corresponds to a single tile: using tile directly" << endl;
+      }
+      return rawtile;
+    }
+  }
+
   // Create an empty tile with the correct dimensions
   RawTile region( 0, res, seq, ang, width, height, channels, bpc );
   region.dataLength = width * height * channels * (bpc/8);
   region.sampleType = sampleType;
 
   // Allocate memory for the region
-  if( bpc == 8 ) region.data = new unsigned char[width*height*channels];
-  else if( bpc == 16 ) region.data = new unsigned short[width*height*channels];
-  else if( bpc == 32 && sampleType == FIXEDPOINT ) region.data = new int[width*height*channels];
-  else if( bpc == 32 && sampleType == FLOATINGPOINT ) region.data = new float[width*height*channels];
+  region.allocate( region.dataLength );
 
-  unsigned int current_height = 0;
-
-  // Decode the image strip by strip
+  // Tiles already in our cache are copied straight away. The rest are decoded afterwards
+  std::vector<unsigned int> missing;
   for( unsigned int i=starty; i<endy; i++ ){
-
-    unsigned int buffer_index = 0;
-
-    // Keep track of the current pixel boundary horizontally. ie. only up
-    //  to the beginning of the current tile boundary.
-    unsigned int current_width = 0;
-
     for( unsigned int j=startx; j<endx; j++ ){
+      unsigned int tile = (i*ntlx) + j;
+      RawTile rawtile;
+      if( tileCache->getTile( TileKey::make( cacheImage, res, tile, seq, ang, UNCOMPRESSED, 0 ), rawtile ) &&
+	  rawtile.timestamp >= image->timestamp && !rawtile.padded ){
+	this->copyTile( rawtile, region, i, j, x, y );
+      }
+      else missing.push_back( tile );
+    }
+  }
 
-      // Time the tile retrieval
-      if( loglevel >= 3 ) tile_timer.start();
+  if( missing.empty() ) return region;
 
-      // Get an uncompressed tile
-      RawTile rawtile = this->getTile( res, (i*ntlx) + j, seq, ang, layers, UNCOMPRESSED );
 
-      if( loglevel >= 5 ){
-	*logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
-		 << (i*ntlx) + j << " at resolution " << res << endl;
-      }
+  // Decode missing tiles in parallel if our image can be opened separately by each thread.
+  // Each thread other than our own decodes through its own copy of the image
+  std::vector<IIPImage*> images;
+#ifdef _OPENMP
+  unsigned int threads = omp_get_max_threads();
+  if( threads > missing.size() ) threads = missing.size();
+  for( unsigned int t=1; t<threads; t++ ){
+    IIPImage* copy = image->clone();
+    if( !copy ) break;
+    images.push_back( copy );
+  }
+#endif
 
+  if( loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: decoding " << missing.size() << " tiles with "
+	     << images.size()+1 << " thread" << ((images.size() > 0) ? "s" : "") << endl;
+  }
 
-      // Only print this out once per image
-      if( (loglevel >= 5) && (i==starty) && (j==starty) ){
-	*logfile << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
-		 << rawtile.bpc << " bits per channel" << endl;
+  // Tiles are handed out one at a time, so that a thread whose copy of the image fails to open
+  // simply takes no part and leaves its share to the others
+  std::atomic<unsigned int> next( 0 );
+
+  // Tiles which failed to decode through a copy of our image, retried afterwards through our own
+  std::vector<unsigned int> deferred;
+
+  // Exceptions cannot leave a parallel region, so note the first error and throw it afterwards
+  std::string error;
+  std::atomic<bool> failed( false );
+#ifdef _OPENMP
+  bool reported = false;
+#endif
+
+#if defined(_OPENMP)
+#pragma omp parallel num_threads( images.size()+1 ) if( images.size() > 0 )
+#endif
+  {
+    TileManager* manager = this;
+
+#ifdef _OPENMP
+    int t = omp_get_thread_num();
+    if( t > 0 ){
+      try{
+	images[t-1]->openImage();
+	manager = new TileManager( tileCache, images[t-1], watermark, jpeg, logfile, loglevel );
       }
-
-      // Set the tile width and height to be that of the source tile - Use the rawtile data
-      // because if we take a tile from cache the image pointer will not necessarily be pointing
-      // to the the current tile
-      src_tile_width = rawtile.width;
-      src_tile_height = rawtile.height;
-      dst_tile_width = src_tile_width;
-      dst_tile_height = src_tile_height;
-
-      // Variables for the pixel offset within the current tile
-      unsigned int xf = 0;
-      unsigned int yf = 0;
-
-      // If our viewport has been set, we need to modify our start
-      // and end points on the source image
-      if( !( x==0 && y==0 && width==im_width && height==im_height ) ){
-
-	unsigned int remainder;  // Remaining pixels in the final row or column
-
-	if( j == startx ){
-	  // Calculate the width used in the current tile
-	  // If there is only 1 tile, the width is just the view width
-	  if( j < endx - 1 ) dst_tile_width = src_tile_width - xoffset;
-	  else dst_tile_width = width;
-	  xf = xoffset;
+      catch( const std::exception& e ){
+	manager = NULL;
+	// Only report this once, as every copy of the image is likely to fail in the same way
+#pragma omp critical
+	if( !reported ){
+	  reported = true;
+	  if( loglevel >= 1 ){
+	    *logfile << "TileManager getRegion :: unable to open image for parallel decoding: " << e.what() << endl;
+	  }
 	}
-	else if( j == endx-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (width+x) % basic_tile_width;
-	  if( remainder != 0 ) dst_tile_width = remainder;
+      }
+    }
+#endif
+
+    unsigned int n;
+    while( manager && !failed && (n = next++) < missing.size() ){
+      unsigned int tile = missing[n];
+      try{
+	RawTile rawtile = manager->getTile( res, tile, seq, ang, layers, UNCOMPRESSED );
+	this->copyTile( rawtile, region, tile / ntlx, tile % ntlx, x, y );
+      }
+      catch( const std::exception& e ){
+#if defined(_OPENMP)
+#pragma omp critical
+#endif
+	{
+	  if( manager != this ) deferred.push_back( tile );
+	  else if( error.empty() ){
+	    error = e.what();
+	    failed = true;
+	  }
 	}
+      }
+    }
 
-	if( i == starty ){
-	  // Calculate the height used in the current row of tiles
-	  // If there is only 1 row the height is just the view height
-	  if( i < endy - 1 ) dst_tile_height = src_tile_height - yoffset;
-	  else dst_tile_height = height;
-	  yf = yoffset;
-	}
-	else if( i == endy-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (height+y) % basic_tile_height;
-	  if( remainder != 0 ) dst_tile_height = remainder;
-	}
+    if( manager != this ) delete manager;
+  }
 
-	if( loglevel >= 5 ){
-	  *logfile << "TileManager getRegion :: destination tile width: " << dst_tile_width
-		   << ", tile height: " << dst_tile_height << endl;
-	}
-      }
+  for( unsigned int t=0; t<images.size(); t++ ) delete images[t];
+
+  if( failed ) throw file_error( error );
+
+  // Tiles which failed in another thread are decoded through our own image, so that any genuine
+  // error is reported just once
+  if( !deferred.empty() && loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: retrying " << deferred.size() << " tiles serially" << endl;
+  }
+  for( unsigned int n=0; n<deferred.size(); n++ ){
+    unsigned int tile = deferred[n];
+    RawTile rawtile = this->getTile( res, tile, seq, ang, layers, UNCOMPRESSED );
+    this->copyTile( rawtile, region, tile / ntlx, tile % ntlx, x, y );
+  }
 
+  return region;
 
-      // Copy our tile data into the appropriate part of the strip memory
-      // one whole tile width at a time
-      for( unsigned int k=0; k<dst_tile_height; k++ ){
+}
 
-	buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
-	unsigned int inx = ((k+yf)*rawtile.width*channels) + (xf*channels);
 
-	// Simply copy the line of data across
-	if( bpc == 8 ){
-	  unsigned char* ptr = (unsigned char*) rawtile.data;
-	  unsigned char* buf = (unsigned char*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
-	}
-	else if( bpc ==  16 ){
-	  unsigned short* ptr = (unsigned short*) rawtile.data;
-	  unsigned short* buf = (unsigned short*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
-	}
-	else if( bpc == 32 && sampleType == FIXEDPOINT ){
-	  unsigned int* ptr = (unsigned int*) rawtile.data;
-	  unsigned int* buf = (unsigned int*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-	else if( bpc == 32 && sampleType == FLOATINGPOINT ){
-	  float* ptr = (float*) rawtile.data;
-	  float* buf = (float*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-      }
 
-      current_width += dst_tile_width;
-    }
+void TileManager::copyTile( const RawTile& rawtile, RawTile& region, unsigned int i, unsigned int j,
+			    unsigned int x, unsigned int y ){
+
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
 
-    current_height += dst_tile_height;
+  // Intersect our tile with our region
+  unsigned int tx = j * tw;
+  unsigned int ty = i * th;
+  unsigned int x0 = ( tx > x ) ? tx : x;
+  unsigned int y0 = ( ty > y ) ? ty : y;
+  unsigned int x1 = ( tx + rawtile.width < x + region.width ) ? tx + rawtile.width : x + region.width;
+  unsigned int y1 = ( ty + rawtile.height < y + region.height ) ? ty + rawtile.height : y + region.height;
+  if( x1 <= x0 || y1 <= y0 ) return;
 
+  if( loglevel >= 5 ){
+    *logfile << "TileManager getRegion :: copying " << x1-x0 << "x" << y1-y0 << " pixels of tile "
+	     << rawtile.tileNum << endl;
   }
 
-  return region;
+  // Copy our tile data into the appropriate part of the region one scanline at a time
+  unsigned int bytes = region.channels * (region.bpc/8);
+  unsigned int len = (x1-x0) * bytes;
+  unsigned char* src = (unsigned char*) rawtile.data + ( (size_t)(y0-ty)*rawtile.width + (x0-tx) ) * bytes;
+  unsigned char* dst = (unsigned char*) region.data + ( (size_t)(y0-y)*region.width + (x0-x) ) * bytes;
+  for( unsigned int k=y0; k<y1; k++ ){
+    memcpy( dst, src, len );
+    src += rawtile.width * bytes;
+    dst += region.width * bytes;
+  }
 
 }
@@ -33,6 +33,10 @@
 #include "Logger.h"
 
 
+// Maximum size in pixels of virtual resolutions decoded as a whole and kept in the tile cache
+#define MAX_VIRTUAL_RESOLUTION_SIZE 1048576
+
+
 /// Class to manage access to the tile cache and tile cropping
 
 class TileManager{
@@ -43,10 +47,15 @@ class TileManager{
   Cache* tileCache;
   Compressor* jpeg;
   IIPImage* image;
+  const CacheImage* cacheImage;
   Watermark* watermark;
   Logger* logfile;
   int loglevel;
-  Timer compression_timer, tile_timer, insert_timer;
+  Timer compression_timer, tile_timer, insert_timer, decode_timer;
+
+  /// Not copyable, as each copy would release our interned image
+  TileManager( const TileManager& );
+  TileManager& operator= ( const TileManager& );
 
   /// Get a new tile from the image file
   /**
@@ -64,6 +73,56 @@ class TileManager{
   RawTile getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
 
 
+  /// Get a whole virtual resolution
+  /**
+   *  Virtual resolutions are reduced from the smallest resolution held in the image, so are
+   *  decoded once as a whole and kept in the tile cache. Concurrent requests for the same
+   *  resolution share a single decode.
+   *  @param res resolution number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @return RawTile holding the whole resolution
+   */
+  RawTile getVirtualResolution( unsigned int res, int xangle, int yangle, int layers );
+
+
+  /// Whether a resolution is a virtual resolution small enough to be decoded as a whole and cached
+  /** Also requires that our tile cache can hold the whole resolution
+   *  @param res resolution number */
+  bool cachesVirtualResolution( unsigned int res );
+
+
+  /// Crop a region from a whole virtual resolution
+  /**
+   *  The region is always returned in a private buffer, which the caller may modify
+   *  @param res resolution number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param x left offset
+   *  @param y top offset
+   *  @param w width of region
+   *  @param h height of region
+   *  @return RawTile
+   */
+  RawTile getVirtualRegion( unsigned int res, int xangle, int yangle, int layers,
+			    unsigned int x, unsigned int y, unsigned int w, unsigned int h );
+
+
+  /// Copy the part of a tile lying within a region into that region
+  /**
+   *  @param rawtile tile
+   *  @param region region being composited
+   *  @param i row of our tile
+   *  @param j column of our tile
+   *  @param x left offset of region
+   *  @param y top offset of region
+   */
+  void copyTile( const RawTile& rawtile, RawTile& region, unsigned int i, unsigned int j,
+		 unsigned int x, unsigned int y );
+
+
   /// Crop a tile to remove padding
   /** @param t pointer to tile to crop
    */
@@ -85,6 +144,7 @@ class TileManager{
   TileManager( Cache* tc, IIPImage* im, Watermark* w, Compressor* j, Logger* s, int l ){
     tileCache = tc; 
     image = im;
+    cacheImage = tc->getImage( im->getImagePath() );
     watermark = w;
     jpeg = j;
     logfile = s ;
@@ -92,6 +152,10 @@ class TileManager{
   };
 
 
+  /// Destructor - release our interned image
+  ~TileManager(){ tileCache->releaseImage( cacheImage ); };
+
+
 
   /// Get a tile from the cache
   /**
@@ -113,7 +177,8 @@ class TileManager{
   /// Generate a complete region
   /**
    *  Build up an arbitrary region by extracting tiles from the cache by using getTile function.
-   *  Data returned as uncompressed data.
+   *  Tiles not already in the cache are decoded in parallel if the image can be opened by
+   *  several threads at once. Data returned as uncompressed data.
    *  @param res resolution number
    *  @param xangle horizontal sequence number
    *  @param yangle vertical sequence number
@@ -72,6 +72,7 @@ void Transform::normalize( RawTile& in, const vector<float>& max, const vector<f
   unsigned char* ucptr;
 
   if( in.bpc == 32 && in.sampleType == FLOATINGPOINT ) {
+    in.unshare();
     normdata = (float*)in.data;
   }
   else {
@@ -135,19 +136,10 @@ void Transform::normalize( RawTile& in, const vector<float>& max, const vector<f
     }
   }
 
-  // Delete our original buffers, unless we already had floats
-  if( in.bpc == 32 && in.sampleType == FIXEDPOINT ){
-    delete[] (unsigned int*) in.data;
-  }
-  else if( in.bpc == 16 ){
-    delete[] (unsigned short*) in.data;
-  }
-  else if( in.bpc == 8 ){
-    delete[] (unsigned char*) in.data;
-  }
+  // Replace our original buffer, unless we already had floats
+  if( normdata != in.data ) in.adopt( normdata );
 
-  // Assign our new buffer and modify some info
-  in.data = normdata;
+  // Modify some info
   in.bpc = 32;
   in.dataLength = np * (in.bpc/8);
 
@@ -216,10 +208,8 @@ void Transform::shade( RawTile& in, int h_angle, int v_angle ){
   }
 
 
-  // Delete old data buffer
-  delete[] (float*) in.data;
-
-  in.data = buffer;
+  // Replace old data buffer
+  in.adopt( buffer );
   in.channels = 1;
   in.dataLength = in.width * in.height * (in.bpc/8);
 }
@@ -319,6 +309,9 @@ void Transform::LAB2sRGB( RawTile& in ){
 
   unsigned long np = in.width * in.height * in.channels;
 
+  // Conversion is done in place
+  in.unshare();
+
   // Parallelize code using OpenMP
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
@@ -456,9 +449,8 @@ void Transform::cmap( RawTile& in, enum cmap_type cmap ){
 
   };
 
-  // Delete old data buffer
-  delete[] (float*) in.data;
-  in.data = outptr;
+  // Replace old data buffer
+  in.adopt( outptr );
   in.channels = out_chan;
   in.dataLength = ndata * out_chan * (in.bpc/8);
 }
@@ -469,6 +461,7 @@ void Transform::cmap( RawTile& in, enum cmap_type cmap ){
 void Transform::inv( RawTile& in ){
 
   unsigned int np = in.dataLength * 8 / in.bpc;
+  in.unshare();
   float *infptr = (float*) in.data;
 
   // Loop through our pixels for floating values
@@ -488,52 +481,64 @@ void Transform::inv( RawTile& in ){
 // Resize image using nearest neighbour interpolation
 void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resampled_width, unsigned int resampled_height ){
 
+  // Create new buffer if size is larger than input size, otherwise resize in place
+  bool new_buffer = false;
+  if( resampled_width*resampled_height > in.width*in.height ) new_buffer = true;
+  else in.unshare();
+
   // Pointer to input buffer
   unsigned char *input = (unsigned char*) in.data;
 
   int channels = in.channels;
-  unsigned int width = in.width;
-  unsigned int height = in.height;
 
   // Pointer to output buffer
   unsigned char *output;
+  if( new_buffer ) output = new unsigned char[(unsigned long long)resampled_width*resampled_height*in.channels];
+  else output = input;
+
+  resample_nearestneighbour( input, in.width, in.height, 0, in.height, channels,
+			     output, resampled_width, resampled_height, 0, resampled_height );
+
+  // Replace original buffer
+  if( new_buffer ) in.adopt( output );
+
+  // Correctly set our Rawtile info
+  in.width = resampled_width;
+  in.height = resampled_height;
+  in.dataLength = resampled_width * resampled_height * channels * (in.bpc/8);
+}
 
-  // Create new buffer if size is larger than input size
-  bool new_buffer = false;
-  if( resampled_width*resampled_height > in.width*in.height ){
-    new_buffer = true;
-    output = new unsigned char[(unsigned long long)resampled_width*resampled_height*in.channels];
-  }
-  else output = (unsigned char*) in.data;
+
+
+// Resize a band of rows using nearest neighbour interpolation
+void Transform::resample_nearestneighbour( const unsigned char* input, unsigned int width, unsigned int height,
+					   unsigned int top, unsigned int rows, int channels,
+					   unsigned char* output, unsigned int resampled_width, unsigned int resampled_height,
+					   unsigned int start, unsigned int end ){
 
   // Calculate our scale
   float xscale = (float)width / (float)resampled_width;
   float yscale = (float)height / (float)resampled_height;
 
-  for( unsigned int j=0; j<resampled_height; j++ ){
+  for( unsigned int j=start; j<end; j++ ){
+
+    // Row within our band of input rows, limited to the rows we hold
+    unsigned long jj = (unsigned int) floorf(j*yscale);
+    jj = (jj < top) ? 0 : ( (jj-top < rows) ? jj-top : rows-1 );
+
     for( unsigned int i=0; i<resampled_width; i++ ){
 
       // Indexes in the current pyramid resolution and resampled spaces
       // Make sure to limit our input index to the image surface
       unsigned long ii = (unsigned int) floorf(i*xscale);
-      unsigned long jj = (unsigned int) floorf(j*yscale);
       unsigned long pyramid_index = (unsigned int) channels * ( ii + jj*width );
 
-      unsigned long long resampled_index = (unsigned long long)(i + j*resampled_width)*channels;
-      for( int k=0; k<in.channels; k++ ){
+      unsigned long long resampled_index = (unsigned long long)(i + (j-start)*resampled_width)*channels;
+      for( int k=0; k<channels; k++ ){
 	output[resampled_index+k] = input[pyramid_index+k];
       }
     }
   }
-
-  // Delete original buffer
-  if( new_buffer ) delete[] (unsigned char*) input;
-
-  // Correctly set our Rawtile info
-  in.width = resampled_width;
-  in.height = resampled_height;
-  in.dataLength = resampled_width * resampled_height * channels * (in.bpc/8);
-  in.data = output;
 }
 
 
@@ -542,17 +547,31 @@ void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resample
 //  - Floating point implementation which benchmarks about 2.5x slower than nearest neighbour
 void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width, unsigned int resampled_height ){
 
-  // Pointer to input buffer
-  unsigned char *input = (unsigned char*) in.data;
-
   int channels = in.channels;
-  unsigned int width = in.width;
-  unsigned int height = in.height;
-  unsigned long np = in.channels * in.width * in.height;
 
   // Create new buffer and pointer for our output - make sure we have enough digits via unsigned long long
   unsigned char *output = new unsigned char[(unsigned long long)resampled_width*resampled_height*in.channels];
 
+  resample_bilinear( (unsigned char*) in.data, in.width, in.height, 0, in.height, channels,
+		     output, resampled_width, resampled_height, 0, resampled_height );
+
+  // Replace original buffer
+  in.adopt( output );
+
+  // Correctly set our Rawtile info
+  in.width = resampled_width;
+  in.height = resampled_height;
+  in.dataLength = resampled_width * resampled_height * channels * (in.bpc/8);
+}
+
+
+
+// Resize a band of rows using bilinear interpolation
+void Transform::resample_bilinear( const unsigned char* input, unsigned int width, unsigned int height,
+				   unsigned int top, unsigned int rows, int channels,
+				   unsigned char* output, unsigned int resampled_width, unsigned int resampled_height,
+				   unsigned int start, unsigned int end ){
+
   // Calculate our scale
   float xscale = (float)(width) / (float)resampled_width;
   float yscale = (float)(height) / (float)resampled_height;
@@ -562,9 +581,9 @@ void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width,
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
 #elif defined(_OPENMP)
-#pragma omp parallel for if( resampled_width*resampled_height > PARALLEL_THRESHOLD )
+#pragma omp parallel for if( resampled_width*(end-start) > PARALLEL_THRESHOLD )
 #endif
-  for( unsigned int j=0; j<resampled_height; j++ ){
+  for( unsigned int j=start; j<end; j++ ){
 
     // Index to the current pyramid resolution's top left pixel
     int jj = (int) floor( j*yscale );
@@ -574,23 +593,26 @@ void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width,
     float c = (float)(jj+1) - jscale;
     float d = jscale - (float)jj;
 
+    // Rows within our band of input rows - use replication at the edge
+    unsigned long j1 = ( (unsigned int) jj < top ) ? 0 : jj - top;
+    if( j1 >= rows ) j1 = rows - 1;
+    unsigned long j2 = ( (unsigned int) jj+1 < height && j1+1 < rows ) ? j1+1 : j1;
+
     for( unsigned int i=0; i<resampled_width; i++ ){
 
       // Index to the current pyramid resolution's top left pixel
       int ii = (int) floor( i*xscale );
 
-      // Calculate the indices of the 4 surrounding pixels
-      unsigned long p11, p12, p21, p22;
-      unsigned long jj_w = jj*width;
-      p11 = (unsigned long) ( channels * ( ii + jj_w ) );
-      p12 = (unsigned long) ( channels * ( ii + (jj_w+width) ) );
-      p21 = (unsigned long) ( channels * ( (ii+1) + jj_w ) );
-      p22 = (unsigned long) ( channels * ( (ii+1) + (jj_w+width) ) );
-
       // Make sure we don't stray outside our input buffer boundary
       // - use replication at the edge
-      p12 = (p12<=np)? p12 : np-channels;
-      p22 = (p22<=np)? p22 : np-channels;
+      unsigned long i2 = ( (unsigned int) ii+1 < width ) ? ii+1 : ii;
+
+      // Calculate the indices of the 4 surrounding pixels
+      unsigned long p11, p12, p21, p22;
+      p11 = (unsigned long) ( channels * ( ii + j1*width ) );
+      p12 = (unsigned long) ( channels * ( ii + j2*width ) );
+      p21 = (unsigned long) ( channels * ( i2 + j1*width ) );
+      p22 = (unsigned long) ( channels * ( i2 + j2*width ) );
 
       // Calculate the rest of our weights
       float iscale = i*xscale;
@@ -598,9 +620,9 @@ void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width,
       float b = iscale - (float)ii;
 
       // Output buffer index
-      unsigned long long resampled_index = (unsigned long long)( (j*resampled_width + i) * in.channels );
+      unsigned long long resampled_index = (unsigned long long)( ((j-start)*resampled_width + i) * channels );
 
-      for( int k=0; k<in.channels; k++ ){
+      for( int k=0; k<channels; k++ ){
 	float tx = input[p11+k]*a + input[p21+k]*b;
 	float ty = input[p12+k]*a + input[p22+k]*b;
 	unsigned char r = (unsigned char)( c*tx + d*ty );
@@ -608,15 +630,59 @@ void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width,
       }
     }
   }
+}
 
-  // Delete original buffer
-  delete[] (unsigned char*) input;
 
-  // Correctly set our Rawtile info
-  in.width = resampled_width;
-  in.height = resampled_height;
-  in.dataLength = resampled_width * resampled_height * channels * (in.bpc/8);
-  in.data = output;
+
+// Resize the next band of rows of an image being resized a band at a time
+void Transform::resample_band( RawTile& band, unsigned int top, unsigned int height,
+			       unsigned int resampled_width, unsigned int resampled_height, int interpolation,
+			       unsigned int& next, std::vector<unsigned char>& carry ){
+
+  float yscale = (float)height / (float)resampled_height;
+  unsigned int bottom = top + band.height;
+
+  // Find the output rows for which we now hold all the input rows
+  unsigned int last = next;
+  while( last < resampled_height ){
+    unsigned int jj = (unsigned int) floorf( last*yscale );
+    if( interpolation != 0 && jj+1 < height ) jj++;
+    if( jj >= bottom ) break;
+    last++;
+  }
+
+  // Prepend the last row of our previous band if our first output row needs it
+  unsigned int row = band.width * band.channels;
+  const unsigned char* input = (const unsigned char*) band.data;
+  unsigned int first = top;
+  std::vector<unsigned char> joined;
+  if( last > next && !carry.empty() && (unsigned int) floorf( next*yscale ) < top ){
+    joined.reserve( carry.size() + band.dataLength );
+    joined.insert( joined.end(), carry.begin(), carry.end() );
+    joined.insert( joined.end(), input, input + band.dataLength );
+    input = &joined[0];
+    first = top - 1;
+  }
+
+  RawTile strip( 0, band.resolution, band.hSequence, band.vSequence,
+		 resampled_width, last-next, band.channels, 8 );
+  strip.dataLength = resampled_width * (last-next) * band.channels;
+
+  if( last > next ){
+    strip.allocate( strip.dataLength );
+    if( interpolation == 0 ){
+      resample_nearestneighbour( input, band.width, height, first, bottom-first, band.channels,
+				 (unsigned char*) strip.data, resampled_width, resampled_height, next, last );
+    }
+    else{
+      resample_bilinear( input, band.width, height, first, bottom-first, band.channels,
+			 (unsigned char*) strip.data, resampled_width, resampled_height, next, last );
+    }
+  }
+
+  carry.assign( (const unsigned char*) band.data + (band.height-1)*row, (const unsigned char*) band.data + band.height*row );
+  next = last;
+  band = strip;
 }
 
 
@@ -639,8 +705,7 @@ void Transform::contrast( RawTile& in, float c ){
   }
 
   // Replace original buffer with new
-  delete[] (float*) in.data;
-  in.data = buffer;
+  in.adopt( buffer );
   in.bpc = 8;
   in.dataLength = np * (in.bpc/8);
 }
@@ -653,6 +718,7 @@ void Transform::gamma( RawTile& in, float g ){
   if( g == 1.0 ) return;
 
   unsigned int np = in.width * in.height * in.channels;
+  in.unshare();
   float* infptr = (float*)in.data;
 
   // Loop through our pixels for floating values
@@ -676,6 +742,7 @@ void Transform::log( RawTile& in ){
   float scale = 1.0 / logf( 2.0 );
 
   unsigned int np = in.width * in.height * in.channels;
+  in.unshare();
 
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
@@ -700,7 +767,7 @@ void Transform::rotate( RawTile& in, float angle=0.0 ){
     unsigned int n = 0;
 
     // Allocate memory for our temporary buffer - rotate function only ever operates on 8bit data
-    void *buffer = new unsigned char[in.width*in.height*in.channels];
+    unsigned char *buffer = new unsigned char[in.width*in.height*in.channels];
 
     // Rotate 90
     if( (int) angle % 360 == 90 ){
@@ -748,11 +815,8 @@ void Transform::rotate( RawTile& in, float angle=0.0 ){
       }
     }
 
-    // Delete old data buffer
-    delete[] (unsigned char*) in.data;
-
-    // Assign new data to Rawtile
-    in.data = buffer;
+    // Replace old data buffer with our new data
+    in.adopt( buffer );
 
     // For 90 and 270 rotation swap width and height
     if( (int)angle % 180 == 90 ){
@@ -790,9 +854,8 @@ void Transform::greyscale( RawTile& rawtile ){
     buffer[i] = (unsigned char)( ( 1254097*R + 2462056*G + 478151*B ) >> 22 );
   }
 
-  // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) rawtile.data;
-  rawtile.data = (void*) buffer;
+  // Replace our old data buffer with our grayscale data
+  rawtile.adopt( buffer );
 
   // Update our number of channels and data length
   rawtile.channels = 1;
@@ -806,6 +869,9 @@ void Transform::twist( RawTile& rawtile, const vector< vector<float> >& matrix )
 
   unsigned long np = rawtile.width * rawtile.height;
 
+  // Values are written back in place
+  rawtile.unshare();
+
   // Create temporary buffer for our calculated values
   float* pixel = new float[rawtile.channels];
 
@@ -859,6 +925,8 @@ void Transform::flatten( RawTile& in, int bands ){
   unsigned long no = 0;
   unsigned int gap = in.channels - bands;
 
+  in.unshare();
+
   // Simply loop through assigning to the same buffer
   for( unsigned long i=0; i<np; i++ ){
     for( int k=0; k<bands; k++ ){
@@ -913,9 +981,8 @@ void Transform::flip( RawTile& rawtile, int orientation ){
     }
   }
 
-  // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) rawtile.data;
-  rawtile.data = (void*) buffer;
+  // Replace our old data buffer with our flipped data
+  rawtile.adopt( buffer );
 }
 
 
@@ -1001,6 +1068,7 @@ void Transform::binary( RawTile &in, unsigned char threshold ){
   this->greyscale( in );
 
   unsigned int np = in.width * in.height;
+  in.unshare();
 
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
@@ -1046,6 +1114,7 @@ void Transform::equalize( RawTile& in, vector<unsigned int>& histogram ){
   }
 
   // Map image through cumulative histogram
+  in.unshare();
 #if defined(__ICC) || defined(__INTEL_COMPILER)
 #pragma ivdep
 #elif defined(_OPENMP)
@@ -124,6 +124,54 @@ struct Transform {
   void interpolate_bilinear( RawTile& in, unsigned int w, unsigned int h );
 
 
+  /// Resize a band of rows of an 8 bit image using nearest neighbour interpolation
+  /** Produces the same output rows as resizing the whole image, so that large images can be
+      resized a band at a time
+      @param input buffer holding rows top to top+rows-1 of our image
+      @param width image width
+      @param height image height
+      @param top first image row held in input
+      @param rows number of image rows held in input
+      @param channels number of channels
+      @param output buffer for our output rows
+      @param w target width
+      @param h target height
+      @param start first output row to produce
+      @param end output row after the last to produce
+  */
+  void resample_nearestneighbour( const unsigned char* input, unsigned int width, unsigned int height,
+				  unsigned int top, unsigned int rows, int channels,
+				  unsigned char* output, unsigned int w, unsigned int h,
+				  unsigned int start, unsigned int end );
+
+
+  /// Resize a band of rows of an 8 bit image using bilinear interpolation
+  /** Each output row requires the two input rows surrounding it. Parameters are as for
+      resample_nearestneighbour()
+  */
+  void resample_bilinear( const unsigned char* input, unsigned int width, unsigned int height,
+			  unsigned int top, unsigned int rows, int channels,
+			  unsigned char* output, unsigned int w, unsigned int h,
+			  unsigned int start, unsigned int end );
+
+
+  /// Resize the next band of rows of an 8 bit image, as part of resizing an image a band at a time
+  /** Bands must be given in order from the top of the image. Each produces the output rows for
+      which all the input rows needed are held, including the last row of the previous band
+      @param band band of input rows, replaced by the output rows it completes
+      @param top first image row held in band
+      @param height image height
+      @param w target width
+      @param h target height
+      @param interpolation 0 for nearest neighbour, otherwise bilinear
+      @param next next output row to produce, advanced past the rows produced
+      @param carry last row of the previous band, replaced by the last row of this band
+  */
+  void resample_band( RawTile& band, unsigned int top, unsigned int height,
+		      unsigned int w, unsigned int h, int interpolation,
+		      unsigned int& next, std::vector<unsigned char>& carry );
+
+
   /// Rotate image - currently only by 90, 180 or 270 degrees, other values will do nothing
   /** @param in tile input data
       @param angle angle of rotation - currently only rotations by 90, 180 and 270 degrees